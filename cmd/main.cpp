@@ -1,4 +1,5 @@
 #include <evogen/Block.h>
+#include <evogen/BlockHandle.h>
 #include <evogen/Generator.h>
 #include <evogen/Image.h>
 #include <evogen/Structure.h>
@@ -21,10 +22,12 @@ int main()
     world.fill_blocks_at({11, 11, 11}, {-11, 50, -11}, evo::VanillaBlock::Stone);
     world.fill_blocks_outline({-50, 50, -50}, {-40, 40, -40}, evo::VanillaBlock::OakPlanks);
     world.fill_blocks_hollow({50, 50, 50}, {40, 40, 40}, evo::VanillaBlock::OakLog, evo::VanillaBlock::Podzol);
-    world.fill_blocks_if({50, 100, 50}, {40, 140, 40}, [](auto& offset)->std::optional<evo::Block> {
-        if(abs(offset.x % 2) == abs(offset.y % 2))
-            return {evo::VanillaBlock::OakLog};
-        return {evo::VanillaBlock::Stone};
+    evo::BlockHandle oak_log = evo::VanillaBlock::OakLog;
+    evo::BlockHandle stone = evo::VanillaBlock::Stone;
+    world.fill_blocks_by_row({50, 100, 50}, {40, 140, 40}, [&](auto& offset, int count, evo::BlockHandle* blocks) {
+        auto block = abs(offset.x % 2) == abs(offset.y % 2) ? oak_log : stone;
+        for(int z = 0; z < count; z++)
+            blocks[z] = block;
     });
 
     evo::Structure structure;
@@ -45,8 +48,7 @@ int main()
     world.fill_cylinder({-25, 40, -25}, 10, 10, evo::VanillaBlock::AcaciaPlanks);
 
     evo::Generator generator;
-    generator.load_from_world(world);
-    generator.generate_to_file("functions/output.mcfunction");
+    generator.stream_from_world_to_file(world, "functions/output.mcfunction");
     return 0;
 }
 
@@ -0,0 +1,441 @@
+#include <evogen/AnvilReader.h>
+
+#include <evogen/BlockContainer.h>
+#include <evogen/NBTReader.h>
+#include <evogen/Parallel.h>
+
+#include <bit>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+namespace evo
+{
+
+using TagType = NBTReader::TagType;
+
+static constexpr int SECTION_SIZE = 16;
+static constexpr int SECTION_VOLUME = SECTION_SIZE * SECTION_SIZE * SECTION_SIZE;
+static constexpr int REGION_SIZE = 32;
+static constexpr size_t SECTOR_SIZE = 4096;
+// Since 1.16 (20w17a), values in long arrays don't span two longs.
+static constexpr int32_t FIRST_ALIGNED_DATA_VERSION = 2529;
+
+static int floor_divide(int value, int divisor)
+{
+    return (value < 0 ? value - divisor + 1 : value) / divisor;
+}
+
+namespace
+{
+
+// Location of a chunk's data in a region file.
+struct ChunkLocation
+{
+    int x;
+    int z;
+    uint8_t const* data;
+    size_t size;
+    uint8_t compression;
+};
+
+// Part of a section inside the requested box. Indices are X, Z, Y ordered, like in
+// sections; a uniform section has no indices.
+struct DecodedSection
+{
+    Vector<int> origin;
+    Vector<int> size;
+    std::vector<BlockHandle> palette;
+    std::vector<uint32_t> indices;
+};
+
+struct RawSection
+{
+    int y = 0;
+    std::vector<BlockHandle> palette;
+    std::vector<uint64_t> data;
+};
+
+}
+
+AnvilReader::~AnvilReader()
+{
+    for(auto& it: m_regions)
+    {
+        if(it.second.data)
+            munmap(const_cast<uint8_t*>(it.second.data), it.second.size);
+    }
+}
+
+AnvilReader::Region const* AnvilReader::region_at(int x, int z)
+{
+    auto result = m_regions.try_emplace({x, z});
+    auto& region = result.first->second;
+    if(result.second)
+    {
+        auto path = m_directory + "/r." + std::to_string(x) + "." + std::to_string(z) + ".mca";
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return nullptr;
+        struct stat info;
+        if(fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= 2 * SECTOR_SIZE)
+        {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data != MAP_FAILED)
+            {
+                region.data = static_cast<uint8_t const*>(data);
+                region.size = info.st_size;
+            }
+        }
+        close(fd);
+    }
+    return region.data ? &region : nullptr;
+}
+
+static bool decompress(uint8_t const* data, size_t size, std::vector<uint8_t>& output)
+{
+    z_stream stream{};
+    // Detects zlib and gzip headers.
+    if(inflateInit2(&stream, 15 + 32) != Z_OK)
+        return false;
+    stream.next_in = const_cast<uint8_t*>(data);
+    stream.avail_in = size;
+    output.resize(std::max<size_t>(output.capacity(), size * 4));
+    int result = Z_OK;
+    while(result == Z_OK)
+    {
+        if(stream.total_out == output.size())
+            output.resize(output.size() * 2);
+        stream.next_out = output.data() + stream.total_out;
+        stream.avail_out = output.size() - stream.total_out;
+        result = inflate(&stream, Z_NO_FLUSH);
+    }
+    output.resize(stream.total_out);
+    inflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+static bool is_air(BlockHandle block)
+{
+    auto& id = block.block().id();
+    return id == "minecraft:air" || id == "minecraft:cave_air" || id == "minecraft:void_air" || id == "air";
+}
+
+// Reads a section compound (1.18+: Y, block_states{palette, data}; older: Y, Palette, BlockStates).
+static bool read_section(NBTReader& reader, RawSection& section)
+{
+    TagType type;
+    std::string name;
+    int depth = 1;
+    while(depth > 0)
+    {
+        if(!reader.read_tag_header(type, name))
+            return false;
+        if(type == TagType::End)
+        {
+            depth--;
+            continue;
+        }
+        int64_t value;
+        if(name == "block_states" && type == TagType::Compound)
+            depth++;
+        else if(name == "Y")
+        {
+            if(!reader.read_integer(type, value))
+                return false;
+            section.y = value;
+        }
+        else if((name == "palette" || name == "Palette") && type == TagType::List)
+        {
+            if(!read_block_state_palette(reader, section.palette))
+                return false;
+        }
+        else if((name == "data" || name == "BlockStates") && type == TagType::LongArray)
+        {
+            if(!reader.read_long_array(section.data))
+                return false;
+        }
+        else if(!reader.skip(type))
+            return false;
+    }
+    return true;
+}
+
+// Decodes the parts of sections of a chunk that are inside the box between `min` and `max`.
+static bool decode_chunk(ChunkLocation const& location, Vector<int> const& min, Vector<int> const& max,
+                         bool skip_air, std::vector<DecodedSection>& sections, std::string& error)
+{
+    thread_local std::vector<uint8_t> buffer;
+    uint8_t const* data = location.data;
+    size_t size = location.size;
+    switch(location.compression)
+    {
+        case 1: // gzip
+        case 2: // zlib
+            if(!decompress(data, size, buffer))
+            {
+                error = "Invalid compressed data";
+                return false;
+            }
+            data = buffer.data();
+            size = buffer.size();
+            break;
+        case 3: // uncompressed
+            break;
+        default:
+            error = "Unsupported compression type " + std::to_string(location.compression);
+            return false;
+    }
+
+    NBTReader reader(data, size);
+    TagType type;
+    std::string name;
+    std::vector<RawSection> raw_sections;
+    int32_t data_version = 0;
+    if(!reader.read_root(type, name) || type != TagType::Compound)
+    {
+        error = reader.failed() ? reader.error() : "Root tag must be a compound";
+        return false;
+    }
+    // Before 1.18, everything is in a "Level" compound.
+    int depth = 1;
+    while(depth > 0 && !reader.failed())
+    {
+        if(!reader.read_tag_header(type, name))
+            break;
+        if(type == TagType::End)
+        {
+            depth--;
+            continue;
+        }
+        if(name == "Level" && type == TagType::Compound)
+            depth++;
+        else if(name == "DataVersion" && type == TagType::Int)
+            reader.read_int(data_version);
+        else if((name == "sections" || name == "Sections") && type == TagType::List)
+        {
+            TagType element_type;
+            int32_t length;
+            if(!reader.read_list_header(element_type, length))
+                break;
+            if(length > 0 && element_type != TagType::Compound)
+            {
+                reader.fail("Sections must be a list of compounds");
+                break;
+            }
+            raw_sections.resize(length);
+            for(auto& section: raw_sections)
+            {
+                if(!read_section(reader, section))
+                    break;
+            }
+        }
+        else
+            reader.skip(type);
+    }
+    if(reader.failed())
+    {
+        error = reader.error();
+        return false;
+    }
+
+    thread_local std::vector<uint32_t> values(SECTION_VOLUME);
+    for(auto& section: raw_sections)
+    {
+        // Sections without a palette are empty (or from before 1.13).
+        if(section.palette.empty())
+            continue;
+        Vector<int> origin{location.x * SECTION_SIZE, section.y * SECTION_SIZE, location.z * SECTION_SIZE};
+        Vector<int> start{std::max(min.x, origin.x), std::max(min.y, origin.y), std::max(min.z, origin.z)};
+        Vector<int> end{std::min(max.x, origin.x + SECTION_SIZE - 1), std::min(max.y, origin.y + SECTION_SIZE - 1), std::min(max.z, origin.z + SECTION_SIZE - 1)};
+        if(start.x > end.x || start.y > end.y || start.z > end.z)
+            continue;
+
+        auto& decoded = sections.emplace_back();
+        decoded.origin = start;
+        decoded.size = end - start + Vector<int>{1, 1, 1};
+        decoded.palette = std::move(section.palette);
+        if(skip_air)
+        {
+            for(auto& block: decoded.palette)
+            {
+                if(is_air(block))
+                    block = BlockHandle();
+            }
+        }
+        if(decoded.palette.size() == 1)
+            continue;
+
+        unsigned bits = std::max<unsigned>(4, std::bit_width(decoded.palette.size() - 1));
+        uint64_t mask = (uint64_t{1} << bits) - 1;
+        auto& words = section.data;
+        if(data_version >= FIRST_ALIGNED_DATA_VERSION)
+        {
+            size_t per_word = 64 / bits;
+            if(words.size() != (SECTION_VOLUME + per_word - 1) / per_word)
+            {
+                error = "Invalid block state array length " + std::to_string(words.size());
+                return false;
+            }
+            size_t index = 0;
+            for(auto word: words)
+            {
+                for(size_t count = 0; count < per_word && index < SECTION_VOLUME; count++, word >>= bits)
+                    values[index++] = word & mask;
+            }
+        }
+        else
+        {
+            if(words.size() * 64 < SECTION_VOLUME * bits)
+            {
+                error = "Invalid block state array length " + std::to_string(words.size());
+                return false;
+            }
+            for(size_t index = 0, bit = 0; index < SECTION_VOLUME; index++, bit += bits)
+            {
+                auto value = words[bit >> 6] >> (bit & 63);
+                if((bit & 63) + bits > 64)
+                    value |= words[(bit >> 6) + 1] << (64 - (bit & 63));
+                values[index] = value & mask;
+            }
+        }
+
+        auto offset = start - origin;
+        decoded.indices.reserve(static_cast<size_t>(decoded.size.x) * decoded.size.y * decoded.size.z);
+        for(int y = offset.y; y < offset.y + decoded.size.y; y++)
+        {
+            for(int z = offset.z; z < offset.z + decoded.size.z; z++)
+            {
+                auto row = values.data() + (y * SECTION_SIZE + z) * SECTION_SIZE;
+                decoded.indices.insert(decoded.indices.end(), row + offset.x, row + offset.x + decoded.size.x);
+            }
+        }
+    }
+    return true;
+}
+
+// Data of chunks saved outside of the region file (c.<x>.<z>.mcc), when it's too large.
+static bool read_external_chunk(std::string const& path, std::vector<uint8_t>& data)
+{
+    std::ifstream file(path, std::ios::binary);
+    if(!file)
+        return false;
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+bool AnvilReader::read_box(Vector<int> const& start, Vector<int> const& end, BlockContainer& container, Vector<int> const& offset)
+{
+    Vector<int> min{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
+    Vector<int> max{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+    int min_chunk_x = floor_divide(min.x, SECTION_SIZE), max_chunk_x = floor_divide(max.x, SECTION_SIZE);
+    int min_chunk_z = floor_divide(min.z, SECTION_SIZE), max_chunk_z = floor_divide(max.z, SECTION_SIZE);
+
+    // Chunks present in region files, region by region.
+    std::vector<ChunkLocation> locations;
+    std::vector<std::vector<uint8_t>> external_chunks;
+    bool success = true;
+    for(int region_x = floor_divide(min_chunk_x, REGION_SIZE); region_x <= floor_divide(max_chunk_x, REGION_SIZE); region_x++)
+    {
+        for(int region_z = floor_divide(min_chunk_z, REGION_SIZE); region_z <= floor_divide(max_chunk_z, REGION_SIZE); region_z++)
+        {
+            auto region = region_at(region_x, region_z);
+            if(!region)
+                continue;
+            for(int chunk_x = std::max(min_chunk_x, region_x * REGION_SIZE); chunk_x <= std::min(max_chunk_x, region_x * REGION_SIZE + REGION_SIZE - 1); chunk_x++)
+            {
+                for(int chunk_z = std::max(min_chunk_z, region_z * REGION_SIZE); chunk_z <= std::min(max_chunk_z, region_z * REGION_SIZE + REGION_SIZE - 1); chunk_z++)
+                {
+                    auto entry = region->data + ((chunk_x - region_x * REGION_SIZE) + (chunk_z - region_z * REGION_SIZE) * REGION_SIZE) * 4;
+                    size_t position = (entry[0] << 16 | entry[1] << 8 | entry[2]) * SECTOR_SIZE;
+                    if(position == 0)
+                        continue;
+                    uint8_t const* chunk_data = nullptr;
+                    uint32_t length = 0;
+                    if(position + 5 <= region->size)
+                    {
+                        chunk_data = region->data + position;
+                        length = chunk_data[0] << 24 | chunk_data[1] << 16 | chunk_data[2] << 8 | chunk_data[3];
+                    }
+                    if(length == 0 || position + 4 + length > region->size)
+                    {
+                        std::cerr << "Invalid chunk " << chunk_x << " " << chunk_z << " in region " << region_x << " " << region_z << std::endl;
+                        success = false;
+                        continue;
+                    }
+                    uint8_t compression = chunk_data[4];
+                    if(compression & 0x80)
+                    {
+                        auto path = m_directory + "/c." + std::to_string(chunk_x) + "." + std::to_string(chunk_z) + ".mcc";
+                        auto& external = external_chunks.emplace_back();
+                        if(!read_external_chunk(path, external))
+                        {
+                            std::cerr << "Could not read " << path << std::endl;
+                            success = false;
+                            continue;
+                        }
+                        locations.push_back({chunk_x, chunk_z, external.data(), external.size(), static_cast<uint8_t>(compression & 0x7f)});
+                    }
+                    else
+                        locations.push_back({chunk_x, chunk_z, chunk_data + 5, length - 1, compression});
+                }
+            }
+        }
+    }
+
+    // Chunks are decoded in parallel batches, then copied to the container in order.
+    std::vector<std::vector<DecodedSection>> decoded(std::min(DECODE_BATCH_SIZE, locations.size()));
+    std::vector<std::string> errors(decoded.size());
+    for(size_t batch_start = 0; batch_start < locations.size(); batch_start += DECODE_BATCH_SIZE)
+    {
+        size_t batch_end = std::min(batch_start + DECODE_BATCH_SIZE, locations.size());
+        parallel_for(batch_end - batch_start, m_options.thread_count, [&](size_t index) {
+            decoded[index].clear();
+            errors[index].clear();
+            if(!decode_chunk(locations[batch_start + index], min, max, m_options.skip_air, decoded[index], errors[index]) && errors[index].empty())
+                errors[index] = "Invalid chunk";
+        });
+
+        for(size_t index = batch_start; index < batch_end; index++)
+        {
+            auto& location = locations[index];
+            if(!errors[index - batch_start].empty())
+            {
+                std::cerr << "Error reading chunk " << location.x << " " << location.z << ": " << errors[index - batch_start] << std::endl;
+                success = false;
+                continue;
+            }
+            for(auto& section: decoded[index - batch_start])
+            {
+                auto origin = section.origin + offset;
+                if(section.indices.empty())
+                {
+                    if(section.palette[0].is_valid())
+                        container.fill_blocks_at(origin, origin + section.size - Vector<int>{1, 1, 1}, section.palette[0]);
+                    continue;
+                }
+                size_t position = 0;
+                bool result = container.set_blocks_from_indices(origin, section.size, section.palette, [&](uint32_t* output, size_t count) {
+                    memcpy(output, section.indices.data() + position, count * sizeof(uint32_t));
+                    position += count;
+                    return true;
+                });
+                if(!result)
+                {
+                    std::cerr << "Error reading chunk " << location.x << " " << location.z << ": Invalid palette index" << std::endl;
+                    success = false;
+                }
+            }
+        }
+    }
+    return success;
+}
+
+}
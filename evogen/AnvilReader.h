@@ -0,0 +1,66 @@
+#pragma once
+
+#include <evogen/Vector.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace evo
+{
+
+class BlockContainer;
+
+// Reads blocks from Anvil region files (r.<x>.<z>.mca) of an existing world, the
+// counterpart of AnvilWriter. Supports the chunk formats of Minecraft 1.16+ (and
+// older ones with block state palettes, since 1.13).
+//
+// Region files are memory-mapped when first needed, and only chunks intersecting
+// the requested box are decompressed and decoded (in parallel).
+class AnvilReader
+{
+public:
+    struct Options
+    {
+        // Threads used for decoding chunks. 0 = all hardware threads.
+        unsigned thread_count = 0;
+        // Store air as Empty, so that it isn't placed.
+        bool skip_air = false;
+    };
+
+    // `directory` is the "region" directory of a save.
+    explicit AnvilReader(std::string const& directory)
+    : m_directory(directory) {}
+    AnvilReader(std::string const& directory, Options const& options)
+    : m_directory(directory), m_options(options) {}
+    ~AnvilReader();
+
+    AnvilReader(AnvilReader const&) = delete;
+    AnvilReader& operator=(AnvilReader const&) = delete;
+
+    // Copies blocks of the box between `start` and `end` (inclusive, world coordinates)
+    // to `container`, moved by `offset`. Missing regions and chunks are skipped.
+    // Returns false if a chunk couldn't be read.
+    bool read_box(Vector<int> const& start, Vector<int> const& end, BlockContainer& container, Vector<int> const& offset = {});
+
+    // Chunks decoded at once. Decoded chunks are copied to the container between batches.
+    static constexpr size_t DECODE_BATCH_SIZE = 64;
+
+private:
+    struct Region
+    {
+        uint8_t const* data = nullptr;
+        size_t size = 0;
+    };
+
+    // Null if the region file doesn't exist.
+    Region const* region_at(int x, int z);
+
+    std::string m_directory;
+    Options m_options;
+    std::map<std::pair<int, int>, Region> m_regions;
+};
+
+}
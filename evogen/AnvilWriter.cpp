@@ -0,0 +1,357 @@
+#include <evogen/AnvilWriter.h>
+
+#include <evogen/NBTWriter.h>
+#include <evogen/Parallel.h>
+#include <evogen/World.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <zlib.h>
+
+namespace evo
+{
+
+using TagType = NBTWriter::TagType;
+
+// Minecraft chunks are columns of 16^3 sections, and regions are 32x32 chunks.
+static constexpr int SECTION_SIZE = 16;
+static constexpr int SECTION_VOLUME = SECTION_SIZE * SECTION_SIZE * SECTION_SIZE;
+static constexpr int REGION_SIZE = 32;
+static constexpr size_t SECTOR_SIZE = 4096;
+// Sections per side of our chunk, and our chunks per side of a region.
+static constexpr int SECTIONS_PER_CHUNK = Chunk::SIZE / SECTION_SIZE;
+static constexpr int CHUNKS_PER_REGION = REGION_SIZE * SECTION_SIZE / Chunk::SIZE;
+static_assert(Chunk::SIZE % SECTION_SIZE == 0);
+
+static int floor_divide(int value, int divisor)
+{
+    return (value < 0 ? value - divisor + 1 : value) / divisor;
+}
+
+static std::vector<uint8_t> encode_palette_entry(Block const& block)
+{
+    NBTWriter writer;
+    write_block_state(writer, block);
+    return std::move(writer.data());
+}
+
+static bool is_air(std::string id)
+{
+    if(id.find(':') == std::string::npos)
+        id = "minecraft:" + id;
+    return id == "minecraft:air" || id == "minecraft:cave_air" || id == "minecraft:void_air";
+}
+
+// Packs values into longs like Minecraft (1.16+) does: values don't span two longs.
+static std::vector<uint64_t> pack_values(uint32_t const* values, size_t count, unsigned bits)
+{
+    size_t per_long = 64 / bits;
+    uint64_t mask = (uint64_t{1} << bits) - 1;
+    std::vector<uint64_t> result((count + per_long - 1) / per_long);
+    for(size_t index = 0; index < count; index++)
+        result[index / per_long] |= (values[index] & mask) << (index % per_long * bits);
+    return result;
+}
+
+namespace
+{
+
+// Our chunks in one X/Z column, sorted by Y, with the palette entry of every
+// descriptor of their palettes.
+struct Column
+{
+    int x;
+    int z;
+    std::vector<std::pair<int, Chunk const*>> chunks;
+};
+
+}
+
+bool AnvilWriter::write(World const& world)
+{
+    m_statistics = {};
+    int min_section = floor_divide(m_options.min_y, SECTION_SIZE);
+    int end_section = min_section + m_options.height / SECTION_SIZE;
+    unsigned height_bits = std::bit_width(static_cast<unsigned>(m_options.height));
+
+    // Palette entries of all descriptors used in the world, encoded once. Entry 0 is
+    // air, used for Empty and Height descriptors too.
+    m_palette_entries.clear();
+    m_palette_entries.push_back({encode_palette_entry(Block("air")), true});
+    auto key_of = [](BlockDescriptor descriptor) { return static_cast<uint32_t>(descriptor.kind) << 16 | descriptor.arg; };
+    std::unordered_map<uint32_t, uint32_t> descriptor_to_entry;
+    std::unordered_map<BlockHandle, uint32_t> block_to_entry;
+
+    std::map<std::pair<int, int>, Column> columns;
+    for(auto& [position, chunk]: world.chunks())
+    {
+        for(auto descriptor: chunk.palette())
+        {
+            auto result = descriptor_to_entry.try_emplace(key_of(descriptor), 0);
+            if(!result.second || !descriptor.is_placeable())
+                continue;
+            auto block = world.block_from_descriptor(descriptor);
+            if(!block.has_value())
+                continue;
+            auto entry = block_to_entry.try_emplace(*block, m_palette_entries.size());
+            if(entry.second)
+            {
+                m_palette_entries.push_back({encode_palette_entry(block->block()), is_air(block->block().id())});
+                if(!block->block().nbt().empty())
+                    m_statistics.blocks_without_nbt++;
+            }
+            result.first->second = entry.first->second;
+        }
+        auto& column = columns[{position.x, position.z}];
+        column.x = position.x;
+        column.z = position.z;
+        column.chunks.emplace_back(position.y, &chunk);
+    }
+
+    std::map<std::pair<int, int>, std::vector<Column*>> region_map;
+    for(auto& [position, column]: columns)
+    {
+        std::sort(column.chunks.begin(), column.chunks.end(), [](auto const& a, auto const& b) { return a.first < b.first; });
+        region_map[{floor_divide(column.x, CHUNKS_PER_REGION), floor_divide(column.z, CHUNKS_PER_REGION)}].push_back(&column);
+    }
+    std::vector<std::pair<std::pair<int, int>, std::vector<Column*>>> regions(region_map.begin(), region_map.end());
+
+    std::error_code error;
+    std::filesystem::create_directories(m_options.directory, error);
+    if(error)
+    {
+        std::cerr << "Could not create " << m_options.directory << ": " << error.message() << std::endl;
+        return false;
+    }
+
+    std::atomic<bool> success = true;
+    std::atomic<size_t> chunk_count = 0, section_count = 0, skipped_section_count = 0;
+    parallel_for(regions.size(), m_options.thread_count, [&](size_t region_index) {
+        auto& [region_position, region_columns] = regions[region_index];
+
+        // Compressed chunk data, by position in the region (x + z * 32).
+        std::vector<std::vector<uint8_t>> chunk_data(REGION_SIZE * REGION_SIZE);
+        std::vector<uint32_t> indices(SECTION_VOLUME);
+        std::vector<uint32_t> states(SECTION_VOLUME);
+        std::vector<uint32_t> heights(SECTION_SIZE * SECTION_SIZE);
+        std::vector<uint32_t> section_palette;
+        std::vector<uint32_t> chunk_entries;
+        std::vector<int32_t> entry_to_section_index(m_palette_entries.size(), -1);
+        NBTWriter sections;
+        NBTWriter chunk_writer;
+
+        for(auto column: region_columns)
+        {
+            for(int dx = 0; dx < SECTIONS_PER_CHUNK; dx++)
+            {
+                for(int dz = 0; dz < SECTIONS_PER_CHUNK; dz++)
+                {
+                    sections.clear();
+                    int sections_written = 0;
+                    std::fill(heights.begin(), heights.end(), 0);
+
+                    for(auto [chunk_y, chunk]: column->chunks)
+                    {
+                        chunk_entries.clear();
+                        bool all_air = true;
+                        for(auto descriptor: chunk->palette())
+                        {
+                            chunk_entries.push_back(descriptor_to_entry.at(key_of(descriptor)));
+                            all_air = all_air && m_palette_entries[chunk_entries.back()].is_air;
+                        }
+                        if(all_air)
+                            continue;
+
+                        for(int dy = 0; dy < SECTIONS_PER_CHUNK; dy++)
+                        {
+                            // Our chunks are X, Y, Z ordered, sections Y, Z, X ordered.
+                            Vector<unsigned> start{static_cast<unsigned>(dx * SECTION_SIZE), static_cast<unsigned>(dy * SECTION_SIZE), static_cast<unsigned>(dz * SECTION_SIZE)};
+                            chunk->get_indices_at(start, start + Vector<unsigned>{SECTION_SIZE - 1, SECTION_SIZE - 1, SECTION_SIZE - 1}, indices.data());
+                            int section_y = chunk_y * SECTIONS_PER_CHUNK + dy;
+                            // Sections outside of the world must not touch the heightmap either.
+                            if(section_y < min_section || section_y >= end_section)
+                            {
+                                if(std::any_of(indices.begin(), indices.end(), [&](uint32_t index) { return !m_palette_entries[chunk_entries[index]].is_air; }))
+                                    skipped_section_count++;
+                                continue;
+                            }
+                            int height_base = section_y * SECTION_SIZE - m_options.min_y + 1;
+
+                            section_palette.clear();
+                            bool has_blocks = false;
+                            size_t index = 0;
+                            for(int x = 0; x < SECTION_SIZE; x++)
+                            {
+                                for(int y = 0; y < SECTION_SIZE; y++)
+                                {
+                                    for(int z = 0; z < SECTION_SIZE; z++)
+                                    {
+                                        auto entry = chunk_entries[indices[index++]];
+                                        auto& section_index = entry_to_section_index[entry];
+                                        if(section_index < 0)
+                                        {
+                                            section_index = section_palette.size();
+                                            section_palette.push_back(entry);
+                                        }
+                                        states[(y * SECTION_SIZE + z) * SECTION_SIZE + x] = section_index;
+                                        if(!m_palette_entries[entry].is_air)
+                                        {
+                                            has_blocks = true;
+                                            heights[z * SECTION_SIZE + x] = height_base + y;
+                                        }
+                                    }
+                                }
+                            }
+                            for(auto entry: section_palette)
+                                entry_to_section_index[entry] = -1;
+                            if(!has_blocks)
+                                continue;
+
+                            sections.write_tag_header(TagType::Byte, "Y");
+                            sections.write_byte(section_y);
+                            sections.write_tag_header(TagType::Compound, "block_states");
+                            sections.write_tag_header(TagType::List, "palette");
+                            sections.write_list_header(TagType::Compound, section_palette.size());
+                            for(auto entry: section_palette)
+                                sections.write_raw(m_palette_entries[entry].nbt);
+                            if(section_palette.size() > 1)
+                            {
+                                unsigned bits = std::max(4u, static_cast<unsigned>(std::bit_width(section_palette.size() - 1)));
+                                auto data = pack_values(states.data(), states.size(), bits);
+                                sections.write_tag_header(TagType::LongArray, "data");
+                                sections.write_long_array(data.data(), data.size());
+                            }
+                            sections.write_end();
+                            sections.write_tag_header(TagType::Compound, "biomes");
+                            sections.write_tag_header(TagType::List, "palette");
+                            sections.write_list_header(TagType::String, 1);
+                            sections.write_string(m_options.biome);
+                            sections.write_end();
+                            sections.write_end();
+                            sections_written++;
+                        }
+                    }
+                    if(sections_written == 0)
+                        continue;
+
+                    int chunk_x = column->x * SECTIONS_PER_CHUNK + dx;
+                    int chunk_z = column->z * SECTIONS_PER_CHUNK + dz;
+                    chunk_writer.clear();
+                    chunk_writer.write_tag_header(TagType::Compound, "");
+                    chunk_writer.write_tag_header(TagType::Int, "DataVersion");
+                    chunk_writer.write_int(m_options.data_version);
+                    chunk_writer.write_tag_header(TagType::Int, "xPos");
+                    chunk_writer.write_int(chunk_x);
+                    chunk_writer.write_tag_header(TagType::Int, "zPos");
+                    chunk_writer.write_int(chunk_z);
+                    chunk_writer.write_tag_header(TagType::Int, "yPos");
+                    chunk_writer.write_int(min_section);
+                    chunk_writer.write_tag_header(TagType::String, "Status");
+                    chunk_writer.write_string("minecraft:full");
+                    chunk_writer.write_tag_header(TagType::Long, "LastUpdate");
+                    chunk_writer.write_long(0);
+                    chunk_writer.write_tag_header(TagType::Long, "InhabitedTime");
+                    chunk_writer.write_long(0);
+                    // Makes the game compute light.
+                    chunk_writer.write_tag_header(TagType::Byte, "isLightOn");
+                    chunk_writer.write_byte(0);
+                    chunk_writer.write_tag_header(TagType::List, "sections");
+                    chunk_writer.write_list_header(TagType::Compound, sections_written);
+                    chunk_writer.write_raw(sections.data());
+                    chunk_writer.write_tag_header(TagType::List, "block_entities");
+                    chunk_writer.write_list_header(TagType::Compound, 0);
+                    // The other heightmaps depend on block properties; the game computes
+                    // missing ones when loading the chunk.
+                    auto heightmap = pack_values(heights.data(), heights.size(), height_bits);
+                    chunk_writer.write_tag_header(TagType::Compound, "Heightmaps");
+                    chunk_writer.write_tag_header(TagType::LongArray, "WORLD_SURFACE");
+                    chunk_writer.write_long_array(heightmap.data(), heightmap.size());
+                    chunk_writer.write_end();
+                    chunk_writer.write_tag_header(TagType::Compound, "structures");
+                    chunk_writer.write_tag_header(TagType::Compound, "References");
+                    chunk_writer.write_end();
+                    chunk_writer.write_tag_header(TagType::Compound, "starts");
+                    chunk_writer.write_end();
+                    chunk_writer.write_end();
+                    chunk_writer.write_end();
+
+                    // Chunk data: length (including the compression type), compression type (2 = zlib), data.
+                    auto& output = chunk_data[(chunk_x - region_position.first * REGION_SIZE) + (chunk_z - region_position.second * REGION_SIZE) * REGION_SIZE];
+                    auto& input = chunk_writer.data();
+                    uLongf compressed_size = compressBound(input.size());
+                    output.resize(5 + compressed_size);
+                    if(compress2(output.data() + 5, &compressed_size, input.data(), input.size(), m_options.compression_level) != Z_OK)
+                    {
+                        std::cerr << "Could not compress chunk " << chunk_x << " " << chunk_z << std::endl;
+                        success = false;
+                        return;
+                    }
+                    output.resize(5 + compressed_size);
+                    uint32_t length = compressed_size + 1;
+                    output[0] = length >> 24;
+                    output[1] = length >> 16;
+                    output[2] = length >> 8;
+                    output[3] = length;
+                    output[4] = 2;
+                    section_count += sections_written;
+                    chunk_count++;
+                }
+            }
+        }
+
+        // Header: a sector offset (3 bytes) and sector count (1 byte) for every chunk,
+        // then timestamps. Chunks are padded to whole sectors.
+        std::vector<uint8_t> header(2 * SECTOR_SIZE);
+        size_t sector = 2;
+        for(size_t index = 0; index < chunk_data.size(); index++)
+        {
+            auto& data = chunk_data[index];
+            if(data.empty())
+                continue;
+            size_t sector_count = (data.size() + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            if(sector_count > 255)
+            {
+                std::cerr << "Chunk " << index << " in region " << region_position.first << " " << region_position.second << " is too large" << std::endl;
+                success = false;
+                return;
+            }
+            data.resize(sector_count * SECTOR_SIZE);
+            header[index * 4] = sector >> 16;
+            header[index * 4 + 1] = sector >> 8;
+            header[index * 4 + 2] = sector;
+            header[index * 4 + 3] = sector_count;
+            sector += sector_count;
+        }
+
+        auto path = m_options.directory + "/r." + std::to_string(region_position.first) + "." + std::to_string(region_position.second) + ".mca";
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<char const*>(header.data()), header.size());
+        for(auto& data: chunk_data)
+            file.write(reinterpret_cast<char const*>(data.data()), data.size());
+        if(!file)
+        {
+            std::cerr << "Could not write " << path << std::endl;
+            success = false;
+        }
+    });
+
+    m_statistics.regions = regions.size();
+    m_statistics.chunks = chunk_count;
+    m_statistics.sections = section_count;
+    m_statistics.skipped_sections = skipped_section_count;
+    std::cout << "Anvil: " << m_statistics.chunks << " chunks (" << m_statistics.sections << " sections) in "
+              << m_statistics.regions << " regions in " << m_options.directory << std::endl;
+    if(m_statistics.skipped_sections > 0)
+        std::cerr << "WARNING: " << m_statistics.skipped_sections << " sections outside of world height were skipped" << std::endl;
+    if(m_statistics.blocks_without_nbt > 0)
+        std::cerr << "WARNING: " << m_statistics.blocks_without_nbt << " blocks with NBT were written without it" << std::endl;
+    return success;
+}
+
+}
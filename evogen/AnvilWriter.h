@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace evo
+{
+
+class World;
+
+// Writes a World directly as Anvil region files (r.<x>.<z>.mca, in the chunk format
+// of Minecraft 1.18+), an alternative to running commands generated by Generator.
+// The files can be copied to the "region" directory of a save.
+//
+// Every Minecraft chunk that contains a placeable block is written, the rest of the
+// chunk (including Empty blocks) becomes air. Region files are written from scratch,
+// so chunks that were already in them are lost. Light is left to be computed by the
+// game. Block NBT is not written (see write_block_state()).
+class AnvilWriter
+{
+public:
+    struct Options
+    {
+        std::string directory = "region";
+        // Defaults are for 1.20.1.
+        int data_version = 3465;
+        int min_y = -64;
+        int height = 384;
+        std::string biome = "minecraft:plains";
+        // zlib compression level, 0-9.
+        int compression_level = 6;
+        // Threads used for writing regions. 0 = all hardware threads.
+        unsigned thread_count = 0;
+    };
+
+    AnvilWriter() = default;
+    explicit AnvilWriter(Options const& options)
+    : m_options(options) {}
+
+    bool write(World const&);
+
+    struct Statistics
+    {
+        size_t regions = 0;
+        size_t chunks = 0;          // Minecraft chunks
+        size_t sections = 0;        // non-empty sections
+        size_t skipped_sections = 0; // sections with blocks outside of the world height
+        size_t blocks_without_nbt = 0; // distinct blocks whose NBT was dropped
+    };
+
+    Statistics const& statistics() const { return m_statistics; }
+
+private:
+    // Block written for a BlockDescriptor, as an encoded palette entry compound.
+    struct PaletteEntry
+    {
+        std::vector<uint8_t> nbt;
+        bool is_air = false;
+    };
+
+    Options m_options;
+    std::vector<PaletteEntry> m_palette_entries;
+    Statistics m_statistics;
+};
+
+}
@@ -1,5 +1,7 @@
 #include <evogen/Block.h>
 
+#include <algorithm>
+
 namespace evo
 {
 
@@ -47,4 +49,140 @@ static constexpr char const* BLOCK_IDS[] {
 Block::Block(VanillaBlock type, BlockStates const& states, std::string const& nbt)
 : Block(BLOCK_IDS[static_cast<size_t>(type)], states, nbt) {}
 
+Block Block::from_string(std::string const& input)
+{
+    auto id_end = input.find_first_of("[{");
+    if(id_end == std::string::npos)
+        return Block(input);
+    BlockStates states;
+    auto nbt_start = id_end;
+    if(input[id_end] == '[')
+    {
+        auto states_end = input.find(']', id_end);
+        if(states_end == std::string::npos)
+            states_end = input.size();
+        states = BlockStates::from_string(input.substr(id_end + 1, states_end - id_end - 1));
+        nbt_start = std::min(states_end + 1, input.size());
+    }
+    return Block(input.substr(0, id_end), states, input.substr(nbt_start));
+}
+
+// Horizontal directions, clockwise.
+static constexpr char const* DIRECTIONS[] { "north", "east", "south", "west" };
+
+static int direction_index(std::string const& name)
+{
+    for(int index = 0; index < 4; index++)
+    {
+        if(name == DIRECTIONS[index])
+            return index;
+    }
+    return -1;
+}
+
+// Transforms every direction in a state value like "north", "ascending_east" or
+// "north_west" (rail shapes), keeping Minecraft's order of words.
+template<class Transform>
+static std::string transform_directions(std::string const& value, Transform&& transform)
+{
+    auto direction = direction_index(value);
+    if(direction >= 0)
+        return DIRECTIONS[transform(direction)];
+
+    if(value.starts_with("ascending_"))
+        return "ascending_" + transform_directions(value.substr(10), transform);
+
+    auto separator = value.find('_');
+    if(separator == std::string::npos)
+        return value;
+    auto first = direction_index(value.substr(0, separator));
+    auto second = direction_index(value.substr(separator + 1));
+    if(first < 0 || second < 0)
+        return value;
+    first = transform(first);
+    second = transform(second);
+    // North/south always comes first.
+    if(first % 2 == 1)
+        std::swap(first, second);
+    if(first % 2 == 1 || second % 2 == 0)
+        return first % 2 == 0 ? "north_south" : "east_west";
+    return std::string(DIRECTIONS[first]) + "_" + DIRECTIONS[second];
+}
+
+template<class Transform>
+static void transform_direction_states(BlockStates& states, Transform&& transform)
+{
+    for(auto name: {"facing", "shape"})
+    {
+        auto value = states.state(name);
+        if(!value.empty())
+            states.set_state(name, transform_directions(value, transform));
+    }
+
+    // Side connections of fences, walls, panes, redstone wire...
+    std::string connections[4];
+    for(int index = 0; index < 4; index++)
+    {
+        connections[index] = states.state(DIRECTIONS[index]);
+        states.remove_state(DIRECTIONS[index]);
+    }
+    for(int index = 0; index < 4; index++)
+    {
+        if(!connections[index].empty())
+            states.set_state(DIRECTIONS[transform(index)], connections[index]);
+    }
+}
+
+Block Block::rotated(Rotation rotation) const
+{
+    int turns = static_cast<int>(rotation);
+    if(turns == 0)
+        return *this;
+
+    auto states = m_states;
+    transform_direction_states(states, [&](int direction) { return (direction + turns) % 4; });
+
+    auto axis = states.state("axis");
+    if(turns % 2 == 1 && (axis == "x" || axis == "z"))
+        states.set_state("axis", axis == "x" ? "z" : "x");
+
+    // Signs, banners, skulls: 16 steps, clockwise.
+    auto sixteenth = states.state("rotation");
+    if(!sixteenth.empty())
+        states.set_state("rotation", std::to_string((std::stoi(sixteenth) + 4 * turns) % 16));
+
+    return Block(m_id, states, m_nbt);
+}
+
+Block Block::mirrored(Mirror mirror) const
+{
+    if(mirror == Mirror::None)
+        return *this;
+
+    auto states = m_states;
+    // North and south are 0 and 2, east and west are 1 and 3.
+    int flipped_parity = mirror == Mirror::LeftRight ? 0 : 1;
+    transform_direction_states(states, [&](int direction) { return direction % 2 == flipped_parity ? (direction + 2) % 4 : direction; });
+
+    // Rotation 0 is south.
+    auto sixteenth = states.state("rotation");
+    if(!sixteenth.empty())
+    {
+        int value = std::stoi(sixteenth);
+        states.set_state("rotation", std::to_string(mirror == Mirror::LeftRight ? (24 - value) % 16 : (16 - value) % 16));
+    }
+
+    // Stair corners, double chests, door hinges.
+    for(auto name: {"shape", "type", "hinge"})
+    {
+        auto value = states.state(name);
+        if(value.ends_with("left"))
+            states.set_state(name, value.substr(0, value.size() - 4) + "right");
+        else if(value.ends_with("right"))
+            states.set_state(name, value.substr(0, value.size() - 5) + "left");
+    }
+
+    return Block(m_id, states, m_nbt);
+}
+
 }
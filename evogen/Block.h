@@ -9,6 +9,22 @@
 namespace evo
 {
 
+// Transformations of placed structures, the same as in structure blocks.
+enum class Rotation
+{
+    None,
+    Clockwise90,
+    Clockwise180,
+    Counterclockwise90,
+};
+
+enum class Mirror
+{
+    None,
+    LeftRight,  // Flips Z
+    FrontBack,  // Flips X
+};
+
 class Block
 {
 public:
@@ -20,12 +36,20 @@ public:
 
     Block(VanillaBlock type, BlockStates const& states = {}, std::string const& nbt = "");
 
-    std::string id() const { return m_id; }
-    BlockStates states() const { return m_states; }
-    std::string nbt() const { return m_nbt; }
+    // Parses command format, e.g "minecraft:chest[facing=north]{Items:[]}".
+    static Block from_string(std::string const& input);
+
+    std::string const& id() const { return m_id; }
+    BlockStates const& states() const { return m_states; }
+    std::string const& nbt() const { return m_nbt; }
 
     std::string to_command_format() const { return m_id + "[" + m_states.to_string() + "]" + m_nbt; }
 
+    // Block with its directional states (facing, axis, rotation, rail shape, side
+    // connections, left/right handedness) transformed.
+    Block rotated(Rotation) const;
+    Block mirrored(Mirror) const;
+
     bool operator==(Block const& other) const
     {
         return id() == other.id() && states() == other.states() && nbt() == other.nbt();
@@ -81,7 +105,10 @@ struct hash<evo::Block>
 {
     size_t operator()(evo::Block const& block) const
     {
-        return std::hash<std::string>()(block.to_command_format());
+        size_t result = std::hash<std::string>()(block.id());
+        result = result * 31 + block.states().hash();
+        result = result * 31 + std::hash<std::string>()(block.nbt());
+        return result;
     }
 };
 
@@ -3,41 +3,25 @@
 #include <evogen/Structure.h>
 #include <evogen/Task.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
 namespace evo
 {
 
-void BlockContainer::set_block_at(Vector<int> const& position, Block const& block)
+void BlockContainer::set_block_at(Vector<int> const& position, BlockHandle block)
 {
-    auto index = index_of(block);
-    if(index.has_value())
-        set_block_descriptor_at(position, BlockDescriptor::create_block(index.value()));
-    else
-    {
-        uint16_t new_index = generate_index(block);
-        set_block_descriptor_at(position, BlockDescriptor::create_block(new_index));
-    }
+    set_block_descriptor_at(position, BlockDescriptor::create_block(ensure_index(block)));
 }
 
-void BlockContainer::fill_blocks_at(Vector<int> const& start, Vector<int> const& end, Block const& block)
+void BlockContainer::fill_blocks_at(Vector<int> const& start, Vector<int> const& end, BlockHandle block)
 {
-    // TODO: Optimize it
-    int minx = std::min(start.x, end.x), maxx = std::max(start.x, end.x);
-    int miny = std::min(start.y, end.y), maxy = std::max(start.y, end.y);
-    int minz = std::min(start.z, end.z), maxz = std::max(start.z, end.z);
     //std::cerr << "fill_blocks_at " << start.to_string() << " / " << end.to_string() << " = " << block.to_command_format() << std::endl;
-    for(int x = minx; x <= maxx; x++)
-    {
-        for(int y = miny; y <= maxy; y++)
-        {
-            for(int z = minz; z <= maxz; z++)
-            {
-                set_block_at({x, y, z}, block);
-            }
-        }
-    }
+    fill_block_descriptors_at(start, end, BlockDescriptor::create_block(ensure_index(block)));
 }
 
-void BlockContainer::fill_blocks_hollow(Vector<int> const& start, Vector<int> const& end, Block const& outline, Block const& fill)
+void BlockContainer::fill_blocks_hollow(Vector<int> const& start, Vector<int> const& end, BlockHandle outline, BlockHandle fill)
 {
     auto min_vector = Vector<int>{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
     auto max_vector = Vector<int>{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
@@ -46,63 +30,368 @@ void BlockContainer::fill_blocks_hollow(Vector<int> const& start, Vector<int> co
     fill_blocks_outline(min_vector, max_vector, outline);
 }
 
-void BlockContainer::fill_blocks_outline(Vector<int> const& start, Vector<int> const& end, Block const& outline)
+void BlockContainer::fill_blocks_outline(Vector<int> const& start, Vector<int> const& end, BlockHandle outline)
 {
     auto min_vector = Vector<int>{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
     auto max_vector = Vector<int>{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+    auto descriptor = BlockDescriptor::create_block(ensure_index(outline));
 
     // X Sides
-    fill_blocks_at(Vector<int>(min_vector.x, min_vector.y, min_vector.z), Vector<int>(min_vector.x, max_vector.y, max_vector.z), outline);
-    fill_blocks_at(Vector<int>(max_vector.x, min_vector.y, min_vector.z), Vector<int>(max_vector.x, max_vector.y, max_vector.z), outline);
+    fill_block_descriptors_at(Vector<int>(min_vector.x, min_vector.y, min_vector.z), Vector<int>(min_vector.x, max_vector.y, max_vector.z), descriptor);
+    fill_block_descriptors_at(Vector<int>(max_vector.x, min_vector.y, min_vector.z), Vector<int>(max_vector.x, max_vector.y, max_vector.z), descriptor);
 
     // Y Sides
-    fill_blocks_at(Vector<int>(min_vector.x + 1, min_vector.y, min_vector.z + 1), Vector<int>(max_vector.x - 1, min_vector.y, max_vector.z - 1), outline);
-    fill_blocks_at(Vector<int>(min_vector.x + 1, max_vector.y, min_vector.z + 1), Vector<int>(max_vector.x - 1, max_vector.y, max_vector.z - 1), outline);
+    fill_block_descriptors_at(Vector<int>(min_vector.x + 1, min_vector.y, min_vector.z + 1), Vector<int>(max_vector.x - 1, min_vector.y, max_vector.z - 1), descriptor);
+    fill_block_descriptors_at(Vector<int>(min_vector.x + 1, max_vector.y, min_vector.z + 1), Vector<int>(max_vector.x - 1, max_vector.y, max_vector.z - 1), descriptor);
 
     // Z Sides
-    fill_blocks_at(Vector<int>(min_vector.x + 1, min_vector.y, min_vector.z), Vector<int>(max_vector.x - 1, max_vector.y, min_vector.z), outline);
-    fill_blocks_at(Vector<int>(min_vector.x + 1, min_vector.y, max_vector.z), Vector<int>(max_vector.x - 1, max_vector.y, max_vector.z), outline);
+    fill_block_descriptors_at(Vector<int>(min_vector.x + 1, min_vector.y, min_vector.z), Vector<int>(max_vector.x - 1, max_vector.y, min_vector.z), descriptor);
+    fill_block_descriptors_at(Vector<int>(min_vector.x + 1, min_vector.y, max_vector.z), Vector<int>(max_vector.x - 1, max_vector.y, max_vector.z), descriptor);
 }
 
-void BlockContainer::fill_ball(Vector<int> const& center, double radius, Block const& block)
+// Largest k >= 0 such that `base` + k^2 < `limit`, or -1 if there is none.
+// The comparison is the same as in per-block tests like `x*x + y*y + z*z < r*r`.
+static int max_offset_below(int64_t base, double limit)
+{
+    if(!(static_cast<double>(base) < limit))
+        return -1;
+    int64_t k = std::sqrt(std::max(0.0, limit - base));
+    while(k > 0 && !(static_cast<double>(base + k * k) < limit))
+        k--;
+    while(static_cast<double>(base + (k + 1) * (k + 1)) < limit)
+        k++;
+    return k;
+}
+
+// Same, but for `base` + k^2 <= `limit`.
+static int max_offset_within(int64_t base, double limit)
+{
+    if(!(static_cast<double>(base) <= limit))
+        return -1;
+    int64_t k = std::sqrt(std::max(0.0, limit - base));
+    while(k > 0 && !(static_cast<double>(base + k * k) <= limit))
+        k--;
+    while(static_cast<double>(base + (k + 1) * (k + 1)) <= limit)
+        k++;
+    return k;
+}
+
+void BlockContainer::fill_ball(Vector<int> const& center, double radius, BlockHandle block)
 {
     auto start = center - Vector<int>(radius+1, radius+1, radius+1);
     auto end = center + Vector<int>(radius+1, radius+1, radius+1);
     //std::cerr << "fill_ball r=" << radius << " : " << start.to_string() << "/" << end.to_string() << " = " << block.to_command_format() << std::endl;
-    fill_blocks_if(start, end, [&](Vector<int> const& offset) {
-        return offset.x * offset.x + offset.y * offset.y + offset.z * offset.z < radius * radius ?
-            block : std::optional<Block>();
+    fill_rows(start, end, block, [&](int x, int y, auto&& fill_span) {
+        int64_t dx = x - center.x, dy = y - center.y;
+        int k = max_offset_below(dx * dx + dy * dy, radius * radius);
+        fill_span(center.z - k, center.z + k);
+    });
+}
+
+void BlockContainer::fill_ellipsoid(Vector<int> const& center, Vector<double> const& radii, BlockHandle block)
+{
+    if(radii.x <= 0 || radii.y <= 0 || radii.z <= 0)
+        return;
+    auto start = center - Vector<int>(radii.x+1, radii.y+1, radii.z+1);
+    auto end = center + Vector<int>(radii.x+1, radii.y+1, radii.z+1);
+    fill_rows(start, end, block, [&](int x, int y, auto&& fill_span) {
+        double fx = (x - center.x) / radii.x, fy = (y - center.y) / radii.y;
+        // (dz / rz)^2 < 1 - fx^2 - fy^2
+        int k = max_offset_below(0, (1 - fx * fx - fy * fy) * radii.z * radii.z);
+        fill_span(center.z - k, center.z + k);
     });
 }
 
-void BlockContainer::fill_cylinder(Vector<int> const& bottom_side_center, double radius, double height, Block const& block)
+void BlockContainer::fill_cylinder(Vector<int> const& bottom_side_center, double radius, double height, BlockHandle block)
 {
     auto start = bottom_side_center + Vector<int>(-radius-1, 0, -radius-1);
     auto end = bottom_side_center + Vector<int>(radius+1, height, radius+1);
     //std::cerr << "fill_cylinder r=" << radius << " h=" << height << " : " << start.to_string() << "/" << end.to_string() << " = " << block.to_command_format() << std::endl;
-    fill_blocks_if(start, end, [&](Vector<int> const& offset) {
-        return offset.x * offset.x + offset.z * offset.z < radius * radius ?
-            block : std::optional<Block>();
+    fill_rows(start, end, block, [&](int x, int, auto&& fill_span) {
+        int64_t dx = x - bottom_side_center.x;
+        int k = max_offset_below(dx * dx, radius * radius);
+        fill_span(bottom_side_center.z - k, bottom_side_center.z + k);
+    });
+}
+
+void BlockContainer::fill_cone(Vector<int> const& bottom_side_center, double radius, double height, BlockHandle block)
+{
+    if(height <= 0)
+        return;
+    auto start = bottom_side_center + Vector<int>(-radius-1, 0, -radius-1);
+    auto end = bottom_side_center + Vector<int>(radius+1, height, radius+1);
+    fill_rows(start, end, block, [&](int x, int y, auto&& fill_span) {
+        int64_t dx = x - bottom_side_center.x;
+        double layer_radius = radius * (1 - (y - bottom_side_center.y) / height);
+        int k = max_offset_below(dx * dx, layer_radius * layer_radius);
+        fill_span(bottom_side_center.z - k, bottom_side_center.z + k);
+    });
+}
+
+void BlockContainer::fill_torus(Vector<int> const& center, double major_radius, double minor_radius, BlockHandle block)
+{
+    auto extent = major_radius + minor_radius + 1;
+    auto start = center - Vector<int>(extent, minor_radius+1, extent);
+    auto end = center + Vector<int>(extent, minor_radius+1, extent);
+    fill_rows(start, end, block, [&](int x, int y, auto&& fill_span) {
+        int64_t dx = x - center.x, dy = y - center.y;
+        double tube_squared = minor_radius * minor_radius - dy * dy;
+        if(tube_squared <= 0)
+            return;
+        // Horizontal distance from the axis must be in (major - tube, major + tube).
+        double tube = std::sqrt(tube_squared);
+        int outer = max_offset_below(dx * dx, (major_radius + tube) * (major_radius + tube));
+        int inner = major_radius > tube ? max_offset_within(dx * dx, (major_radius - tube) * (major_radius - tube)) : -1;
+        if(inner < 0)
+            fill_span(center.z - outer, center.z + outer);
+        else
+        {
+            fill_span(center.z - outer, center.z - inner - 1);
+            fill_span(center.z + inner + 1, center.z + outer);
+        }
     });
 }
 
-void BlockContainer::place_structure(Structure const& structure, Vector<int> const& offset)
+void BlockContainer::fill_capsule(Vector<int> const& start, Vector<int> const& end, double radius, BlockHandle block)
+{
+    Vector<int> min_vector{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
+    Vector<int> max_vector{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+    Vector<int> margin(radius+1, radius+1, radius+1);
+
+    Vector<double> axis(end.x - start.x, end.y - start.y, end.z - start.z);
+    double length_squared = axis.x * axis.x + axis.y * axis.y + axis.z * axis.z;
+    double radius_squared = radius * radius;
+
+    fill_rows(min_vector - margin, max_vector + margin, block, [&](int x, int y, auto&& fill_span) {
+        // The capsule is convex, so a row crosses it in a single span: the union of
+        // the spans through both end balls and through the cylinder between them.
+        int64_t z_min = INT64_MAX, z_max = INT64_MIN;
+        for(auto& ball_center: {start, end})
+        {
+            int64_t dx = x - ball_center.x, dy = y - ball_center.y;
+            int k = max_offset_below(dx * dx + dy * dy, radius_squared);
+            if(k >= 0)
+            {
+                z_min = std::min<int64_t>(z_min, ball_center.z - k);
+                z_max = std::max<int64_t>(z_max, ball_center.z + k);
+            }
+        }
+
+        if(length_squared > 0)
+        {
+            // With u = z - start.z, the offset from start is w = (wx, wy, u). Squared
+            // distance from the axis is |w|^2 - (w.axis)^2 / |axis|^2 = a*u^2 + b*u + c,
+            // and position along the axis is t = (p + u * axis.z) / |axis|^2.
+            double wx = x - start.x, wy = y - start.y;
+            double p = wx * axis.x + wy * axis.y;
+            double a = 1 - axis.z * axis.z / length_squared;
+            double b = -2 * p * axis.z / length_squared;
+            double c = wx * wx + wy * wy - p * p / length_squared - radius_squared;
+
+            // Open interval of u where the distance is below the radius.
+            double low = -INFINITY, high = INFINITY;
+            bool inside = true;
+            if(a > 1e-12)
+            {
+                double discriminant = b * b - 4 * a * c;
+                inside = discriminant > 0;
+                if(inside)
+                {
+                    low = (-b - std::sqrt(discriminant)) / (2 * a);
+                    high = (-b + std::sqrt(discriminant)) / (2 * a);
+                }
+            }
+            else
+                inside = c < 0;
+
+            // 0 <= t <= 1
+            if(axis.z != 0)
+            {
+                double t0 = -p / axis.z, t1 = (length_squared - p) / axis.z;
+                low = std::max(low, std::min(t0, t1));
+                high = std::min(high, std::max(t0, t1));
+            }
+            else
+                inside = inside && p >= 0 && p <= length_squared;
+
+            if(inside && low < high)
+            {
+                // Exact test for an integer `u`, to fix up rounding at the ends of the span.
+                auto in_cylinder = [&](int64_t u) {
+                    int64_t ix = x - start.x, iy = y - start.y;
+                    int64_t dot = ix * (end.x - start.x) + iy * (end.y - start.y) + u * (end.z - start.z);
+                    int64_t length = length_squared;
+                    if(dot < 0 || dot > length)
+                        return false;
+                    return static_cast<double>((ix * ix + iy * iy + u * u) * length - dot * dot) < radius_squared * length;
+                };
+                int64_t u_min = static_cast<int64_t>(std::floor(low)) + 1;
+                int64_t u_max = static_cast<int64_t>(std::ceil(high)) - 1;
+                while(u_min <= u_max && !in_cylinder(u_min))
+                    u_min++;
+                while(u_min <= u_max && !in_cylinder(u_max))
+                    u_max--;
+                if(u_min <= u_max)
+                {
+                    while(in_cylinder(u_min - 1))
+                        u_min--;
+                    while(in_cylinder(u_max + 1))
+                        u_max++;
+                    z_min = std::min(z_min, start.z + u_min);
+                    z_max = std::max(z_max, start.z + u_max);
+                }
+            }
+        }
+
+        if(z_min <= z_max)
+            fill_span(z_min, z_max);
+    });
+}
+
+void BlockContainer::commit_chunk_runs(std::vector<Chunk*> const& chunks, std::vector<std::vector<ChunkRun>> const& chunk_runs, size_t count, unsigned thread_count)
+{
+    for(size_t index = 0; index < count; index++)
+    {
+        for(auto& run: chunk_runs[index])
+            ensure_index(run.block);
+    }
+
+    // Only reads the block index from now on, and every chunk is written by one thread.
+    parallel_for(count, thread_count, [&](size_t index) {
+        for(auto& run: chunk_runs[index])
+        {
+            auto descriptor = BlockDescriptor::create_block(index_of(run.block).value());
+            chunks[index]->fill_blocks_at(run.start, {run.start.x, run.start.y, run.end_z}, descriptor);
+        }
+    });
+}
+
+void BlockContainer::store_index_layers(Vector<int> const& origin, Vector<int> const& size, int y, int layer_count, std::vector<uint32_t> const& layers, std::vector<BlockDescriptor> const& palette)
+{
+    auto min_chunk = chunk_position_from_block(origin + Vector<int>{0, y, 0});
+    auto max_chunk = chunk_position_from_block(origin + Vector<int>{size.x - 1, y, size.z - 1});
+    std::vector<uint32_t> chunk_indices;
+    for(int cx = min_chunk.x; cx <= max_chunk.x; cx++)
+    {
+        for(int cz = min_chunk.z; cz <= max_chunk.z; cz++)
+        {
+            Vector<int> chunk_position{cx, min_chunk.y, cz};
+            auto chunk_origin = block_from_chunk_position_and_offset(chunk_position);
+            // Part of the box in this chunk, relative to the box.
+            int x0 = std::max(chunk_origin.x - origin.x, 0), x1 = std::min(chunk_origin.x + Chunk::SIZE - origin.x, size.x) - 1;
+            int z0 = std::max(chunk_origin.z - origin.z, 0), z1 = std::min(chunk_origin.z + Chunk::SIZE - origin.z, size.z) - 1;
+
+            // Transpose to chunk storage order.
+            chunk_indices.clear();
+            for(int x = x0; x <= x1; x++)
+            {
+                for(int layer = 0; layer < layer_count; layer++)
+                {
+                    auto row = layers.data() + static_cast<size_t>(layer * size.z) * size.x + x;
+                    for(int z = z0; z <= z1; z++)
+                        chunk_indices.push_back(row[static_cast<size_t>(z) * size.x]);
+                }
+            }
+            auto start = chunk_offset_from_block(origin + Vector<int>{x0, y, z0});
+            auto end = chunk_offset_from_block(origin + Vector<int>{x1, y + layer_count - 1, z1});
+            ensure_chunk_at(chunk_position).set_blocks_at(start, end, chunk_indices.data(), palette);
+        }
+    }
+}
+
+void BlockContainer::place_structure(Structure const& structure, Vector<int> const& offset, Rotation rotation, Mirror mirror)
 {
-    auto [sx, sy, sz] = structure.size();
-    for(int x = 0; x < sx; x++)
+    auto size = structure.size();
+
+    // Structure block indices are mapped to ours once per placement, so blocks are
+    // not looked up or transformed per voxel.
+    std::vector<BlockDescriptor> index_map(structure.m_index_to_block.size() + 1);
+    for(size_t index = 1; index < index_map.size(); index++)
+    {
+        auto block = structure.m_index_to_block[index - 1];
+        if(rotation != Rotation::None || mirror != Mirror::None)
+            block = block.block().mirrored(mirror).rotated(rotation);
+        index_map[index] = BlockDescriptor::create_block(ensure_index(block));
+    }
+
+    auto transform = [&](Vector<int> position) {
+        if(mirror == Mirror::LeftRight)
+            position.z = size.z - 1 - position.z;
+        else if(mirror == Mirror::FrontBack)
+            position.x = size.x - 1 - position.x;
+        switch(rotation)
+        {
+            case Rotation::None:
+                break;
+            case Rotation::Clockwise90:
+                position = {size.z - 1 - position.z, position.y, position.x};
+                break;
+            case Rotation::Clockwise180:
+                position = {size.x - 1 - position.x, position.y, size.z - 1 - position.z};
+                break;
+            case Rotation::Counterclockwise90:
+                position = {position.z, position.y, size.x - 1 - position.x};
+                break;
+        }
+        return position + offset;
+    };
+
+    // Z runs of equal blocks are copied as whole spans. The transform maps them
+    // to axis-aligned lines, so they can be filled directly.
+    for(auto& [chunk_position, chunk]: structure.m_chunks)
     {
-        for(int y = 0; y < sy; y++)
+        auto origin = block_from_chunk_position_and_offset(chunk_position);
+        Vector<int> start{std::max(origin.x, 0), std::max(origin.y, 0), std::max(origin.z, 0)};
+        Vector<int> end{std::min(origin.x + Chunk::SIZE, size.x) - 1, std::min(origin.y + Chunk::SIZE, size.y) - 1, std::min(origin.z + Chunk::SIZE, size.z) - 1};
+        if(start.x > end.x || start.y > end.y || start.z > end.z)
+            continue;
+
+        // Whole chunks that land exactly on an empty chunk just share its index array.
+        auto target_origin = transform(origin);
+        bool whole_chunk = start == origin && end == origin + Vector<int>{Chunk::SIZE - 1, Chunk::SIZE - 1, Chunk::SIZE - 1};
+        bool aligned = rotation == Rotation::None && mirror == Mirror::None
+            && chunk_offset_from_block(target_origin) == Vector<unsigned>{0, 0, 0};
+        if(whole_chunk && aligned && !chunk.is_uniform())
+        {
+            auto& target = ensure_chunk_at(chunk_position_from_block(target_origin));
+            if(target.is_uniform() && target.block_at({}).kind == BlockDescriptor::Empty)
+            {
+                // Markers are not placed, but then they have to be unique Empty entries.
+                std::vector<BlockDescriptor> palette;
+                bool unique = true;
+                for(auto& descriptor: chunk.palette())
+                {
+                    auto mapped = descriptor.kind == BlockDescriptor::Block ? index_map[descriptor.arg] : BlockDescriptor{};
+                    unique = unique && std::find(palette.begin(), palette.end(), mapped) == palette.end();
+                    palette.push_back(mapped);
+                }
+                if(unique)
+                {
+                    target = chunk.with_palette(std::move(palette));
+                    continue;
+                }
+            }
+        }
+
+        if(chunk.is_uniform())
         {
-            for(int z = 0; z < sz; z++)
+            auto descriptor = chunk.block_at({});
+            if(descriptor.kind == BlockDescriptor::Block)
+                fill_block_descriptors_at(transform(start), transform(end), index_map[descriptor.arg]);
+            continue;
+        }
+
+        for(int x = start.x; x <= end.x; x++)
+        {
+            for(int y = start.y; y <= end.y; y++)
             {
-                auto descriptor = structure.get_block_descriptor_at({x, y, z});
-                assert(descriptor);
-                if(descriptor->kind == BlockDescriptor::Block)
+                for(int run_start = start.z, run_end; run_start <= end.z; run_start = run_end)
                 {
-                    auto block = structure.block_from_index(descriptor->arg);
-                    assert(block.has_value());
-                    // TODO: Handle nbt
-                    set_block_at(Vector<int>(x, y, z) + offset, block.value());
+                    auto descriptor = chunk.block_at(chunk_offset_from_block({x, y, run_start}));
+                    for(run_end = run_start + 1; run_end <= end.z && chunk.block_at(chunk_offset_from_block({x, y, run_end})) == descriptor; run_end++)
+                        ;
+                    if(descriptor.kind == BlockDescriptor::Block)
+                        fill_block_descriptors_at(transform({x, y, run_start}), transform({x, y, run_end - 1}), index_map[descriptor.arg]);
                 }
             }
         }
@@ -120,7 +409,7 @@ void BlockContainer::load_markers_from_image(Image const& image, int y, Vector<i
             auto pixel = image.pixel({x, z});
             if((image.channels() == 4 && pixel.a >= 128) || image.channels() == 3)
             {
-                BlockDescriptor descriptor{BlockDescriptor::Marker, {}, marker_index_from_color(pixel)};
+                auto descriptor = BlockDescriptor::create_marker(marker_index_from_color(pixel));
                 set_block_descriptor_at({x + offset.x, y + offset.y, z + offset.z}, descriptor);
             }
         }
@@ -130,7 +419,31 @@ void BlockContainer::load_markers_from_image(Image const& image, int y, Vector<i
 void BlockContainer::set_block_descriptor_at(Vector<int> const& position, BlockDescriptor block)
 {
     //std::cerr << "set_block_descriptor_at " << position.to_string() << " = " << block.arg << std::endl;
-    ensure_chunk_at(chunk_position_from_block(position)).block_at(chunk_offset_from_block(position)) = block;
+    ensure_chunk_at(chunk_position_from_block(position)).set_block_at(chunk_offset_from_block(position), block);
+}
+
+void BlockContainer::fill_block_descriptors_at(Vector<int> const& start, Vector<int> const& end, BlockDescriptor block)
+{
+    auto min_vector = Vector<int>{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
+    auto max_vector = Vector<int>{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+    auto min_chunk = chunk_position_from_block(min_vector);
+    auto max_chunk = chunk_position_from_block(max_vector);
+
+    for(int cx = min_chunk.x; cx <= max_chunk.x; cx++)
+    {
+        for(int cy = min_chunk.y; cy <= max_chunk.y; cy++)
+        {
+            for(int cz = min_chunk.z; cz <= max_chunk.z; cz++)
+            {
+                Vector<int> chunk_position{cx, cy, cz};
+                auto chunk_start = block_from_chunk_position_and_offset(chunk_position);
+                auto chunk_end = chunk_start + Vector<int>{Chunk::SIZE - 1, Chunk::SIZE - 1, Chunk::SIZE - 1};
+                Vector<int> sub_start{std::max(min_vector.x, chunk_start.x), std::max(min_vector.y, chunk_start.y), std::max(min_vector.z, chunk_start.z)};
+                Vector<int> sub_end{std::min(max_vector.x, chunk_end.x), std::min(max_vector.y, chunk_end.y), std::min(max_vector.z, chunk_end.z)};
+                ensure_chunk_at(chunk_position).fill_blocks_at(chunk_offset_from_block(sub_start), chunk_offset_from_block(sub_end), block);
+            }
+        }
+    }
 }
 
 BlockDescriptor BlockContainer::ensure_block_descriptor_at(Vector<int> const& position)
@@ -139,61 +452,105 @@ BlockDescriptor BlockContainer::ensure_block_descriptor_at(Vector<int> const& po
     return ensure_chunk_at(chunk_position_from_block(position)).block_at(chunk_offset_from_block(position));
 }
 
-BlockDescriptor* BlockContainer::get_block_descriptor_at(Vector<int> const& position)
+std::optional<BlockDescriptor> BlockContainer::get_block_descriptor_at(Vector<int> const& position) const
 {
     auto chunk = get_chunk_at(chunk_position_from_block(position));
     if(!chunk)
-        return nullptr;
-    return &chunk->block_at(chunk_offset_from_block(position));
+        return {};
+    return chunk->block_at(chunk_offset_from_block(position));
 }
 
-BlockDescriptor const* BlockContainer::get_block_descriptor_at(Vector<int> const& position) const
+Chunk& BlockContainer::ensure_chunk_at(Vector<int> const& chunk_position)
 {
-    auto chunk = get_chunk_at(chunk_position_from_block(position));
-    if(!chunk)
-        return nullptr;
-    return &chunk->block_at(chunk_offset_from_block(position));
+    auto [chunk, inserted] = m_chunks.try_emplace(chunk_position);
+    if(inserted)
+        initialize_chunk(*chunk);
+    return *chunk;
 }
 
-Chunk& BlockContainer::ensure_chunk_at(Vector<int> const& chunk_position)
+Chunk* BlockContainer::get_chunk_at(Vector<int> const& chunk_position)
+{
+    return m_chunks.find(chunk_position);
+}
+
+Chunk const* BlockContainer::get_chunk_at(Vector<int> const& chunk_position) const
 {
-    auto it = m_chunks.find(chunk_position);
-    if(it == m_chunks.end())
+    return m_chunks.find(chunk_position);
+}
+
+void BlockContainer::initialize_chunk(Chunk&) const
+{
+}
+
+std::vector<Vector<int>> BlockContainer::dirty_chunks_since(uint64_t checkpoint) const
+{
+    std::vector<Vector<int>> result;
+    for(auto& [position, chunk]: m_chunks.loaded_entries())
     {
-        auto result = m_chunks.try_emplace(chunk_position);
-        //std::cerr << "ensure_chunk_at: creating at " << chunk_position.to_string() << " = " << result.second << std::endl;
-        initialize_chunk(result.first->second);
-        it = result.first;
+        if(chunk.is_modified_since(checkpoint))
+            result.push_back(position);
     }
-    return it->second;
+    return result;
 }
 
-Chunk* BlockContainer::get_chunk_at(Vector<int> const& chunk_position)
+size_t BlockContainer::memory_usage() const
 {
-    auto it = m_chunks.find(chunk_position);
-    if(it == m_chunks.end())
-        return nullptr;
-    return &it->second;
+    size_t result = 0;
+    for(auto& it: m_chunks)
+        result += it.second.memory_usage();
+    return result;
 }
 
-Chunk const* BlockContainer::get_chunk_at(Vector<int> const& chunk_position) const
+void BlockContainer::optimize_chunks()
 {
-    auto it = m_chunks.find(chunk_position);
-    if(it == m_chunks.end())
-        return nullptr;
-    return &it->second;
+    for(auto& it: m_chunks)
+        it.second.optimize();
 }
 
-void BlockContainer::initialize_chunk(Chunk&) const
+size_t BlockContainer::deduplicate_chunks()
 {
+    optimize_chunks();
+
+    size_t shared_count = 0;
+    std::unordered_map<size_t, std::vector<Chunk const*>> chunks_by_hash;
+    for(auto& it: m_chunks)
+    {
+        auto& chunk = it.second;
+        if(chunk.is_uniform())
+            continue;
+        auto& candidates = chunks_by_hash[chunk.indices_hash()];
+        bool shared = false;
+        for(auto candidate: candidates)
+        {
+            if(chunk.shares_indices_with(*candidate) || chunk.share_indices_with(*candidate))
+            {
+                shared = true;
+                break;
+            }
+        }
+        if(shared)
+            shared_count++;
+        else
+            candidates.push_back(&chunk);
+    }
+    return shared_count;
 }
 
-uint16_t BlockContainer::generate_index(Block const& block)
+uint16_t BlockContainer::generate_index(BlockHandle block)
 {
-    m_current_index++;
-    m_index_to_block.try_emplace(m_current_index, block);
-    m_block_to_index.try_emplace(block, m_current_index);
-    return m_current_index;
+    assert(m_index_to_block.size() < UINT16_MAX);
+    m_index_to_block.push_back(block);
+    uint16_t index = m_index_to_block.size();
+    if(m_block_to_index.size() <= block.id())
+        m_block_to_index.resize(block.id() + 1);
+    m_block_to_index[block.id()] = index;
+    return index;
+}
+
+uint16_t BlockContainer::ensure_index(BlockHandle block)
+{
+    auto index = index_of(block);
+    return index.has_value() ? index.value() : generate_index(block);
 }
 
 uint16_t BlockContainer::marker_index_from_color(Color const& color)
@@ -208,50 +565,42 @@ uint16_t BlockContainer::marker_index_from_color(Color const& color)
     return value;
 }
 
-std::optional<Block> BlockContainer::block_from_index(uint16_t index) const
+std::optional<BlockHandle> BlockContainer::block_from_index(uint16_t index) const
 {
-    auto it = m_index_to_block.find(index);
-    return it == m_index_to_block.end() ? std::optional<Block>() : std::optional<Block>(it->second);
+    if(index == 0 || index > m_index_to_block.size())
+        return {};
+    return m_index_to_block[index - 1];
 }
 
-std::optional<uint16_t> BlockContainer::index_of(Block const& block) const
+std::optional<uint16_t> BlockContainer::index_of(BlockHandle block) const
 {
-    auto it = m_block_to_index.find(block);
-    return it == m_block_to_index.end() ? std::optional<uint16_t>() : std::optional<uint16_t>(it->second);
+    if(block.id() >= m_block_to_index.size() || m_block_to_index[block.id()] == 0)
+        return {};
+    return m_block_to_index[block.id()];
 }
 
-void BlockContainer::set_marker(uint16_t index, Block const& block)
+void BlockContainer::set_marker(uint16_t index, BlockHandle block)
 {
     m_marker_index_to_block.insert({index, block});
 }
 
-std::optional<Block> BlockContainer::block_from_marker_index(uint16_t index) const
+std::optional<BlockHandle> BlockContainer::block_from_marker_index(uint16_t index) const
 {
     auto it = m_marker_index_to_block.find(index);
-    return it == m_marker_index_to_block.end() ? std::optional<Block>() : std::optional<Block>(it->second);
-}
-
-Vector<int> BlockContainer::chunk_position_from_block(Vector<int> const& position)
-{
-    auto [ax, ay, az] = position;
-    if(ax < -1) ax++;
-    if(ay < -1) ay++;
-    if(az < -1) az++;
-    int px = ax / Chunk::SIZE; if(ax < 0) px--;
-    int py = ay / Chunk::SIZE; if(ay < 0) py--;
-    int pz = az / Chunk::SIZE; if(az < 0) pz--;
-    //std::cerr << "chunk_position_from_block " << px << "," << py << "," << pz << std::endl;
-    return {px, py, pz};
+    return it == m_marker_index_to_block.end() ? std::optional<BlockHandle>() : std::optional<BlockHandle>(it->second);
 }
 
-Vector<unsigned> BlockContainer::chunk_offset_from_block(Vector<int> const& position)
+std::optional<BlockHandle> BlockContainer::block_from_descriptor(BlockDescriptor descriptor) const
 {
-    auto [ax, ay, az] = position;
-    // FIXME: Is there simpler way to do this?
-    unsigned px = ax < 0 ? (Chunk::SIZE - (-ax) % Chunk::SIZE) % Chunk::SIZE : ax % Chunk::SIZE;
-    unsigned py = ay < 0 ? (Chunk::SIZE - (-ay) % Chunk::SIZE) % Chunk::SIZE : ay % Chunk::SIZE;
-    unsigned pz = az < 0 ? (Chunk::SIZE - (-az) % Chunk::SIZE) % Chunk::SIZE : az % Chunk::SIZE;
-    return {px, py, pz};
+    switch(descriptor.kind)
+    {
+        case BlockDescriptor::Block:
+            return block_from_index(descriptor.arg);
+        case BlockDescriptor::Marker:
+            return block_from_marker_index(descriptor.arg);
+        default:
+            return {};
+    }
 }
 
 Vector<int> BlockContainer::block_from_chunk_position_and_offset(Vector<int> const& position, Vector<unsigned> const& offset)
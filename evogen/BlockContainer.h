@@ -1,32 +1,40 @@
 #pragma once
 
 #include <evogen/Block.h>
+#include <evogen/BlockHandle.h>
 #include <evogen/Chunk.h>
+#include <evogen/ChunkMap.h>
 #include <evogen/Generator.h>
 #include <evogen/Image.h>
+#include <evogen/Parallel.h>
 #include <evogen/Vector.h>
 
 #include <cassert>
+#include <memory>
 #include <optional>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 namespace evo
 {
 
+class SnapshotFile;
 class Structure;
 
 class BlockContainer
 {
 public:
-    void set_block_at(Vector<int> const&, Block const&);
-    void fill_blocks_at(Vector<int> const& start, Vector<int> const& end, Block const&);
+    void set_block_at(Vector<int> const&, BlockHandle);
+    void fill_blocks_at(Vector<int> const& start, Vector<int> const& end, BlockHandle);
 
-    void fill_blocks_hollow(Vector<int> const& start, Vector<int> const& end, Block const& outline, Block const& fill = Block("air"));
-    void fill_blocks_outline(Vector<int> const& start, Vector<int> const& end, Block const& outline);
+    void fill_blocks_hollow(Vector<int> const& start, Vector<int> const& end, BlockHandle outline, BlockHandle fill = BlockHandle("air"));
+    void fill_blocks_outline(Vector<int> const& start, Vector<int> const& end, BlockHandle outline);
 
-    // Position specifies position of all-negative corner of structure.
-    void place_structure(Structure const&, Vector<int> const& position);
+    // Position specifies position of all-negative corner of structure (after transforming it).
+    // The structure is mirrored first, then rotated around the Y axis, like with structure blocks.
+    // Only blocks inside the structure size are placed, markers are skipped.
+    void place_structure(Structure const&, Vector<int> const& position, Rotation = Rotation::None, Mirror = Mirror::None);
 
     // Image coords (pixels) correspond to world coords + offset (Y = 0).
     // y - Y coordinate to place markers on
@@ -36,71 +44,315 @@ public:
     // TODO: Avoid that rounding!
     void load_markers_from_image(Image const&, int y = 0, Vector<int> const& offset = {});
 
-    // Predicate: function of type std::optional<Block>(Vector<int> const& center_offset)
+    // Predicate: function of type std::optional<BlockHandle>(Vector<int> const& center_offset)
+    // std::optional<Block> works too, but then the block is interned for every voxel.
+    // For large boxes, prefer fill_blocks_by_row().
     template<class Predicate>
     void fill_blocks_if(Vector<int> const& start, Vector<int> const& end, Predicate&& predicate)
     {
-        // TODO: Optimize it
+        fill_blocks_by_row(start, end, [&](Vector<int> const& row_offset, int count, BlockHandle* blocks) {
+            for(int z = 0; z < count; z++)
+            {
+                auto offset_vector = row_offset + Vector<int>{0, 0, z};
+                auto block = predicate(offset_vector);
+                blocks[z] = block.has_value() ? BlockHandle(block.value()) : BlockHandle();
+            }
+        });
+    }
+
+    // Batched fill_blocks_if(). RowPredicate: function of type
+    // void(Vector<int> const& row_offset, int count, BlockHandle* blocks), called once for
+    // every X/Y row of the box. It should write to blocks[i] the block for center offset
+    // row_offset + {0, 0, i}, or an invalid handle for no block. Simple loops over `i`
+    // get vectorized by the compiler. Runs of equal blocks are then filled in bulk.
+    template<class RowPredicate>
+    void fill_blocks_by_row(Vector<int> const& start, Vector<int> const& end, RowPredicate&& row_predicate)
+    {
         int minx = std::min(start.x, end.x), maxx = std::max(start.x, end.x);
         int miny = std::min(start.y, end.y), maxy = std::max(start.y, end.y);
         int minz = std::min(start.z, end.z), maxz = std::max(start.z, end.z);
-        //std::cerr << "fill_blocks_if " << start.to_string() << " / " << end.to_string() << std::endl;
         auto center = (Vector<int>{minx, miny, minz} + Vector<int>{maxx, maxy, maxz}) / 2.0;
+        int count = maxz - minz + 1;
+        std::vector<BlockHandle> blocks(count);
+
+        BlockHandle last_block;
+        BlockDescriptor last_descriptor;
         for(int x = minx; x <= maxx; x++)
         {
             for(int y = miny; y <= maxy; y++)
             {
-                for(int z = minz; z <= maxz; z++)
+                auto row_offset = Vector<int>{x, y, minz} - center;
+                row_predicate(row_offset, count, blocks.data());
+                for(int run_start = 0, run_end; run_start < count; run_start = run_end)
+                {
+                    auto block = blocks[run_start];
+                    for(run_end = run_start + 1; run_end < count && blocks[run_end] == block; run_end++)
+                        ;
+                    if(!block.is_valid())
+                        continue;
+                    if(!(block == last_block))
+                    {
+                        last_block = block;
+                        last_descriptor = BlockDescriptor::create_block(ensure_index(block));
+                    }
+                    fill_block_descriptors_at({x, y, minz + run_start}, {x, y, minz + run_end - 1}, last_descriptor);
+                }
+            }
+        }
+    }
+    // Parallel fill_blocks_if() / fill_blocks_by_row(), for large boxes with expensive
+    // predicates. Predicates are called concurrently, so they must be thread-safe.
+    //
+    // Work goes in fixed-size batches of chunks. Between evaluating and writing a
+    // batch, chunks that get blocks are created and new block indices are assigned, in
+    // chunk order, so the result doesn't depend on `thread_count` (0 = all hardware
+    // threads). Every chunk is then filled by a single thread, without any locking.
+    template<class Predicate>
+    void fill_blocks_if_parallel(Vector<int> const& start, Vector<int> const& end, Predicate&& predicate, unsigned thread_count = 0)
+    {
+        fill_blocks_by_row_parallel(start, end, [&](Vector<int> const& row_offset, int count, BlockHandle* blocks) {
+            for(int z = 0; z < count; z++)
+            {
+                auto offset_vector = row_offset + Vector<int>{0, 0, z};
+                auto block = predicate(offset_vector);
+                blocks[z] = block.has_value() ? BlockHandle(block.value()) : BlockHandle();
+            }
+        }, thread_count);
+    }
+
+    template<class RowPredicate>
+    void fill_blocks_by_row_parallel(Vector<int> const& start, Vector<int> const& end, RowPredicate&& row_predicate, unsigned thread_count = 0)
+    {
+        Vector<int> min_vector{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
+        Vector<int> max_vector{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+        auto center = (min_vector + max_vector) / 2.0;
+
+        std::vector<Vector<int>> chunk_positions;
+        auto min_chunk = chunk_position_from_block(min_vector);
+        auto max_chunk = chunk_position_from_block(max_vector);
+        for(int cx = min_chunk.x; cx <= max_chunk.x; cx++)
+        {
+            for(int cy = min_chunk.y; cy <= max_chunk.y; cy++)
+            {
+                for(int cz = min_chunk.z; cz <= max_chunk.z; cz++)
+                    chunk_positions.push_back({cx, cy, cz});
+            }
+        }
+
+        auto batch_size = std::min(PARALLEL_FILL_BATCH_SIZE, chunk_positions.size());
+        std::vector<Chunk*> chunks(batch_size);
+        std::vector<std::vector<ChunkRun>> chunk_runs(batch_size);
+        for(size_t batch_start = 0; batch_start < chunk_positions.size(); batch_start += PARALLEL_FILL_BATCH_SIZE)
+        {
+            size_t batch_end = std::min(batch_start + PARALLEL_FILL_BATCH_SIZE, chunk_positions.size());
+            parallel_for(batch_end - batch_start, thread_count, [&](size_t index) {
+                auto& runs = chunk_runs[index];
+                runs.clear();
+                auto origin = block_from_chunk_position_and_offset(chunk_positions[batch_start + index]);
+                Vector<int> sub_start{std::max(min_vector.x, origin.x), std::max(min_vector.y, origin.y), std::max(min_vector.z, origin.z)};
+                Vector<int> sub_end{std::min(max_vector.x, origin.x + Chunk::SIZE - 1), std::min(max_vector.y, origin.y + Chunk::SIZE - 1), std::min(max_vector.z, origin.z + Chunk::SIZE - 1)};
+                int count = sub_end.z - sub_start.z + 1;
+                BlockHandle blocks[Chunk::SIZE];
+                for(int x = sub_start.x; x <= sub_end.x; x++)
                 {
-                    auto offset_vector = Vector<int>{x, y, z} - center;
-                    auto block = predicate(offset_vector);
-                    if(block.has_value())
-                        set_block_at({x, y, z}, block.value());
+                    for(int y = sub_start.y; y <= sub_end.y; y++)
+                    {
+                        auto row_offset = Vector<int>{x, y, sub_start.z} - center;
+                        row_predicate(row_offset, count, blocks);
+                        for(int run_start = 0, run_end; run_start < count; run_start = run_end)
+                        {
+                            auto block = blocks[run_start];
+                            for(run_end = run_start + 1; run_end < count && blocks[run_end] == block; run_end++)
+                                ;
+                            if(block.is_valid())
+                            {
+                                auto offset = chunk_offset_from_block({x, y, sub_start.z + run_start});
+                                runs.push_back({offset, offset.z + run_end - run_start - 1, block});
+                            }
+                        }
+                    }
                 }
+            });
+            for(size_t index = batch_start; index < batch_end; index++)
+            {
+                auto& runs = chunk_runs[index - batch_start];
+                chunks[index - batch_start] = runs.empty() ? nullptr : &ensure_chunk_at(chunk_positions[index]);
+            }
+            commit_chunk_runs(chunks, chunk_runs, batch_end - batch_start, thread_count);
+        }
+    }
+
+    // Shapes are rasterized row by row: the Z span of every X/Y row is computed
+    // analytically and filled directly in chunk storage.
+    void fill_ball(Vector<int> const& center, double radius, BlockHandle block);
+    void fill_ellipsoid(Vector<int> const& center, Vector<double> const& radii, BlockHandle block);
+    // Cylinder and cone are vertical and `height` + 1 blocks high; the cone narrows upwards.
+    void fill_cylinder(Vector<int> const& bottom_side_center, double radius, double height, BlockHandle block);
+    void fill_cone(Vector<int> const& bottom_side_center, double radius, double height, BlockHandle block);
+    // Horizontal torus: blocks closer than `minor_radius` to a circle of `major_radius` around `center`.
+    void fill_torus(Vector<int> const& center, double major_radius, double minor_radius, BlockHandle block);
+    // Blocks closer than `radius` to the segment from `start` to `end`.
+    void fill_capsule(Vector<int> const& start, Vector<int> const& end, double radius, BlockHandle block);
+
+    // Stores a box of blocks given as indices into `palette`, in the order used by
+    // schematic formats (X changes fastest, then Z, then Y). `decode(uint32_t* output,
+    // size_t count)` should write the next `count` indices and return false on error.
+    // Blocks are decoded a chunk layer at a time and copied directly into chunks.
+    // Returns false if decoding failed or an index was out of range.
+    template<class Decode>
+    bool set_blocks_from_indices(Vector<int> const& origin, Vector<int> const& size, std::vector<BlockDescriptor> const& palette, Decode&& decode)
+    {
+        std::vector<uint32_t> layers;
+        for(int y = 0; y < size.y;)
+        {
+            int layer_count = std::min(size.y - y, Chunk::SIZE - static_cast<int>(chunk_offset_from_block({0, origin.y + y, 0}).y));
+            layers.resize(static_cast<size_t>(size.x) * size.z * layer_count);
+            if(!decode(layers.data(), layers.size()))
+                return false;
+            for(auto index: layers)
+            {
+                if(index >= palette.size())
+                    return false;
             }
+            store_index_layers(origin, size, y, layer_count, layers, palette);
+            y += layer_count;
         }
+        return true;
     }
 
-    void fill_ball(Vector<int> const& center, double radius, Block const& block);
-    void fill_cylinder(Vector<int> const& bottom_side_center, double radius, double height, Block const& block);
+    // The same with a palette of blocks. Invalid handles are stored as Empty.
+    template<class Decode>
+    bool set_blocks_from_indices(Vector<int> const& origin, Vector<int> const& size, std::vector<BlockHandle> const& blocks, Decode&& decode)
+    {
+        std::vector<BlockDescriptor> palette;
+        palette.reserve(blocks.size());
+        for(auto block: blocks)
+            palette.push_back(block.is_valid() ? BlockDescriptor::create_block(ensure_index(block)) : BlockDescriptor::create_empty());
+        return set_blocks_from_indices(origin, size, palette, std::forward<Decode>(decode));
+    }
 
     void set_block_descriptor_at(Vector<int> const&, BlockDescriptor);
+    // Splits the box into per-chunk boxes and fills them directly in chunk storage.
+    void fill_block_descriptors_at(Vector<int> const& start, Vector<int> const& end, BlockDescriptor);
     BlockDescriptor ensure_block_descriptor_at(Vector<int> const&);
-    BlockDescriptor* get_block_descriptor_at(Vector<int> const&);
-    BlockDescriptor const* get_block_descriptor_at(Vector<int> const&) const;
+    std::optional<BlockDescriptor> get_block_descriptor_at(Vector<int> const&) const;
 
     Chunk& ensure_chunk_at(Vector<int> const& chunk_position);
     Chunk* get_chunk_at(Vector<int> const& chunk_position);
     Chunk const* get_chunk_at(Vector<int> const& chunk_position) const;
 
+    // Dirty chunk tracking, for incremental generation, based on Chunk::generation().
+    // checkpoint() ends the current generation and returns it; dirty_chunks_since()
+    // then lists chunks modified after it. Only loaded chunks are checked, since chunks
+    // that are still in a snapshot are unmodified.
+    uint64_t checkpoint() { return Chunk::advance_generation(); }
+    std::vector<Vector<int>> dirty_chunks_since(uint64_t checkpoint) const;
+
+    size_t chunk_count() const { return m_chunks.size(); }
+    ChunkMap const& chunks() const { return m_chunks; }
+
+    // Approximate memory used by block storage of all chunks, in bytes.
+    size_t memory_usage() const;
+
+    // Saves blocks, markers and chunks to a snapshot file. If this container was loaded
+    // from (or last saved to) `path`, only chunks modified since then are written,
+    // appended to the file; saving to another path compacts it.
+    bool save_snapshot(std::string const& path);
+    // Replaces the contents of this container with a snapshot. The file is memory-mapped,
+    // and chunks are decoded when first accessed.
+    bool load_snapshot(std::string const& path);
+
+    // Compacts storage of all chunks (see Chunk::optimize()).
+    void optimize_chunks();
+
+    // Compacts all chunks, then makes chunks with equal layouts (found by content
+    // hash) share one index array. Returns how many chunks now share an array
+    // with an earlier chunk.
+    size_t deduplicate_chunks();
+
     // TODO: Handle y chunks
-    static Vector<int> chunk_position_from_block(Vector<int> const&);
-    static Vector<unsigned> chunk_offset_from_block(Vector<int> const&);
+    // Chunk::SIZE is a power of two, so these are floor division and modulo.
+    static Vector<int> chunk_position_from_block(Vector<int> const& position)
+    {
+        return {position.x >> Chunk::SIZE_SHIFT, position.y >> Chunk::SIZE_SHIFT, position.z >> Chunk::SIZE_SHIFT};
+    }
+    static Vector<unsigned> chunk_offset_from_block(Vector<int> const& position)
+    {
+        constexpr int MASK = Chunk::SIZE - 1;
+        return {static_cast<unsigned>(position.x & MASK), static_cast<unsigned>(position.y & MASK), static_cast<unsigned>(position.z & MASK)};
+    }
     static Vector<int> block_from_chunk_position_and_offset(Vector<int> const& position, Vector<unsigned> const& offset = {});
 
-    std::optional<Block> block_from_index(uint16_t) const;
-    std::optional<uint16_t> index_of(Block const&) const;
+    std::optional<BlockHandle> block_from_index(uint16_t) const;
+    std::optional<uint16_t> index_of(BlockHandle) const;
 
-    void set_marker(uint16_t index, Block const&);
-    void set_marker(Color const& color, Block const& block) { set_marker(marker_index_from_color(color), block); }
+    void set_marker(uint16_t index, BlockHandle);
+    void set_marker(Color const& color, BlockHandle block) { set_marker(marker_index_from_color(color), block); }
 
-    std::optional<Block> block_from_marker_index(uint16_t index) const;
-    std::optional<Block> block_from_marker_color(Color const& color) { return block_from_marker_index(marker_index_from_color(color)); }
+    std::optional<BlockHandle> block_from_marker_index(uint16_t index) const;
+    // Block that the generator places for a Block or Marker descriptor.
+    std::optional<BlockHandle> block_from_descriptor(BlockDescriptor) const;
+    std::optional<BlockHandle> block_from_marker_color(Color const& color) { return block_from_marker_index(marker_index_from_color(color)); }
 
     static uint16_t marker_index_from_color(Color const& color);
 
 protected:
+    static constexpr size_t PARALLEL_FILL_BATCH_SIZE = 64;
+
+    // Z run of blocks in a chunk, `start` and `end_z` inclusive.
+    struct ChunkRun
+    {
+        Vector<unsigned> start;
+        unsigned end_z;
+        BlockHandle block;
+    };
+
+    // Copies layers [y, y + layer_count) (all in one chunk layer) of a box given to
+    // set_blocks_from_indices() to chunks.
+    void store_index_layers(Vector<int> const& origin, Vector<int> const& size, int y, int layer_count, std::vector<uint32_t> const& layers, std::vector<BlockDescriptor> const& palette);
+
+    // Assigns indices to new blocks of runs in the first `count` chunks (in order), then
+    // writes the runs to their chunks in parallel. Chunks without runs may be null.
+    void commit_chunk_runs(std::vector<Chunk*> const& chunks, std::vector<std::vector<ChunkRun>> const& chunk_runs, size_t count, unsigned thread_count);
+
+    // Calls `row_spans(x, y, fill_span)` for every X/Y row of the box between `start`
+    // and `end`. It should call `fill_span(z_start, z_end)` (inclusive) for every part
+    // of the row that belongs to the shape.
+    template<class RowSpans>
+    void fill_rows(Vector<int> const& start, Vector<int> const& end, BlockHandle block, RowSpans&& row_spans)
+    {
+        auto descriptor = BlockDescriptor::create_block(ensure_index(block));
+        for(int x = std::min(start.x, end.x); x <= std::max(start.x, end.x); x++)
+        {
+            for(int y = std::min(start.y, end.y); y <= std::max(start.y, end.y); y++)
+            {
+                row_spans(x, y, [&](int z_start, int z_end) {
+                    if(z_start <= z_end)
+                        fill_block_descriptors_at({x, y, z_start}, {x, y, z_end}, descriptor);
+                });
+            }
+        }
+    }
+
     void initialize_chunk(Chunk&) const;
-    uint16_t generate_index(Block const&);
+    uint16_t generate_index(BlockHandle);
+    uint16_t ensure_index(BlockHandle);
+
+    // Block index N is stored at [N - 1].
+    std::vector<BlockHandle> m_index_to_block;
+    ChunkMap m_chunks;
 
-    std::unordered_map<uint16_t, Block> m_index_to_block;
-    std::unordered_map<Vector<int>, Chunk> m_chunks;
+    std::unordered_map<uint16_t, BlockHandle> m_marker_index_to_block;
 
-    std::unordered_map<uint16_t, Block> m_marker_index_to_block;
+    // File that chunks not loaded yet come from, and the generation in which it was
+    // loaded or saved: chunks modified after that have to be saved again.
+    std::shared_ptr<SnapshotFile> m_snapshot;
+    uint64_t m_snapshot_generation = 0;
 
 private:
-    std::unordered_map<Block, uint16_t> m_block_to_index;
-    uint16_t m_current_index = 0;
+    // Indexed by BlockHandle::id(), 0 means that the block has no index yet.
+    std::vector<uint16_t> m_block_to_index;
+
 };
 
 }
@@ -0,0 +1,82 @@
+#include <evogen/BlockHandle.h>
+
+#include <cassert>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace evo
+{
+
+namespace
+{
+
+struct BlockTableEntry
+{
+    Block block;
+    std::string command_format;
+};
+
+class BlockTable
+{
+public:
+    BlockTable()
+    {
+        // Id 0 is reserved for invalid handles.
+        m_entries.emplace_back();
+    }
+
+    uint32_t intern(Block const& block)
+    {
+        {
+            std::shared_lock lock(m_mutex);
+            auto it = m_ids.find(block);
+            if(it != m_ids.end())
+                return it->second;
+        }
+        std::unique_lock lock(m_mutex);
+        auto result = m_ids.try_emplace(block, m_entries.size());
+        if(result.second)
+            m_entries.push_back({block, block.to_command_format()});
+        return result.first->second;
+    }
+
+    BlockTableEntry const& entry(uint32_t id) const
+    {
+        std::shared_lock lock(m_mutex);
+        assert(id != 0 && id < m_entries.size());
+        // Deque never moves existing elements, so the reference stays valid.
+        return m_entries[id];
+    }
+
+private:
+    mutable std::shared_mutex m_mutex;
+    std::deque<BlockTableEntry> m_entries;
+    std::unordered_map<Block, uint32_t> m_ids;
+};
+
+BlockTable& block_table()
+{
+    static BlockTable table;
+    return table;
+}
+
+}
+
+BlockHandle BlockHandle::intern(Block const& block)
+{
+    return BlockHandle(block_table().intern(block));
+}
+
+Block const& BlockHandle::block() const
+{
+    return block_table().entry(m_id).block;
+}
+
+std::string const& BlockHandle::to_command_format() const
+{
+    return block_table().entry(m_id).command_format;
+}
+
+}
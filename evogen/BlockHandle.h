@@ -0,0 +1,63 @@
+#pragma once
+
+#include <evogen/Block.h>
+
+#include <cstdint>
+#include <string>
+
+namespace evo
+{
+
+// A Block interned in the global block table. Handles are 4 bytes and trivially
+// copyable; two handles are equal iff they refer to equal Blocks. Interning is
+// thread-safe, but it hashes the block's strings, so convert once and then pass
+// handles around in hot paths.
+class BlockHandle
+{
+public:
+    // Invalid handle, doesn't refer to any block.
+    BlockHandle() = default;
+
+    BlockHandle(Block const& block)
+    : BlockHandle(intern(block)) {}
+
+    BlockHandle(std::string const& id, BlockStates const& states = {}, std::string const& nbt = "")
+    : BlockHandle(Block(id, states, nbt)) {}
+
+    BlockHandle(VanillaBlock type, BlockStates const& states = {}, std::string const& nbt = "")
+    : BlockHandle(Block(type, states, nbt)) {}
+
+    static BlockHandle intern(Block const&);
+
+    bool is_valid() const { return m_id != 0; }
+    uint32_t id() const { return m_id; }
+
+    Block const& block() const;
+
+    // Cached Block::to_command_format().
+    std::string const& to_command_format() const;
+
+    bool operator==(BlockHandle const& other) const { return m_id == other.m_id; }
+
+private:
+    explicit BlockHandle(uint32_t id)
+    : m_id(id) {}
+
+    uint32_t m_id = 0;
+};
+
+}
+
+namespace std
+{
+
+template<>
+struct hash<evo::BlockHandle>
+{
+    size_t operator()(evo::BlockHandle const& handle) const
+    {
+        return std::hash<uint32_t>()(handle.id());
+    }
+};
+
+}
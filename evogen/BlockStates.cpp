@@ -1,6 +1,6 @@
 #include <evogen/BlockStates.h>
 
-#include <cassert>
+#include <functional>
 #include <sstream>
 
 namespace evo
@@ -8,8 +8,20 @@ namespace evo
 
 BlockStates BlockStates::from_string(std::string const& input)
 {
-    // TODO
-    assert(false);
+    // "name=value,name=value"
+    BlockStates states;
+    size_t start = 0;
+    while(start < input.size())
+    {
+        auto end = input.find(',', start);
+        if(end == std::string::npos)
+            end = input.size();
+        auto separator = input.find('=', start);
+        if(separator != std::string::npos && separator < end)
+            states.set_state(input.substr(start, separator - start), input.substr(separator + 1, end - separator - 1));
+        start = end + 1;
+    }
+    return states;
 }
    
 std::string BlockStates::to_string() const
@@ -26,4 +38,15 @@ std::string BlockStates::to_string() const
     return oss.str();
 }
 
+size_t BlockStates::hash() const
+{
+    size_t result = 0;
+    for(auto& state: m_states)
+    {
+        result = result * 31 + std::hash<std::string>()(state.first);
+        result = result * 31 + std::hash<std::string>()(state.second);
+    }
+    return result;
+}
+
 }
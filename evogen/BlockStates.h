@@ -15,10 +15,17 @@ public:
 
     std::string state(std::string const& name) const { auto it = m_states.find(name); if(it == m_states.end()) return ""; return it->second; }
     void set_state(std::string const& name, std::string const& value) { m_states[name] = value; }
+    void remove_state(std::string const& name) { m_states.erase(name); }
 
     std::string to_string() const;
 
-    bool operator==(BlockStates const& other) { return other.m_states == m_states; }
+    // (name, value) pairs, sorted by name.
+    auto begin() const { return m_states.begin(); }
+    auto end() const { return m_states.end(); }
+
+    bool operator==(BlockStates const& other) const { return other.m_states == m_states; }
+
+    size_t hash() const;
 
 private:
     std::map<std::string, std::string> m_states;
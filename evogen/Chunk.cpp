@@ -1,84 +1,416 @@
 #include <evogen/Chunk.h>
 
-#include <evogen/Generator.h>
-#include <evogen/World.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <bitset>
+#include <climits>
+#include <cstdint>
+#include <optional>
 
 namespace evo
 {
 
-void Chunk::generate_tasks(World const& world, Generator& generator) const
+// Smallest supported index width that can address `palette_size` entries.
+static unsigned bits_for_palette_size(size_t palette_size)
 {
-    // TODO: Handle compression in x,y axis (the full of blocks chunk expands to 32*32=1024 /fills now)
-    // TODO: Reset handle flag on finish
+    unsigned bits = std::bit_width(palette_size - 1);
+    return std::max(1u, std::bit_ceil(bits));
+}
+
+// Starts at 1, so that 0 is older than every checkpoint.
+static std::atomic<uint64_t> s_generation = 1;
+
+uint64_t Chunk::current_generation()
+{
+    return s_generation.load(std::memory_order_relaxed);
+}
+
+uint64_t Chunk::advance_generation()
+{
+    return s_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Chunk::set_block_at(Vector<unsigned> const& position, BlockDescriptor block)
+{
+    assert(position.x < SIZE && position.y < SIZE && position.z < SIZE);
+    if(is_uniform() && m_palette[0] == block)
+        return;
+    auto palette_index = ensure_palette_index(block);
+    mutable_indices().set(index_of(position), palette_index);
+    m_generation = current_generation();
+}
+
+void Chunk::fill_blocks_at(Vector<unsigned> const& start, Vector<unsigned> const& end, BlockDescriptor block)
+{
+    assert(start.x <= end.x && start.y <= end.y && start.z <= end.z);
+    assert(end.x < SIZE && end.y < SIZE && end.z < SIZE);
+    if(start == Vector<unsigned>{0, 0, 0} && end == Vector<unsigned>{SIZE - 1, SIZE - 1, SIZE - 1})
+    {
+        m_palette = { block };
+        m_indices = nullptr;
+        m_generation = current_generation();
+        return;
+    }
+    if(is_uniform() && m_palette[0] == block)
+        return;
+
+    m_generation = current_generation();
+    auto palette_index = ensure_palette_index(block);
+    auto& indices = mutable_indices();
+    size_t span = end.z - start.z + 1;
+    for(unsigned x = start.x; x <= end.x; x++)
+    {
+        for(unsigned y = start.y; y <= end.y; y++)
+            indices.fill(index_of({x, y, start.z}), span, palette_index);
+    }
+}
+
+void Chunk::set_blocks_at(Vector<unsigned> const& start, Vector<unsigned> const& end, uint32_t const* indices, std::vector<BlockDescriptor> const& palette)
+{
+    assert(start.x <= end.x && start.y <= end.y && start.z <= end.z);
+    assert(end.x < SIZE && end.y < SIZE && end.z < SIZE);
+    size_t count = static_cast<size_t>(end.x - start.x + 1) * (end.y - start.y + 1) * (end.z - start.z + 1);
+
+    // Our palette index for every entry of `palette` that is used. Palette entries are
+    // added before touching the index array, since adding them may resize it. Compact
+    // first if they may not fit at all, and not while mapping, where it would renumber
+    // entries that are already mapped.
+    if(m_palette.size() + palette.size() > size_t{1} << 16)
+        optimize();
+    thread_local std::vector<uint32_t> palette_map;
+    palette_map.assign(palette.size(), UINT32_MAX);
+    bool only_first = true;
+    for(size_t index = 0; index < count; index++)
+    {
+        auto& mapped = palette_map[indices[index]];
+        if(mapped == UINT32_MAX)
+        {
+            mapped = ensure_palette_index(palette[indices[index]], false);
+            only_first = only_first && mapped == 0;
+        }
+    }
+    if(is_uniform() && only_first)
+        return;
+
+    m_generation = current_generation();
+    auto& array = mutable_indices();
+    size_t index = 0;
+    for(unsigned x = start.x; x <= end.x; x++)
+    {
+        for(unsigned y = start.y; y <= end.y; y++)
+        {
+            for(unsigned z = start.z; z <= end.z; z++)
+                array.set(index_of({x, y, z}), palette_map[indices[index++]]);
+        }
+    }
+}
+
+void Chunk::get_indices_at(Vector<unsigned> const& start, Vector<unsigned> const& end, uint32_t* indices) const
+{
+    assert(start.x <= end.x && start.y <= end.y && start.z <= end.z);
+    assert(end.x < SIZE && end.y < SIZE && end.z < SIZE);
+    unsigned count = end.z - start.z + 1;
+    for(unsigned x = start.x; x <= end.x; x++)
+    {
+        for(unsigned y = start.y; y <= end.y; y++)
+        {
+            if(is_uniform())
+                std::fill_n(indices, count, 0);
+            else
+                m_indices->get(index_of({x, y, start.z}), count, indices);
+            indices += count;
+        }
+    }
+}
+
+uint32_t Chunk::ensure_palette_index(BlockDescriptor block, bool compact)
+{
+    for(size_t index = 0; index < m_palette.size(); index++)
+    {
+        if(m_palette[index] == block)
+            return index;
+    }
+
+    // The index array is full: drop stale entries before making it wider. Only keep
+    // the width if that freed a quarter of it, so that a palette that is almost all in
+    // use doesn't get compacted again for every new entry.
+    if(compact && !is_uniform() && m_palette.size() == size_t{1} << m_indices->bits())
+    {
+        auto old_size = m_palette.size();
+        optimize();
+        if(!is_uniform() && m_palette.size() > old_size - old_size / 4 && m_indices->bits() < 16)
+            m_indices = std::make_shared<PackedArray>(m_indices->resized(bits_for_palette_size(old_size + 1)));
+    }
+
+    m_palette.push_back(block);
+    if(is_uniform())
+        m_indices = std::make_shared<PackedArray>(VOLUME, 1);
+    else if(m_palette.size() > size_t{1} << m_indices->bits())
+        m_indices = std::make_shared<PackedArray>(m_indices->resized(bits_for_palette_size(m_palette.size())));
+    return m_palette.size() - 1;
+}
+
+PackedArray& Chunk::mutable_indices()
+{
+    assert(m_indices);
+    if(m_indices.use_count() > 1)
+        m_indices = std::make_shared<PackedArray>(*m_indices);
+    else
+    {
+        // The last other owner may have just dropped its reference in another thread;
+        // make sure its reads happen before our writes.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *m_indices;
+}
+
+Chunk Chunk::with_palette(std::vector<BlockDescriptor> palette) const
+{
+    assert(palette.size() == m_palette.size());
+    Chunk result(*this);
+    result.m_palette = std::move(palette);
+    result.m_generation = current_generation();
+    return result;
+}
+
+void Chunk::optimize()
+{
+    if(is_uniform())
+        return;
+
+    // Palette entries get new indices in order of first use; 0 means unused.
+    auto& indices = *m_indices;
+    std::vector<uint32_t> remap(m_palette.size(), 0);
+    std::vector<BlockDescriptor> new_palette;
+    for(size_t index = 0; index < VOLUME; index++)
+    {
+        auto& new_index = remap[indices.get(index)];
+        if(new_index == 0)
+        {
+            new_palette.push_back(m_palette[indices.get(index)]);
+            new_index = new_palette.size();
+        }
+    }
+
+    if(new_palette.size() == 1)
+    {
+        m_palette = std::move(new_palette);
+        m_indices = nullptr;
+        return;
+    }
+
+    auto new_bits = bits_for_palette_size(new_palette.size());
+    bool identity = new_bits == indices.bits();
+    for(size_t index = 0; index < m_palette.size() && identity; index++)
+        identity = remap[index] == 0 || remap[index] == index + 1;
+    m_palette = std::move(new_palette);
+    // Don't unshare the index array if nothing changes.
+    if(identity)
+        return;
+
+    auto new_indices = std::make_shared<PackedArray>(VOLUME, new_bits);
+    for(size_t index = 0; index < VOLUME; index++)
+        new_indices->set(index, remap[indices.get(index)] - 1);
+    m_indices = std::move(new_indices);
+}
+
+size_t Chunk::indices_hash() const
+{
+    return m_indices ? m_indices->hash() : 0;
+}
+
+bool Chunk::share_indices_with(Chunk const& other)
+{
+    if(!m_indices || !other.m_indices)
+        return false;
+    if(m_indices != other.m_indices)
+    {
+        if(!(*m_indices == *other.m_indices))
+            return false;
+        m_indices = other.m_indices;
+    }
+    return true;
+}
+
+bool Chunk::has_same_indices(Chunk const& other) const
+{
+    if(!m_indices || !other.m_indices)
+        return !m_indices && !other.m_indices;
+    return m_indices == other.m_indices || *m_indices == *other.m_indices;
+}
+
+// Little-endian: palette size (u32), palette entries (kind u8, arg u16), index bits
+// (u8, 0 for uniform chunks), then the index array words (u64).
+void Chunk::serialize(std::vector<uint8_t>& output) const
+{
+    auto append = [&](uint64_t value, int size) {
+        for(int byte = 0; byte < size; byte++, value >>= 8)
+            output.push_back(static_cast<uint8_t>(value));
+    };
+    append(m_palette.size(), 4);
+    for(auto& descriptor: m_palette)
+    {
+        append(descriptor.kind, 1);
+        append(descriptor.arg, 2);
+    }
+    append(m_indices ? m_indices->bits() : 0, 1);
+    if(m_indices)
+    {
+        for(auto word: m_indices->words())
+            append(word, 8);
+    }
+}
+
+bool Chunk::deserialize(uint8_t const* data, size_t size)
+{
+    auto end = data + size;
+    auto read = [&](int size) -> std::optional<uint64_t> {
+        if(end - data < size)
+            return {};
+        uint64_t value = 0;
+        for(int byte = size - 1; byte >= 0; byte--)
+            value = value << 8 | data[byte];
+        data += size;
+        return value;
+    };
+
+    auto palette_size = read(4);
+    if(!palette_size || *palette_size == 0 || *palette_size > size_t{1} << 16)
+        return false;
+    std::vector<BlockDescriptor> palette(*palette_size);
+    for(auto& descriptor: palette)
+    {
+        auto kind = read(1);
+        auto arg = read(2);
+        if(!arg || *kind > BlockDescriptor::Marker)
+            return false;
+        descriptor.kind = static_cast<BlockDescriptor::Kind>(*kind);
+        descriptor.arg = *arg;
+    }
+
+    auto bits = read(1);
+    if(!bits)
+        return false;
+    std::shared_ptr<PackedArray> indices;
+    if(*bits != 0)
+    {
+        if(*bits > 16 || !std::has_single_bit(*bits) || palette.size() > size_t{1} << *bits)
+            return false;
+        indices = std::make_shared<PackedArray>(VOLUME, *bits);
+        if(static_cast<size_t>(end - data) != indices->words().size() * 8)
+            return false;
+        for(auto& word: indices->words())
+            word = *read(8);
+        // Every index must be in the palette.
+        std::vector<uint32_t> row(SIZE);
+        for(size_t index = 0; index < VOLUME; index += SIZE)
+        {
+            indices->get(index, SIZE, row.data());
+            for(auto value: row)
+            {
+                if(value >= palette.size())
+                    return false;
+            }
+        }
+    }
+    else if(data != end)
+        return false;
+
+    m_palette = std::move(palette);
+    m_indices = std::move(indices);
+    return true;
+}
+
+size_t Chunk::memory_usage() const
+{
+    size_t result = sizeof(Chunk) + m_palette.capacity() * sizeof(BlockDescriptor);
+    if(m_indices)
+        result += (sizeof(PackedArray) + m_indices->memory_usage()) / m_indices.use_count();
+    return result;
+}
+
+size_t Chunk::generate_boxes(std::vector<BlockBox>& boxes, ScanBuffers& buffers) const
+{
+    if(is_uniform())
+    {
+        if(!m_palette[0].is_placeable())
+            return 0;
+        boxes.push_back({{0, 0, 0}, {SIZE - 1, SIZE - 1, SIZE - 1}, m_palette[0]});
+        return SIZE * SIZE;
+    }
+
+    // Palette entries are unique, so comparing palette indices is enough.
+    auto& indices = buffers.indices;
+    auto& visited = buffers.visited;
+    visited.reset();
+    for(size_t index = 0; index < VOLUME; index++)
+        indices[index] = m_indices->get(index);
+    std::vector<bool> placeable(m_palette.size());
+    for(size_t index = 0; index < m_palette.size(); index++)
+        placeable[index] = m_palette[index].is_placeable();
+
+    auto matches = [&](size_t index, uint16_t palette_index) {
+        return !visited[index] && indices[index] == palette_index;
+    };
+    auto row_matches = [&](unsigned x, unsigned y, unsigned z0, unsigned z1, uint16_t palette_index) {
+        for(unsigned z = z0; z <= z1; z++)
+        {
+            if(!matches(index_of({x, y, z}), palette_index))
+                return false;
+        }
+        return true;
+    };
+
+    size_t z_runs = 0;
     for(unsigned y = 0; y < SIZE; y++)
     {
         for(unsigned x = 0; x < SIZE; x++)
         {
-            size_t same_blocks = 0;
-            uint16_t last_block_index = 0;
-            std::optional<Block> last_block;
-            int saved_z = -1;
-            for(unsigned z = 0; z < SIZE + 1; z++)
+            for(unsigned z = 0; z < SIZE; z++)
             {
-                auto& block_descriptor = z == SIZE ? BlockDescriptor{} : block_at({x, y, z});
-                if(block_descriptor.flags.handled)
+                auto index = index_of({x, y, z});
+                auto palette_index = indices[index];
+                if(!placeable[palette_index])
                     continue;
-                block_descriptor.flags.handled = true;
-                static auto save = [&]() {
-                    if(last_block.has_value())
-                    {
-                        assert(same_blocks >= 1);
-                        if(same_blocks == 1)
-                            generator.add_task<PlaceBlockTask>(
-                                last_block.value(),
-                                Vector<int>{static_cast<int>(x), static_cast<int>(y), static_cast<int>(saved_z)});
-                        else
-                            generator.add_task<FillBlocksTask>(
-                                last_block.value(),
-                                Vector<int>{static_cast<int>(x), static_cast<int>(y), saved_z},
-                                Vector<int>{static_cast<int>(x), static_cast<int>(y), static_cast<int>(z - 1)});
-                    }
-                    same_blocks = 0;
-                    last_block_index = 0;
-                    last_block = {};
-                    saved_z = -1;
-                };
-                switch(block_descriptor.kind)
+                if(z == 0 || indices[index - 1] != palette_index)
+                    z_runs++;
+                if(visited[index])
+                    continue;
+
+                unsigned z1 = z;
+                while(z1 + 1 < SIZE && matches(index + z1 + 1 - z, palette_index))
+                    z1++;
+                unsigned x1 = x;
+                while(x1 + 1 < SIZE && row_matches(x1 + 1, y, z, z1, palette_index))
+                    x1++;
+                unsigned y1 = y;
+                while(y1 + 1 < SIZE)
                 {
-                    case BlockDescriptor::Empty:
-                    case BlockDescriptor::Height:
-                        save();
+                    bool layer_matches = true;
+                    for(unsigned bx = x; bx <= x1 && layer_matches; bx++)
+                        layer_matches = row_matches(bx, y1 + 1, z, z1, palette_index);
+                    if(!layer_matches)
                         break;
-                    case BlockDescriptor::Marker:
-                    case BlockDescriptor::Block:
+                    y1++;
+                }
+
+                for(unsigned bx = x; bx <= x1; bx++)
+                {
+                    for(unsigned by = y; by <= y1; by++)
                     {
-                        if(last_block_index == block_descriptor.arg)
-                        {
-                            same_blocks++;
-                        }
-                        else
-                        {
-                            if(last_block_index != 0)
-                                save();
-                            last_block_index = block_descriptor.arg;
-                            if(block_descriptor.kind == BlockDescriptor::Marker)
-                                last_block = world.block_from_marker_index(last_block_index);
-                            else
-                                last_block = world.block_from_index(last_block_index);
-                            if(!last_block.has_value())
-                            {
-                                std::cout << "ERROR: No block for " << (block_descriptor.kind == BlockDescriptor::Marker ? "marker" : "block")
-                                    << " index " << last_block_index << std::endl;
-                                assert(false);
-                            }
-                            saved_z = z;
-                            same_blocks = 1;
-                        }
+                        for(unsigned bz = z; bz <= z1; bz++)
+                            visited[index_of({bx, by, bz})] = true;
                     }
                 }
+                boxes.push_back({
+                    {static_cast<int>(x), static_cast<int>(y), static_cast<int>(z)},
+                    {static_cast<int>(x1), static_cast<int>(y1), static_cast<int>(z1)},
+                    m_palette[palette_index]});
             }
         }
     }
+    return z_runs;
 }
 
 }
@@ -1,18 +1,16 @@
 #pragma once
 
+#include <evogen/PackedArray.h>
 #include <evogen/Vector.h>
 
+#include <bitset>
 #include <cassert>
+#include <memory>
+#include <vector>
 
 namespace evo
 {
 
-struct BlockDescriptorFlags
-{
-    mutable uint8_t handled : 1 = 0;  // Already handled by generator
-    uint8_t reserved : 7 = 0;
-};
-
 class BlockDescriptor
 {
 public:
@@ -26,43 +24,154 @@ public:
     };
 
     Kind kind = Empty;
-    BlockDescriptorFlags flags;
     uint16_t arg = 0;
 
     static BlockDescriptor create_empty() { return BlockDescriptor{.kind = Empty}; }
     static BlockDescriptor create_block(uint16_t index) { return BlockDescriptor{.kind = Block, .arg = index}; }
     static BlockDescriptor create_heightmap(uint16_t index) { return BlockDescriptor{.kind = Height, .arg = index}; }
     static BlockDescriptor create_marker(uint16_t index) { return BlockDescriptor{.kind = Marker, .arg = index}; }
+
+    bool operator==(BlockDescriptor const& other) const { return kind == other.kind && arg == other.arg; }
+
+    // Whether the generator places something for this descriptor.
+    bool is_placeable() const { return kind == Block || kind == Marker; }
 };
 
-class Generator;
-class World;
+// Box of identical blocks, `start` and `end` inclusive.
+struct BlockBox
+{
+    Vector<int> start;
+    Vector<int> end;
+    BlockDescriptor block;
+
+    size_t volume() const
+    {
+        return static_cast<size_t>(end.x - start.x + 1) * (end.y - start.y + 1) * (end.z - start.z + 1);
+    }
+};
 
 // These chunks != Minecraft chunks!
+// Blocks are stored as indices into a per-chunk palette of descriptors, bit-packed
+// with as few bits as the palette needs. A chunk that contains only one descriptor
+// (e.g a fresh, all-Empty chunk) has no index array at all.
+//
+// Index arrays are copy-on-write: copies of a chunk (and chunks deduplicated with
+// share_indices_with()) refer to the same array until one of them is modified.
+// Palettes are small and always owned by the chunk, so chunks with the same layout
+// but different blocks can share an index array, too.
 class Chunk
 {
 public:
-    static constexpr int SIZE = 32;
+    static constexpr int SIZE_SHIFT = 5;
+    static constexpr int SIZE = 1 << SIZE_SHIFT;
+    static constexpr int VOLUME = SIZE * SIZE * SIZE;
 
     Chunk() = default;
     explicit Chunk(Chunk const& other) = default;
+    Chunk(Chunk&&) = default;
+    Chunk& operator=(Chunk const&) = default;
+    Chunk& operator=(Chunk&&) = default;
 
-    BlockDescriptor& block_at(Vector<unsigned> const& position)
+    BlockDescriptor block_at(Vector<unsigned> const& position) const
     {
         assert(position.x < SIZE && position.y < SIZE && position.z < SIZE);
-        return m_blocks[position.x][position.y][position.z];
+        if(is_uniform())
+            return m_palette[0];
+        return m_palette[m_indices->get(index_of(position))];
     }
 
-    BlockDescriptor const& block_at(Vector<unsigned> const&  position) const
+    void set_block_at(Vector<unsigned> const& position, BlockDescriptor);
+
+    // Fills the box between `start` and `end` (inclusive, start <= end on every axis).
+    // A fill that covers the whole chunk makes it uniform.
+    void fill_blocks_at(Vector<unsigned> const& start, Vector<unsigned> const& end, BlockDescriptor);
+
+    // Sets blocks of the box between `start` and `end` to palette[indices[N]], where N
+    // goes over the box in storage order (Z fastest, then Y, then X). All indices
+    // must be valid.
+    void set_blocks_at(Vector<unsigned> const& start, Vector<unsigned> const& end, uint32_t const* indices, std::vector<BlockDescriptor> const& palette);
+
+    // Writes palette indices of the box between `start` and `end` to `indices`, in
+    // storage order (like set_blocks_at()).
+    void get_indices_at(Vector<unsigned> const& start, Vector<unsigned> const& end, uint32_t* indices) const;
+
+    bool is_uniform() const { return !m_indices; }
+    size_t palette_size() const { return m_palette.size(); }
+    std::vector<BlockDescriptor> const& palette() const { return m_palette; }
+
+    // Copy of this chunk (sharing the index array) with palette entry N replaced by
+    // palette[N]. Entries of `palette` must be unique.
+    Chunk with_palette(std::vector<BlockDescriptor> palette) const;
+
+    // Removes palette entries that are no longer used and shrinks the index array
+    // (or drops it entirely if only one descriptor is left). Palette entries are
+    // ordered by first use, so chunks with the same layout get equal index arrays.
+    void optimize();
+
+    // Hash of the index array, 0 for uniform chunks.
+    size_t indices_hash() const;
+    // Makes this chunk refer to the index array of `other` if they are equal.
+    // Returns true if the arrays are shared now.
+    bool share_indices_with(Chunk const& other);
+    bool shares_indices_with(Chunk const& other) const { return m_indices && m_indices == other.m_indices; }
+    // Whether the index arrays are equal (or both chunks are uniform). Shared arrays
+    // are compared by pointer only.
+    bool has_same_indices(Chunk const& other) const;
+
+    // Generation in which the chunk was created or last modified. Generations are
+    // counted globally and only ever increase (see BlockContainer::checkpoint()), so
+    // stamps of chunks in different containers compare too. Changes that keep all
+    // blocks (optimize(), sharing) don't count. Chunks loaded from storage are marked
+    // unmodified (generation 0), older than any checkpoint.
+    uint64_t generation() const { return m_generation; }
+    void mark_unmodified() { m_generation = 0; }
+    bool is_modified_since(uint64_t generation) const { return m_generation > generation; }
+
+    static uint64_t current_generation();
+    // Starts a new generation; returns the one that ended.
+    static uint64_t advance_generation();
+
+    // Compact binary form of the palette and index array, used by snapshots.
+    void serialize(std::vector<uint8_t>&) const;
+    // Returns false (and leaves the chunk unchanged) if `data` is invalid.
+    bool deserialize(uint8_t const* data, size_t size);
+
+    // Approximate heap + inline memory used by this chunk, in bytes. A shared index
+    // array is split evenly between the chunks that share it.
+    size_t memory_usage() const;
+    static constexpr size_t dense_memory_usage() { return VOLUME * sizeof(BlockDescriptor); }
+
+    // Scratch space of generate_boxes(). A scan overwrites all of it, so one set can be
+    // reused for any number of scans (one at a time).
+    struct ScanBuffers
     {
-        assert(position.x < SIZE && position.y < SIZE && position.z < SIZE);
-        return m_blocks[position.x][position.y][position.z];
-    }
+        std::vector<uint16_t> indices = std::vector<uint16_t>(VOLUME);
+        std::bitset<VOLUME> visited;
+    };
 
-    void generate_tasks(World const& world, Generator&) const;
+    // Greedily covers placeable blocks of this chunk with boxes (relative to chunk
+    // origin): runs along Z are extended along X, then along Y. Appends them to `boxes`
+    // and returns how many Z runs there were, i.e how many commands would be needed
+    // without merging. Doesn't modify the chunk, so chunks can be scanned concurrently,
+    // each scan with its own buffers.
+    size_t generate_boxes(std::vector<BlockBox>& boxes, ScanBuffers&) const;
 
 private:
-    BlockDescriptor m_blocks[SIZE][SIZE][SIZE] = {};
+    static size_t index_of(Vector<unsigned> const& position)
+    {
+        return (position.x * SIZE + position.y) * SIZE + position.z;
+    }
+
+    // Adds `block` to the palette if needed. With `compact`, unused entries may be
+    // dropped first, which renumbers the others.
+    uint32_t ensure_palette_index(BlockDescriptor, bool compact = true);
+    // Index array that can be modified, copied first if it's shared.
+    PackedArray& mutable_indices();
+
+    std::vector<BlockDescriptor> m_palette { BlockDescriptor{} };
+    // Null for uniform chunks.
+    std::shared_ptr<PackedArray> m_indices;
+    uint64_t m_generation = current_generation();
 };
 
 }
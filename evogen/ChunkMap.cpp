@@ -0,0 +1,193 @@
+#include <evogen/ChunkMap.h>
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <iostream>
+#include <mutex>
+#include <tuple>
+
+namespace evo
+{
+
+ChunkMap& ChunkMap::operator=(ChunkMap const& other)
+{
+    // Entries have a const key, so they can't be assigned one by one.
+    if(this != &other)
+        *this = ChunkMap(other);
+    return *this;
+}
+
+ChunkMap& ChunkMap::operator=(ChunkMap&& other)
+{
+    m_entries = std::move(other.m_entries);
+    m_slots = std::move(other.m_slots);
+    m_source = std::move(other.m_source);
+    m_unloaded_count = other.m_unloaded_count.load();
+    m_failed_positions = std::move(other.m_failed_positions);
+    m_last_index = 0;
+    other.m_last_index = 0;
+    other.m_unloaded_count = 0;
+    return *this;
+}
+
+uint64_t ChunkMap::key_of(Vector<int> const& position)
+{
+    [[maybe_unused]] constexpr int LIMIT = 1 << (COORD_BITS - 1);
+    assert(position.x >= -LIMIT && position.x < LIMIT);
+    assert(position.y >= -LIMIT && position.y < LIMIT);
+    assert(position.z >= -LIMIT && position.z < LIMIT);
+    constexpr uint64_t MASK = (uint64_t{1} << COORD_BITS) - 1;
+    return (static_cast<uint64_t>(position.x) & MASK) << (2 * COORD_BITS)
+         | (static_cast<uint64_t>(position.y) & MASK) << COORD_BITS
+         | (static_cast<uint64_t>(position.z) & MASK);
+}
+
+size_t ChunkMap::slot_of(uint64_t key) const
+{
+    // Fibonacci hashing; the top bits are the best mixed ones.
+    auto hash = key * 0x9e3779b97f4a7c15;
+    return hash >> (64 - std::countr_zero(m_slots.size()));
+}
+
+Chunk const* ChunkMap::find_or_load(Vector<int> const& position) const
+{
+    {
+        std::shared_lock lock(m_load_mutex);
+        if(auto chunk = find_loaded(position))
+            return chunk;
+        if(m_unloaded_count == 0 || !m_source->contains(position))
+            return nullptr;
+    }
+    // Another thread may have loaded the chunk (or failed to) in the meantime.
+    std::unique_lock lock(m_load_mutex);
+    if(auto chunk = find_loaded(position))
+        return chunk;
+    if(std::find(m_failed_positions.begin(), m_failed_positions.end(), position) != m_failed_positions.end())
+        return nullptr;
+    return load(position);
+}
+
+Chunk const* ChunkMap::find_loaded(Vector<int> const& position) const
+{
+    if(m_slots.empty())
+        return nullptr;
+    auto key = key_of(position);
+    auto mask = m_slots.size() - 1;
+    for(auto slot = slot_of(key);; slot = (slot + 1) & mask)
+    {
+        auto& it = m_slots[slot];
+        if(it.key == EMPTY_KEY)
+            return nullptr;
+        if(it.key == key)
+        {
+            m_last_index.store(it.index, std::memory_order_relaxed);
+            return &m_entries[it.index].second;
+        }
+    }
+}
+
+std::pair<Chunk*, bool> ChunkMap::try_emplace(Vector<int> const& position)
+{
+    if(auto chunk = find(position))
+        return {chunk, false};
+    return {insert(position), true};
+}
+
+Chunk* ChunkMap::insert(Vector<int> const& position) const
+{
+    if((m_entries.size() + 1) * 2 > m_slots.size())
+        grow();
+
+    auto key = key_of(position);
+    auto mask = m_slots.size() - 1;
+    auto slot = slot_of(key);
+    while(m_slots[slot].key != EMPTY_KEY)
+        slot = (slot + 1) & mask;
+
+    uint32_t index = m_entries.size();
+    m_entries.emplace_back(std::piecewise_construct, std::forward_as_tuple(position), std::forward_as_tuple());
+    m_slots[slot] = {key, index};
+    m_last_index.store(index, std::memory_order_relaxed);
+    return &m_entries.back().second;
+}
+
+Chunk* ChunkMap::load(Vector<int> const& position) const
+{
+    Chunk chunk;
+    Chunk* result = nullptr;
+    if(m_source->load_chunk(position, chunk))
+    {
+        result = insert(position);
+        *result = chunk;
+        result->mark_unmodified();
+    }
+    else
+    {
+        std::cerr << "Could not load chunk " << position.to_string() << std::endl;
+        m_failed_positions.push_back(position);
+    }
+    // Last, so that lookups that don't lock see the complete map once every chunk
+    // is loaded.
+    m_unloaded_count.fetch_sub(1, std::memory_order_release);
+    return result;
+}
+
+bool ChunkMap::load_all() const
+{
+    if(m_unloaded_count > 0)
+    {
+        std::unique_lock lock(m_load_mutex);
+        for(size_t index = 0; m_unloaded_count > 0 && index < m_source->chunk_count(); index++)
+        {
+            auto position = m_source->chunk_position(index);
+            if(!find_loaded(position) && std::find(m_failed_positions.begin(), m_failed_positions.end(), position) == m_failed_positions.end())
+                load(position);
+        }
+    }
+    return failed_count() == 0;
+}
+
+size_t ChunkMap::failed_count() const
+{
+    std::shared_lock lock(m_load_mutex);
+    return m_failed_positions.size();
+}
+
+void ChunkMap::set_source(std::shared_ptr<ChunkSource const> source)
+{
+    m_source = std::move(source);
+    m_unloaded_count = 0;
+    m_failed_positions.clear();
+    if(!m_source)
+        return;
+    if(m_entries.empty())
+        m_unloaded_count = m_source->chunk_count();
+    else
+    {
+        for(size_t index = 0; index < m_source->chunk_count(); index++)
+        {
+            if(!find_loaded(m_source->chunk_position(index)))
+                m_unloaded_count++;
+        }
+    }
+}
+
+void ChunkMap::grow() const
+{
+    std::vector<Slot> old_slots(std::max<size_t>(m_slots.size() * 2, 64));
+    std::swap(old_slots, m_slots);
+
+    auto mask = m_slots.size() - 1;
+    for(auto& it: old_slots)
+    {
+        if(it.key == EMPTY_KEY)
+            continue;
+        auto slot = slot_of(it.key);
+        while(m_slots[slot].key != EMPTY_KEY)
+            slot = (slot + 1) & mask;
+        m_slots[slot] = it;
+    }
+}
+
+}
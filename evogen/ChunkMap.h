@@ -0,0 +1,138 @@
+#pragma once
+
+#include <evogen/Chunk.h>
+#include <evogen/Vector.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+namespace evo
+{
+
+// Chunks that can be loaded into a ChunkMap when they are first accessed, e.g
+// from a snapshot file.
+class ChunkSource
+{
+public:
+    virtual ~ChunkSource() = default;
+
+    virtual size_t chunk_count() const = 0;
+    virtual Vector<int> chunk_position(size_t index) const = 0;
+    virtual bool contains(Vector<int> const&) const = 0;
+    // Loads a chunk that the source contains. Returns false on error.
+    virtual bool load_chunk(Vector<int> const&, Chunk&) const = 0;
+};
+
+// Map from chunk positions to chunks.
+//
+// Chunks are stored in a deque, in insertion order, so pointers to them stay valid
+// when the map grows. Lookups go through an open-addressing (linear probing) table
+// of packed chunk positions, and the last chunk found is remembered, since most
+// accesses (fills, sweeps over a box) hit the same chunk many times in a row.
+//
+// Chunk coordinates must fit in 21 bits (that is, +-2^20 chunks).
+//
+// With a ChunkSource, chunks of the source are loaded on first access (even through
+// const functions, like the lookup cache). Iteration loads all of them. Lookups lock
+// while some chunks are not loaded yet, so const accesses from many threads are safe;
+// inserting chunks isn't. Chunks that fail to load are reported once and then treated
+// as missing.
+class ChunkMap
+{
+public:
+    using Entry = std::pair<Vector<int> const, Chunk>;
+
+    ChunkMap() = default;
+    ChunkMap(ChunkMap const& other)
+    : m_entries(other.m_entries), m_slots(other.m_slots), m_source(other.m_source), m_unloaded_count(other.m_unloaded_count.load())
+    , m_failed_positions(other.m_failed_positions) {}
+    ChunkMap(ChunkMap&& other)
+    : m_entries(std::move(other.m_entries)), m_slots(std::move(other.m_slots)), m_source(std::move(other.m_source)), m_unloaded_count(other.m_unloaded_count.load())
+    , m_failed_positions(std::move(other.m_failed_positions))
+    {
+        other.m_unloaded_count = 0;
+    }
+    ChunkMap& operator=(ChunkMap const& other);
+    ChunkMap& operator=(ChunkMap&& other);
+
+    Chunk* find(Vector<int> const& position)
+    {
+        return const_cast<Chunk*>(std::as_const(*this).find(position));
+    }
+
+    Chunk const* find(Vector<int> const& position) const
+    {
+        // Entries may be appended by loads on other threads.
+        if(m_unloaded_count.load(std::memory_order_acquire) > 0)
+            return find_or_load(position);
+        // The cache is only a hint, so relaxed accesses are enough for concurrent
+        // readers.
+        auto last = m_last_index.load(std::memory_order_relaxed);
+        if(last < m_entries.size() && m_entries[last].first == position)
+            return &m_entries[last].second;
+        return find_loaded(position);
+    }
+
+    // Returns the chunk at `position` and whether it was inserted (default-constructed).
+    std::pair<Chunk*, bool> try_emplace(Vector<int> const& position);
+
+    // Counts chunks that are not loaded yet, too.
+    size_t size() const { return m_entries.size() + m_unloaded_count; }
+    bool empty() const { return size() == 0; }
+
+    // Iteration is in insertion (or load) order.
+    auto begin() { load_all(); return m_entries.begin(); }
+    auto end() { load_all(); return m_entries.end(); }
+    auto begin() const { load_all(); return std::as_const(m_entries).begin(); }
+    auto end() const { load_all(); return std::as_const(m_entries).end(); }
+
+    // Chunks not in the map are loaded from `source` when needed. Chunks that are
+    // already loaded stay.
+    void set_source(std::shared_ptr<ChunkSource const> source);
+    ChunkSource const* source() const { return m_source.get(); }
+    // Returns false if any chunk of the source failed to load (now or before).
+    bool load_all() const;
+    size_t failed_count() const;
+
+    // Doesn't load anything.
+    Chunk const* find_loaded(Vector<int> const& position) const;
+    std::deque<Entry> const& loaded_entries() const { return m_entries; }
+    std::deque<Entry>& loaded_entries() { return m_entries; }
+
+private:
+    static constexpr int COORD_BITS = 21;
+    static constexpr uint64_t EMPTY_KEY = ~uint64_t{0};
+
+    struct Slot
+    {
+        uint64_t key = EMPTY_KEY;
+        uint32_t index = 0;
+    };
+
+    static uint64_t key_of(Vector<int> const&);
+    size_t slot_of(uint64_t key) const;
+    Chunk const* find_or_load(Vector<int> const&) const;
+    // Inserts a chunk that isn't in the map yet.
+    Chunk* insert(Vector<int> const&) const;
+    // Needs m_load_mutex held exclusively. Returns null if loading failed.
+    Chunk* load(Vector<int> const&) const;
+    void grow() const;
+
+    // Entries are mutable, since chunks are loaded from the source on demand.
+    mutable std::deque<Entry> m_entries;
+    // Capacity is a power of two, and at least twice the entry count.
+    mutable std::vector<Slot> m_slots;
+    mutable std::atomic<uint32_t> m_last_index = 0;
+    std::shared_ptr<ChunkSource const> m_source;
+    mutable std::atomic<size_t> m_unloaded_count = 0;
+    // Chunks of the source that failed to load, so they aren't retried.
+    mutable std::vector<Vector<int>> m_failed_positions;
+    mutable std::shared_mutex m_load_mutex;
+};
+
+}
@@ -0,0 +1,116 @@
+#include <evogen/ChunkOrder.h>
+
+#include <bit>
+#include <cassert>
+#include <climits>
+
+namespace evo
+{
+
+// Chunk coordinates are made non-negative (relative to the minimum) and must fit in 21 bits.
+static constexpr unsigned COORD_BITS = 21;
+
+static uint64_t spread_bits(uint64_t value)
+{
+    // Puts bit N of `value` at bit 3N.
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffff;
+    value = (value | value << 16) & 0x1f0000ff0000ff;
+    value = (value | value << 8) & 0x100f00f00f00f00f;
+    value = (value | value << 4) & 0x10c30c30c30c30c3;
+    value = (value | value << 2) & 0x1249249249249249;
+    return value;
+}
+
+static uint64_t morton_key(uint32_t x, uint32_t y, uint32_t z)
+{
+    return spread_bits(x) << 2 | spread_bits(y) << 1 | spread_bits(z);
+}
+
+// Skilling's "AxesToTranspose": converts coordinates to the transposed form of
+// their Hilbert index, then interleaves it like a Morton key.
+static uint64_t hilbert_key(uint32_t x, uint32_t y, uint32_t z, unsigned bits)
+{
+    uint32_t axes[3] = {x, y, z};
+    uint32_t top = 1u << (bits - 1);
+
+    // Inverse undo
+    for(uint32_t q = top; q > 1; q >>= 1)
+    {
+        uint32_t p = q - 1;
+        for(int i = 0; i < 3; i++)
+        {
+            if(axes[i] & q)
+                axes[0] ^= p;
+            else
+            {
+                uint32_t t = (axes[0] ^ axes[i]) & p;
+                axes[0] ^= t;
+                axes[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    for(int i = 1; i < 3; i++)
+        axes[i] ^= axes[i - 1];
+    uint32_t t = 0;
+    for(uint32_t q = top; q > 1; q >>= 1)
+    {
+        if(axes[2] & q)
+            t ^= q - 1;
+    }
+    for(int i = 0; i < 3; i++)
+        axes[i] ^= t;
+
+    return morton_key(axes[0], axes[1], axes[2]);
+}
+
+std::vector<uint64_t> chunk_order_keys(std::vector<Vector<int>> const& positions, ChunkOrder order)
+{
+    std::vector<uint64_t> keys;
+    keys.reserve(positions.size());
+    if(positions.empty())
+        return keys;
+
+    Vector<int> min = positions[0], max = positions[0];
+    for(auto& position: positions)
+    {
+        min = {std::min(min.x, position.x), std::min(min.y, position.y), std::min(min.z, position.z)};
+        max = {std::max(max.x, position.x), std::max(max.y, position.y), std::max(max.z, position.z)};
+    }
+    auto extent = max - min;
+    assert(extent.x < (1 << COORD_BITS) && extent.y < (1 << COORD_BITS) && extent.z < (1 << COORD_BITS));
+    unsigned bits = std::max(1u, std::bit_width(static_cast<unsigned>(std::max({extent.x, extent.y, extent.z}))));
+
+    for(auto& position: positions)
+    {
+        uint32_t x = position.x - min.x;
+        uint32_t y = position.y - min.y;
+        uint32_t z = position.z - min.z;
+        switch(order)
+        {
+            case ChunkOrder::Position:
+                keys.push_back(uint64_t{x} << (2 * COORD_BITS) | uint64_t{y} << COORD_BITS | z);
+                break;
+            case ChunkOrder::Morton:
+                keys.push_back(morton_key(x, y, z));
+                break;
+            case ChunkOrder::Hilbert:
+                keys.push_back(hilbert_key(x, y, z, bits));
+                break;
+            case ChunkOrder::SerpentineY:
+            {
+                // Every other layer goes back along X, and every other row along Z,
+                // so that the last chunk of a row/layer is next to the first one of the next.
+                uint32_t row = y % 2 ? extent.x - x : x;
+                uint32_t column = (y * (extent.x + 1) + row) % 2 ? extent.z - z : z;
+                keys.push_back(uint64_t{y} << (2 * COORD_BITS) | uint64_t{row} << COORD_BITS | column);
+                break;
+            }
+        }
+    }
+    return keys;
+}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <evogen/Vector.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace evo
+{
+
+// Order in which the generator visits chunks. Hilbert and SerpentineY keep
+// consecutive chunks next to each other, so the turtle makes short moves and
+// the set of chunks loaded in-game stays small. Morton mostly does too, but jumps
+// between blocks of the curve (e.g from the end of one octant to the next).
+enum class ChunkOrder
+{
+    Position,       // Sorted by X, then Y, then Z.
+    Morton,         // Z-order curve, cheap to compute but not continuous
+    Hilbert,        // Hilbert curve
+    SerpentineY,    // Layer by layer from the bottom, zigzagging through each layer
+};
+
+// Returns a sort key for every position; sorting by them gives `order`.
+// Keys of distinct positions are distinct.
+std::vector<uint64_t> chunk_order_keys(std::vector<Vector<int>> const& positions, ChunkOrder order);
+
+// Sorts `items` so that their chunk positions, given by `position_of(item)`, follow `order`.
+template<class T, class PositionOf>
+void sort_by_chunk_order(std::vector<T>& items, ChunkOrder order, PositionOf&& position_of)
+{
+    std::vector<Vector<int>> positions;
+    positions.reserve(items.size());
+    for(auto& item: items)
+        positions.push_back(position_of(item));
+    auto keys = chunk_order_keys(positions, order);
+
+    std::vector<size_t> permutation(items.size());
+    for(size_t index = 0; index < permutation.size(); index++)
+        permutation[index] = index;
+    std::sort(permutation.begin(), permutation.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+    std::vector<T> sorted;
+    sorted.reserve(items.size());
+    for(auto index: permutation)
+        sorted.push_back(std::move(items[index]));
+    items = std::move(sorted);
+}
+
+}
@@ -0,0 +1,169 @@
+#include <evogen/CommandWriter.h>
+
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace evo
+{
+
+// Longest formatted number + separators.
+static constexpr size_t MAX_NUMBER_SIZE = 24;
+
+CommandWriter::CommandWriter(std::ostream& stream, size_t buffer_size)
+: m_stream(&stream), m_buffer(std::max(buffer_size, MAX_NUMBER_SIZE * 3)) {}
+
+CommandWriter::CommandWriter(int fd, size_t buffer_size)
+: m_fd(fd), m_buffer(std::max(buffer_size, MAX_NUMBER_SIZE * 3)) {}
+
+char* CommandWriter::reserve(size_t size)
+{
+    if(m_used + size > m_buffer.size())
+    {
+        flush();
+        if(size > m_buffer.size())
+            m_buffer.resize(size);
+    }
+    return m_buffer.data() + m_used;
+}
+
+CommandWriter& CommandWriter::operator<<(std::string_view string)
+{
+    auto data = reserve(string.size());
+    memcpy(data, string.data(), string.size());
+    m_used += string.size();
+    return *this;
+}
+
+CommandWriter& CommandWriter::operator<<(char character)
+{
+    *reserve(1) = character;
+    m_used++;
+    return *this;
+}
+
+CommandWriter& CommandWriter::operator<<(int value)
+{
+    auto data = reserve(MAX_NUMBER_SIZE);
+    m_used = std::to_chars(data, data + MAX_NUMBER_SIZE, value).ptr - m_buffer.data();
+    return *this;
+}
+
+CommandWriter& CommandWriter::operator<<(size_t value)
+{
+    auto data = reserve(MAX_NUMBER_SIZE);
+    m_used = std::to_chars(data, data + MAX_NUMBER_SIZE, value).ptr - m_buffer.data();
+    return *this;
+}
+
+CommandWriter& CommandWriter::operator<<(Vector<int> const& vector)
+{
+    return *this << vector.x << ' ' << vector.y << ' ' << vector.z;
+}
+
+CommandWriter& CommandWriter::operator<<(BlockPosition const& position)
+{
+    auto value = position.value();
+    return *this << '~' << value.x << " ~" << value.y << " ~" << value.z;
+}
+
+CommandWriter& CommandWriter::operator<<(BlockHandle block)
+{
+    // Interned strings live as long as the program, so they can be referenced
+    // by pending writev() segments.
+    auto& string = block.to_command_format();
+    if(string.size() >= MIN_EXTERNAL_SIZE && m_fd >= 0)
+    {
+        append_external(string);
+        return *this;
+    }
+    return *this << std::string_view(string);
+}
+
+void CommandWriter::append_external(std::string_view string)
+{
+    if(m_used > m_segment_start)
+        m_segments.push_back({nullptr, m_segment_start, m_used - m_segment_start});
+    m_segment_start = m_used;
+    m_segments.push_back({string.data(), 0, string.size()});
+    if(m_segments.size() >= IOV_MAX - 1)
+        flush();
+}
+
+void CommandWriter::write_out(char const* data, size_t size)
+{
+    if(m_stream)
+    {
+        m_stream->write(data, size);
+        if(m_stream->fail())
+            m_failed = true;
+        return;
+    }
+    while(size > 0)
+    {
+        auto result = ::write(m_fd, data, size);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+        {
+            m_failed = true;
+            return;
+        }
+        data += result;
+        size -= result;
+    }
+}
+
+bool CommandWriter::flush()
+{
+    if(m_segments.empty())
+    {
+        write_out(m_buffer.data(), m_used);
+    }
+    else
+    {
+        if(m_used > m_segment_start)
+            m_segments.push_back({nullptr, m_segment_start, m_used - m_segment_start});
+
+        std::vector<iovec> iov;
+        iov.reserve(m_segments.size());
+        for(auto& segment: m_segments)
+        {
+            auto data = segment.data ? segment.data : m_buffer.data() + segment.offset;
+            iov.push_back({const_cast<char*>(data), segment.size});
+        }
+
+        // Resubmit the remainder after partial writes.
+        size_t first = 0;
+        while(first < iov.size() && !m_failed)
+        {
+            auto result = ::writev(m_fd, iov.data() + first, std::min<size_t>(iov.size() - first, IOV_MAX));
+            if(result < 0 && errno == EINTR)
+                continue;
+            if(result <= 0)
+            {
+                m_failed = true;
+                break;
+            }
+            size_t written = result;
+            while(first < iov.size() && written >= iov[first].iov_len)
+                written -= iov[first++].iov_len;
+            if(first < iov.size())
+            {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+                iov[first].iov_len -= written;
+            }
+        }
+        m_segments.clear();
+    }
+    m_used = 0;
+    m_segment_start = 0;
+    if(m_stream)
+        m_stream->flush();
+    return !m_failed;
+}
+
+}
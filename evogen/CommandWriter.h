@@ -0,0 +1,83 @@
+#pragma once
+
+#include <evogen/Block.h>
+#include <evogen/BlockHandle.h>
+#include <evogen/Vector.h>
+
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+namespace evo
+{
+
+// Buffered writer for generated commands. Everything is formatted straight into
+// a large buffer (numbers with std::to_chars, without temporary strings), which is
+// written out only when it fills up, or on flush().
+//
+// Output goes either to a std::ostream, or to a file descriptor. In the latter case
+// the buffer and long interned block strings (e.g with NBT) are handed to writev()
+// together, so these strings are never copied.
+class CommandWriter
+{
+public:
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+
+    explicit CommandWriter(std::ostream&, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+    // The descriptor is not closed by the writer.
+    explicit CommandWriter(int fd, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+    ~CommandWriter() { flush(); }
+
+    CommandWriter(CommandWriter const&) = delete;
+    CommandWriter& operator=(CommandWriter const&) = delete;
+
+    CommandWriter& operator<<(std::string_view);
+    CommandWriter& operator<<(std::string const& string) { return *this << std::string_view(string); }
+    CommandWriter& operator<<(char const* string) { return *this << std::string_view(string); }
+    CommandWriter& operator<<(char);
+    CommandWriter& operator<<(int);
+    CommandWriter& operator<<(size_t);
+
+    // "x y z"
+    CommandWriter& operator<<(Vector<int> const&);
+    // "~x ~y ~z"
+    CommandWriter& operator<<(BlockPosition const&);
+    // Block in command format
+    CommandWriter& operator<<(BlockHandle);
+
+    void end_line() { *this << '\n'; }
+
+    // Writes out everything buffered so far. Returns false if writing failed
+    // (now or before).
+    bool flush();
+    bool failed() const { return m_failed; }
+
+private:
+    // Strings at least that long are passed to writev() instead of being copied.
+    static constexpr size_t MIN_EXTERNAL_SIZE = 128;
+
+    char* reserve(size_t size);
+    void append_external(std::string_view);
+    void write_out(char const*, size_t);
+
+    std::ostream* m_stream = nullptr;
+    int m_fd = -1;
+
+    std::vector<char> m_buffer;
+    size_t m_used = 0;
+
+    // File descriptor output only: pending writev() segments, either external
+    // strings or (if `data` is null) ranges of the buffer.
+    struct Segment
+    {
+        char const* data;
+        size_t offset;
+        size_t size;
+    };
+    std::vector<Segment> m_segments;
+    size_t m_segment_start = 0;
+
+    bool m_failed = false;
+};
+
+}
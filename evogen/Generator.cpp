@@ -1,38 +1,257 @@
 #include <evogen/Generator.h>
 
+#include <evogen/CommandWriter.h>
+#include <evogen/Parallel.h>
 #include <evogen/World.h>
 
+#include <atomic>
+#include <cstdio>
+#include <fcntl.h>
+#include <filesystem>
 #include <fstream>
+#include <optional>
+#include <unistd.h>
 
 namespace evo
 {
 
 void Generator::load_from_world(World const& world)
 {
+    m_statistics = {};
     world.generate_tasks(*this);
 }
 
+void Generator::add_tasks(TaskList&& tasks)
+{
+    if(is_streaming())
+    {
+        for(auto& task: tasks)
+            task->generate_code(*m_writer, m_output_turtle);
+        m_streamed_task_count += tasks.size();
+    }
+    else
+        m_tasks.insert(m_tasks.end(), std::make_move_iterator(tasks.begin()), std::make_move_iterator(tasks.end()));
+    tasks.clear();
+}
+
+void Generator::print_statistics(size_t task_count) const
+{
+    std::cout << "Generated commands from " << task_count << " tasks!" << std::endl;
+    std::cout << "Block commands: " << m_statistics.block_commands << " (" << m_statistics.z_runs << " without box merging)" << std::endl;
+    if(m_diff_base)
+        std::cout << "Unchanged chunks: " << m_statistics.unchanged_chunks << std::endl;
+    if(m_template_options)
+    {
+        std::cout << "Template commands: " << m_statistics.template_commands << " (replacing " << m_statistics.templated_block_commands
+                  << " block commands), total: " << m_statistics.block_commands + m_statistics.template_commands << std::endl;
+    }
+}
+
+std::string Generator::template_directory() const
+{
+    return m_template_options->datapack + "/data/" + m_template_options->template_namespace + "/structures/" + m_template_options->name;
+}
+
+static std::string template_file_name(Vector<int> const& chunk_position)
+{
+    return std::to_string(chunk_position.x) + "_" + std::to_string(chunk_position.y) + "_" + std::to_string(chunk_position.z);
+}
+
+std::string Generator::template_path(Vector<int> const& chunk_position) const
+{
+    return template_directory() + "/" + template_file_name(chunk_position) + ".nbt";
+}
+
+std::string Generator::template_name(Vector<int> const& chunk_position) const
+{
+    return m_template_options->template_namespace + ":" + m_template_options->name + "/" + template_file_name(chunk_position);
+}
+
+bool Generator::prepare_template_directory() const
+{
+    std::error_code error;
+    std::filesystem::create_directories(template_directory(), error);
+    if(error)
+    {
+        std::cerr << "Could not create " << template_directory() << ": " << error.message() << std::endl;
+        return false;
+    }
+    auto mcmeta_path = m_template_options->datapack + "/pack.mcmeta";
+    if(std::filesystem::exists(mcmeta_path))
+        return true;
+    std::ofstream mcmeta(mcmeta_path);
+    mcmeta << "{\n    \"pack\": {\n        \"pack_format\": " << m_template_options->pack_format
+           << ",\n        \"description\": \"Generated by evogen\"\n    }\n}\n";
+    if(!mcmeta)
+    {
+        std::cerr << "Could not write " << mcmeta_path << std::endl;
+        return false;
+    }
+    return true;
+}
+
 void Generator::generate(std::ostream& stream) const
 {
-    m_stream = &stream;
-    m_turtle.generate_spawn_command(stream);
+    CommandWriter writer(stream);
+    generate(writer);
+}
+
+void Generator::generate(CommandWriter& writer) const
+{
+    Turtle turtle = m_turtle;
+    turtle.generate_spawn_command(writer);
     for(auto& task: m_tasks)
     {
-        task->generate_code(*this);
+        task->generate_code(writer, turtle);
+    }
+    writer << "kill " << turtle.to_strict_selector();
+    writer.end_line();
+    writer.flush();
+    print_statistics(m_tasks.size());
+}
+
+// Files are written through a file descriptor, so that CommandWriter can use writev().
+template<class Callback>
+static bool write_to_file(std::string const& name, Callback&& callback)
+{
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return false;
+
+    bool success;
+    {
+        CommandWriter writer(fd);
+        callback(writer);
+        success = writer.flush();
     }
-    stream << "kill " << m_turtle.to_strict_selector() << std::endl;
-    m_stream = nullptr;
-    std::cout << "Generated commands from " << m_tasks.size() << " tasks!" << std::endl;
+    return close(fd) == 0 && success;
 }
 
 bool Generator::generate_to_file(std::string const& name) const
 {
-    std::ofstream file(name);
-    if(file.fail())
+    return write_to_file(name, [&](CommandWriter& writer) { generate(writer); });
+}
+
+bool Generator::generate_shards(ShardOptions const& options) const
+{
+    struct Shard
+    {
+        size_t first_task;
+        size_t end_task;
+        Vector<int> turtle_position;
+    };
+
+    // Split at task boundaries, tracking where the turtle is at each of them.
+    std::vector<Shard> shards;
+    Vector<int> position = m_turtle.start_position();
+    size_t lines = 0;
+    std::optional<Vector<int>> region;
+    auto region_of = [&](Vector<int> const& position) {
+        auto chunk = World::chunk_position_from_block(position);
+        auto floor_divide = [&](int value) {
+            return (value < 0 ? value - options.region_size + 1 : value) / options.region_size;
+        };
+        return Vector<int>{floor_divide(chunk.x), 0, floor_divide(chunk.z)};
+    };
+    for(size_t index = 0; index < m_tasks.size(); index++)
+    {
+        auto& task = m_tasks[index];
+        position += task->turtle_movement();
+        bool start_shard = shards.empty();
+        if(options.region_size > 0)
+        {
+            if(task->turtle_movement() != Vector<int>{} && region != region_of(position))
+            {
+                region = region_of(position);
+                start_shard = true;
+            }
+        }
+        else if(lines + task->line_count() > options.max_lines)
+            start_shard = true;
+
+        if(start_shard)
+        {
+            if(!shards.empty())
+                shards.back().end_task = index;
+            // The shard starts *before* this task is applied.
+            shards.push_back({index, m_tasks.size(), position - task->turtle_movement()});
+            // The teleport at the start and the schedule (or kill) at the end.
+            lines = 2;
+        }
+        lines += task->line_count();
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(options.directory, error);
+    if(error)
         return false;
 
-    generate(file);
-    return true;
+    auto shard_name = [&](size_t index) {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%04zu", index);
+        return options.name + suffix;
+    };
+
+    std::atomic<bool> success = true;
+    parallel_for(shards.size(), m_thread_count, [&](size_t index) {
+        auto& shard = shards[index];
+        auto path = options.directory + "/" + shard_name(index) + ".mcfunction";
+        bool result = write_to_file(path, [&](CommandWriter& writer) {
+            Turtle turtle = m_turtle;
+            turtle.set_position(shard.turtle_position);
+            turtle.generate_teleport_command(writer);
+            for(size_t task = shard.first_task; task < shard.end_task; task++)
+                m_tasks[task]->generate_code(writer, turtle);
+            if(index + 1 < shards.size())
+                writer << "schedule function " << options.function_namespace << ':' << shard_name(index + 1) << " 1t";
+            else
+                writer << "kill " << m_turtle.to_strict_selector();
+            writer.end_line();
+        });
+        if(!result)
+            success = false;
+    });
+
+    bool dispatcher_result = write_to_file(options.directory + "/" + options.name + ".mcfunction", [&](CommandWriter& writer) {
+        m_turtle.generate_spawn_command(writer);
+        if(shards.empty())
+            writer << "kill " << m_turtle.to_strict_selector();
+        else
+            writer << "schedule function " << options.function_namespace << ':' << shard_name(0) << " 1t";
+        writer.end_line();
+    });
+
+    print_statistics(m_tasks.size());
+    std::cout << "Shards: " << shards.size() << " in " << options.directory << std::endl;
+    return success && dispatcher_result;
+}
+
+void Generator::stream_from_world(World const& world, std::ostream& stream)
+{
+    CommandWriter writer(stream);
+    stream_from_world(world, writer);
+}
+
+void Generator::stream_from_world(World const& world, CommandWriter& writer)
+{
+    m_writer = &writer;
+    m_output_turtle = m_turtle;
+    m_output_turtle.generate_spawn_command(writer);
+    m_streaming = true;
+    m_streamed_task_count = 0;
+    m_statistics = {};
+    world.generate_tasks(*this);
+    m_streaming = false;
+    writer << "kill " << m_output_turtle.to_strict_selector();
+    writer.end_line();
+    writer.flush();
+    m_writer = nullptr;
+    print_statistics(m_streamed_task_count);
+}
+
+bool Generator::stream_from_world_to_file(World const& world, std::string const& name)
+{
+    return write_to_file(name, [&](CommandWriter& writer) { stream_from_world(world, writer); });
 }
 
 }
@@ -1,46 +1,182 @@
 #pragma once
 
+#include <evogen/Chunk.h>
+#include <evogen/ChunkOrder.h>
+#include <evogen/Parallel.h>
 #include <evogen/Task.h>
 #include <evogen/Turtle.h>
 
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <utility>
 #include <vector>
 
 namespace evo
 {
 
+class CommandWriter;
 class World;
 
+using TaskList = std::vector<std::unique_ptr<Task>>;
+
 class Generator
 {
 public:
     Generator(Vector<int> position = {})
-    : m_turtle(position) {}
+    : m_turtle(position), m_output_turtle(position) {}
 
     void load_from_world(World const& world);
 
+    // In streaming mode, tasks are generated immediately instead of being stored.
     template<class T, class... Args>
     void add_task(Args&&... args)
     {
-        m_tasks.push_back(std::make_unique<T>(std::forward<Args>(args)...));
+        if(is_streaming())
+        {
+            T(std::forward<Args>(args)...).generate_code(*m_writer, m_output_turtle);
+            m_streamed_task_count++;
+        }
+        else
+            m_tasks.push_back(std::make_unique<T>(std::forward<Args>(args)...));
     }
 
+    void add_tasks(TaskList&& tasks);
+
+    // Threads used for scanning chunks in load_from_world(). 0 = all hardware threads.
+    // The generated tasks don't depend on it.
+    void set_thread_count(unsigned thread_count) { m_thread_count = thread_count; }
+    unsigned thread_count() const { return m_thread_count; }
+
+    // Order in which load_from_world() visits chunks.
+    void set_chunk_order(ChunkOrder order) { m_chunk_order = order; }
+    ChunkOrder chunk_order() const { return m_chunk_order; }
+
+    // Marks every turtle stop with a redstone block, for debugging.
+    void set_debug_markers(bool debug_markers) { m_debug_markers = debug_markers; }
+    bool debug_markers() const { return m_debug_markers; }
+
+    // Incremental mode: load_from_world() and stream_from_world() generate only chunks
+    // modified since `checkpoint` (see BlockContainer::checkpoint()). Modified chunks
+    // are generated whole; blocks that were removed (made Empty) are left as they are.
+    void set_incremental_checkpoint(std::optional<uint64_t> checkpoint) { m_incremental_checkpoint = checkpoint; }
+    std::optional<uint64_t> incremental_checkpoint() const { return m_incremental_checkpoint; }
+
+    // Diff mode: load_from_world() and stream_from_world() generate only what changed
+    // since `base`, the world as it is already built in-game: blocks that differ are
+    // placed, and blocks that the world no longer places are cleared to air. Chunks
+    // with equal content are skipped by hash. Templates and the incremental checkpoint
+    // are not used in this mode. `base` must stay alive while generating.
+    void set_diff_base(World const* base) { m_diff_base = base; }
+    World const* diff_base() const { return m_diff_base; }
+
+    struct TemplateOptions
+    {
+        // Root of the generated datapack. Templates are written to
+        // <datapack>/data/<template_namespace>/structures/<name>/, and a pack.mcmeta is
+        // created if there is none.
+        std::string datapack = "evogen_datapack";
+        std::string template_namespace = "evogen";
+        std::string name = "output";
+        int pack_format = 15;
+        // Estimated cost of a /place template, in /fill commands (it has to load and
+        // parse the template). Chunks that would need more block commands than that
+        // (counted before merging boxes across chunks) are placed as templates.
+        size_t template_cost = 16;
+    };
+
+    // With template options, load_from_world() and stream_from_world() write dense
+    // chunks as structure templates into a datapack, and place them with a single
+    // /place template command instead of many setblock/fill commands.
+    void set_template_options(std::optional<TemplateOptions> options) { m_template_options = std::move(options); }
+    std::optional<TemplateOptions> const& template_options() const { return m_template_options; }
+
+    // Creates the template directory (and pack.mcmeta) of the datapack.
+    bool prepare_template_directory() const;
+    std::string template_directory() const;
+    // Template of a chunk: the file, and the name used in /place template (e.g
+    // "evogen:output/1_0_-2").
+    std::string template_path(Vector<int> const& chunk_position) const;
+    std::string template_name(Vector<int> const& chunk_position) const;
+
     void generate(std::ostream&) const;
+    void generate(CommandWriter&) const;
     
     void generate_to_stdout() const { generate(std::cout); }
     bool generate_to_file(std::string const&) const;
 
+    // Streaming mode: generates commands for the world directly, without building
+    // the task list. Chunks are scanned in small batches, so memory use doesn't
+    // depend on world size. The output is the same as load_from_world() + generate().
+    void stream_from_world(World const&, std::ostream&);
+    void stream_from_world(World const&, CommandWriter&);
+    bool stream_from_world_to_file(World const&, std::string const&);
+
+    bool is_streaming() const { return m_streaming; }
+
+    struct ShardOptions
+    {
+        // Where shard files are written, e.g "<datapack>/data/evogen/functions".
+        std::string directory = ".";
+        // Functions are called as <function_namespace>:<name>_NNNN.
+        std::string function_namespace = "evogen";
+        std::string name = "output";
+        // A shard is started after that many lines (the default is the default
+        // maxCommandChainLength)...
+        size_t max_lines = 65536;
+        // ...or, if nonzero, whenever the turtle enters another region of
+        // `region_size` x `region_size` chunks (in X/Z). Shards are unbounded then, so
+        // maxCommandChainLength may have to be raised.
+        int region_size = 0;
+    };
+
+    // Splits the output into <name>_0000.mcfunction, <name>_0001.mcfunction, ...,
+    // written in parallel, plus a <name>.mcfunction dispatcher that spawns the turtle.
+    // Shards run one per tick, each scheduling the next one (the last one kills the
+    // turtle), so that maxCommandChainLength limits a shard, not the whole output.
+    // Each shard starts by teleporting the turtle to its absolute position, so shards
+    // don't rely on each other's moves.
+    bool generate_shards(ShardOptions const&) const;
+
+    struct Statistics
+    {
+        size_t block_commands = 0;  // setblock/fill commands generated
+        size_t z_runs = 0;          // setblock/fill commands that would be needed without box merging
+        size_t template_commands = 0;       // place template commands generated
+        size_t templated_block_commands = 0; // setblock/fill commands replaced by them
+        size_t unchanged_chunks = 0;        // chunks skipped in diff mode
+    };
+
+    Statistics const& statistics() const { return m_statistics; }
+    Statistics& statistics() { return m_statistics; }
+
     Turtle const& turtle() const { return m_turtle; }
     Turtle& turtle() { return m_turtle; }
 
-    std::ostream* stream() const { return m_stream; }
+    // Buffers for scanning chunks, shared by all passes of this generator. Separate
+    // generators can run passes over the same world at once.
+    ObjectPool<Chunk::ScanBuffers>& scan_buffers() { return *m_scan_buffers; }
 
 private:
+    void print_statistics(size_t task_count) const;
+
     std::vector<std::unique_ptr<Task>> m_tasks;
     Turtle m_turtle;
-    mutable std::ostream* m_stream = nullptr;
+
+    // Output state when streaming.
+    CommandWriter* m_writer = nullptr;
+    Turtle m_output_turtle;
+
+    unsigned m_thread_count = 0;
+    ChunkOrder m_chunk_order = ChunkOrder::Hilbert;
+    bool m_debug_markers = false;
+    std::optional<TemplateOptions> m_template_options;
+    std::optional<uint64_t> m_incremental_checkpoint;
+    World const* m_diff_base = nullptr;
+    Statistics m_statistics;
+    std::unique_ptr<ObjectPool<Chunk::ScanBuffers>> m_scan_buffers = std::make_unique<ObjectPool<Chunk::ScanBuffers>>();
+    bool m_streaming = false;
+    size_t m_streamed_task_count = 0;
 };
 
 }
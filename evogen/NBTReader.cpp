@@ -0,0 +1,355 @@
+#include <evogen/NBTReader.h>
+
+#include <evogen/BlockHandle.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <type_traits>
+#include <zlib.h>
+
+namespace evo
+{
+
+static constexpr size_t BUFFER_SIZE = 1 << 18;
+// Same limit as in Minecraft.
+static constexpr int MAX_DEPTH = 512;
+
+NBTReader::NBTReader(uint8_t const* data, size_t size)
+: m_position(data), m_end(data + size) {}
+
+NBTReader::~NBTReader()
+{
+    if(m_file)
+        gzclose(m_file);
+}
+
+bool NBTReader::open(std::string const& path)
+{
+    // gzread() passes uncompressed files through unchanged.
+    m_file = gzopen(path.c_str(), "rb");
+    if(!m_file)
+        return fail("Could not open " + path);
+    gzbuffer(m_file, BUFFER_SIZE);
+    m_buffer.resize(BUFFER_SIZE);
+    m_position = m_end = m_buffer.data();
+    return true;
+}
+
+bool NBTReader::fail(std::string const& error)
+{
+    if(m_error.empty())
+        m_error = error;
+    return false;
+}
+
+bool NBTReader::ensure(size_t size)
+{
+    if(failed())
+        return false;
+    if(static_cast<size_t>(m_end - m_position) >= size)
+        return true;
+    if(!m_file)
+        return fail("Unexpected end of data");
+
+    // Move the remainder to the front, then refill.
+    size_t remaining = m_end - m_position;
+    memmove(m_buffer.data(), m_position, remaining);
+    if(m_buffer.size() < size)
+        m_buffer.resize(size);
+    size_t available = remaining;
+    while(available < size)
+    {
+        auto result = gzread(m_file, m_buffer.data() + available, m_buffer.size() - available);
+        if(result < 0)
+        {
+            int code;
+            return fail(std::string("Decompression error: ") + gzerror(m_file, &code));
+        }
+        if(result == 0)
+            return fail("Unexpected end of file");
+        available += result;
+    }
+    m_position = m_buffer.data();
+    m_end = m_position + available;
+    return true;
+}
+
+bool NBTReader::read_bytes(void* output, size_t size)
+{
+    // Long strings and arrays are read in buffer-sized pieces.
+    auto data = static_cast<uint8_t*>(output);
+    while(size > 0)
+    {
+        size_t piece = std::min(size, BUFFER_SIZE);
+        if(!ensure(piece))
+            return false;
+        memcpy(data, m_position, piece);
+        m_position += piece;
+        data += piece;
+        size -= piece;
+    }
+    return true;
+}
+
+bool NBTReader::skip_bytes(size_t size)
+{
+    while(size > 0)
+    {
+        size_t piece = std::min(size, BUFFER_SIZE);
+        if(!ensure(piece))
+            return false;
+        m_position += piece;
+        size -= piece;
+    }
+    return true;
+}
+
+template<class T>
+bool NBTReader::read_big_endian(T& value)
+{
+    if(!ensure(sizeof(T)))
+        return false;
+    std::make_unsigned_t<T> result = 0;
+    for(size_t index = 0; index < sizeof(T); index++)
+        result = static_cast<std::make_unsigned_t<T>>(result << 8 | m_position[index]);
+    m_position += sizeof(T);
+    value = static_cast<T>(result);
+    return true;
+}
+
+bool NBTReader::read_byte(int8_t& value) { return read_big_endian(value); }
+bool NBTReader::read_short(int16_t& value) { return read_big_endian(value); }
+bool NBTReader::read_int(int32_t& value) { return read_big_endian(value); }
+bool NBTReader::read_long(int64_t& value) { return read_big_endian(value); }
+
+bool NBTReader::read_float(float& value)
+{
+    int32_t bits;
+    if(!read_int(bits))
+        return false;
+    value = std::bit_cast<float>(bits);
+    return true;
+}
+
+bool NBTReader::read_double(double& value)
+{
+    int64_t bits;
+    if(!read_long(bits))
+        return false;
+    value = std::bit_cast<double>(bits);
+    return true;
+}
+
+bool NBTReader::read_string(std::string& value)
+{
+    // Length is unsigned. Contents are "modified UTF-8", which is the same as UTF-8
+    // for everything that appears in block names and states.
+    int16_t length;
+    if(!read_short(length))
+        return false;
+    value.resize(static_cast<uint16_t>(length));
+    return read_bytes(value.data(), value.size());
+}
+
+bool NBTReader::read_byte_array(std::vector<uint8_t>& array)
+{
+    int32_t length;
+    if(!read_array_length(length))
+        return false;
+    if(length < 0)
+        return fail("Negative array length");
+    array.resize(length);
+    return read_bytes(array.data(), array.size());
+}
+
+bool NBTReader::read_long_array(std::vector<uint64_t>& array)
+{
+    int32_t length;
+    if(!read_array_length(length))
+        return false;
+    if(length < 0)
+        return fail("Negative array length");
+    array.resize(length);
+    if(!read_bytes(array.data(), array.size() * sizeof(uint64_t)))
+        return false;
+    if constexpr(std::endian::native == std::endian::little)
+    {
+        for(auto& value: array)
+            value = __builtin_bswap64(value);
+    }
+    return true;
+}
+
+bool NBTReader::read_integer(TagType type, int64_t& value)
+{
+    switch(type)
+    {
+        case TagType::Byte: { int8_t result; if(!read_byte(result)) return false; value = result; return true; }
+        case TagType::Short: { int16_t result; if(!read_short(result)) return false; value = result; return true; }
+        case TagType::Int: { int32_t result; if(!read_int(result)) return false; value = result; return true; }
+        case TagType::Long: return read_long(value);
+        default: return fail("Expected an integer tag, got type " + std::to_string(static_cast<int>(type)));
+    }
+}
+
+bool NBTReader::read_tag_header(TagType& type, std::string& name)
+{
+    int8_t raw_type;
+    if(!read_byte(raw_type))
+        return false;
+    if(raw_type < 0 || raw_type > static_cast<int8_t>(TagType::LongArray))
+        return fail("Invalid tag type " + std::to_string(raw_type));
+    type = static_cast<TagType>(raw_type);
+    if(type == TagType::End)
+        return true;
+    return read_string(name);
+}
+
+bool NBTReader::read_list_header(TagType& element_type, int32_t& length)
+{
+    int8_t raw_type;
+    if(!read_byte(raw_type) || !read_int(length))
+        return false;
+    if(raw_type < 0 || raw_type > static_cast<int8_t>(TagType::LongArray))
+        return fail("Invalid list element type " + std::to_string(raw_type));
+    if(length < 0)
+        return fail("Negative list length");
+    element_type = static_cast<TagType>(raw_type);
+    return true;
+}
+
+bool NBTReader::skip(TagType type)
+{
+    return skip(type, 0);
+}
+
+bool NBTReader::skip(TagType type, int depth)
+{
+    if(depth > MAX_DEPTH)
+        return fail("Tags nested too deeply");
+
+    auto skip_array = [&](size_t element_size) {
+        int32_t length;
+        if(!read_array_length(length))
+            return false;
+        if(length < 0)
+            return fail("Negative array length");
+        return skip_bytes(length * element_size);
+    };
+
+    switch(type)
+    {
+        case TagType::End: return true;
+        case TagType::Byte: return skip_bytes(1);
+        case TagType::Short: return skip_bytes(2);
+        case TagType::Int: return skip_bytes(4);
+        case TagType::Long: return skip_bytes(8);
+        case TagType::Float: return skip_bytes(4);
+        case TagType::Double: return skip_bytes(8);
+        case TagType::ByteArray: return skip_array(1);
+        case TagType::IntArray: return skip_array(4);
+        case TagType::LongArray: return skip_array(8);
+        case TagType::String:
+        {
+            int16_t length;
+            return read_short(length) && skip_bytes(static_cast<uint16_t>(length));
+        }
+        case TagType::List:
+        {
+            TagType element_type;
+            int32_t length;
+            if(!read_list_header(element_type, length))
+                return false;
+            size_t element_size = 0;
+            switch(element_type)
+            {
+                case TagType::Byte: element_size = 1; break;
+                case TagType::Short: element_size = 2; break;
+                case TagType::Int: case TagType::Float: element_size = 4; break;
+                case TagType::Long: case TagType::Double: element_size = 8; break;
+                default: break;
+            }
+            if(element_size != 0)
+                return skip_bytes(length * element_size);
+            for(int32_t index = 0; index < length; index++)
+            {
+                if(!skip(element_type, depth + 1))
+                    return false;
+            }
+            return true;
+        }
+        case TagType::Compound:
+        {
+            std::string name;
+            while(true)
+            {
+                TagType field_type;
+                if(!read_tag_header(field_type, name))
+                    return false;
+                if(field_type == TagType::End)
+                    return true;
+                if(!skip(field_type, depth + 1))
+                    return false;
+            }
+        }
+    }
+    return fail("Invalid tag type");
+}
+
+using TagType = NBTReader::TagType;
+
+bool read_block_state_palette(NBTReader& reader, std::vector<BlockHandle>& palette)
+{
+    TagType element_type;
+    int32_t length;
+    if(!reader.read_list_header(element_type, length))
+        return false;
+    if(length > 0 && element_type != TagType::Compound)
+        return reader.fail("Palette must be a list of compounds");
+
+    std::string name;
+    std::string block_id;
+    std::string property_value;
+    for(int32_t index = 0; index < length; index++)
+    {
+        block_id.clear();
+        BlockStates states;
+        while(true)
+        {
+            TagType type;
+            if(!reader.read_tag_header(type, name))
+                return false;
+            if(type == TagType::End)
+                break;
+            if(name == "Name" && type == TagType::String)
+            {
+                if(!reader.read_string(block_id))
+                    return false;
+            }
+            else if(name == "Properties" && type == TagType::Compound)
+            {
+                while(true)
+                {
+                    if(!reader.read_tag_header(type, name))
+                        return false;
+                    if(type == TagType::End)
+                        break;
+                    if(type != TagType::String)
+                        return reader.fail("Blockstate property must be a String");
+                    if(!reader.read_string(property_value))
+                        return false;
+                    states.set_state(name, property_value);
+                }
+            }
+            else if(!reader.skip(type))
+                return false;
+        }
+        if(block_id.empty())
+            return reader.fail("Palette entry without a Name");
+        palette.push_back(BlockHandle(block_id, states));
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct gzFile_s;
+
+namespace evo
+{
+
+class BlockHandle;
+
+// Streaming reader for (big-endian, Java Edition) NBT. It doesn't build a tree:
+// the caller walks tags in file order and skips what it doesn't need, so reading
+// allocates nothing except strings (which can be reused between calls).
+//
+// Input is a file (gzip-compressed or not, decompressed on the fly with zlib) or
+// a memory buffer. All reading functions return false on error or unexpected end
+// of input; error() then says what went wrong, and all further reads fail.
+class NBTReader
+{
+public:
+    enum class TagType : uint8_t
+    {
+        End,
+        Byte,
+        Short,
+        Int,
+        Long,
+        Float,
+        Double,
+        ByteArray,
+        String,
+        List,
+        Compound,
+        IntArray,
+        LongArray,
+    };
+
+    NBTReader() = default;
+    // Reads from memory; the buffer must outlive the reader.
+    NBTReader(uint8_t const* data, size_t size);
+    ~NBTReader();
+
+    NBTReader(NBTReader const&) = delete;
+    NBTReader& operator=(NBTReader const&) = delete;
+
+    bool open(std::string const& path);
+
+    // Reads the root tag header; the root is normally a compound.
+    bool read_root(TagType& type, std::string& name) { return read_tag_header(type, name); }
+
+    // Reads the header of the next tag in a compound. `name` is not read for End,
+    // which terminates the compound.
+    bool read_tag_header(TagType& type, std::string& name);
+    bool read_list_header(TagType& element_type, int32_t& length);
+    // Array tags: the length in elements, then elements follow.
+    bool read_array_length(int32_t& length) { return read_int(length); }
+
+    bool read_byte(int8_t&);
+    bool read_short(int16_t&);
+    bool read_int(int32_t&);
+    bool read_long(int64_t&);
+    bool read_float(float&);
+    bool read_double(double&);
+    bool read_string(std::string&);
+    // Whole array tags (length + elements).
+    bool read_byte_array(std::vector<uint8_t>&);
+    bool read_long_array(std::vector<uint64_t>&);
+
+    // Reads the payload of a numeric tag of any integral type.
+    bool read_integer(TagType, int64_t&);
+
+    bool skip(TagType);
+
+    bool failed() const { return !m_error.empty(); }
+    std::string const& error() const { return m_error; }
+    bool fail(std::string const& error);
+
+private:
+    bool ensure(size_t size);
+    bool read_bytes(void* output, size_t size);
+    bool skip_bytes(size_t size);
+    bool skip(TagType, int depth);
+
+    template<class T>
+    bool read_big_endian(T& value);
+
+    gzFile_s* m_file = nullptr;
+    std::vector<uint8_t> m_buffer;
+    uint8_t const* m_position = nullptr;
+    uint8_t const* m_end = nullptr;
+    std::string m_error;
+};
+
+// Reads a list of block state compounds ({Name, Properties}), used by structure
+// files and chunks, appending their blocks to `palette`.
+bool read_block_state_palette(NBTReader&, std::vector<BlockHandle>& palette);
+
+}
@@ -0,0 +1,117 @@
+#include <evogen/NBTWriter.h>
+
+#include <evogen/Block.h>
+
+#include <bit>
+#include <cassert>
+#include <fstream>
+#include <type_traits>
+#include <zlib.h>
+
+namespace evo
+{
+
+template<class T>
+void NBTWriter::write_big_endian(T value)
+{
+    auto bits = static_cast<std::make_unsigned_t<T>>(value);
+    for(int shift = (sizeof(T) - 1) * 8; shift >= 0; shift -= 8)
+        m_data.push_back(static_cast<uint8_t>(bits >> shift));
+}
+
+void NBTWriter::write_short(int16_t value) { write_big_endian(value); }
+void NBTWriter::write_int(int32_t value) { write_big_endian(value); }
+void NBTWriter::write_long(int64_t value) { write_big_endian(value); }
+
+void NBTWriter::write_tag_header(TagType type, std::string_view name)
+{
+    assert(type != TagType::End);
+    write_byte(static_cast<int8_t>(type));
+    write_string(name);
+}
+
+void NBTWriter::write_list_header(TagType element_type, int32_t length)
+{
+    // Empty lists are written with End as the element type, like Minecraft does.
+    write_byte(static_cast<int8_t>(length == 0 ? TagType::End : element_type));
+    write_int(length);
+}
+
+void NBTWriter::write_float(float value)
+{
+    write_int(std::bit_cast<int32_t>(value));
+}
+
+void NBTWriter::write_double(double value)
+{
+    write_long(std::bit_cast<int64_t>(value));
+}
+
+void NBTWriter::write_string(std::string_view value)
+{
+    assert(value.size() <= UINT16_MAX);
+    write_short(static_cast<int16_t>(value.size()));
+    m_data.insert(m_data.end(), value.begin(), value.end());
+}
+
+void NBTWriter::write_byte_array(uint8_t const* values, size_t count)
+{
+    write_int(count);
+    m_data.insert(m_data.end(), values, values + count);
+}
+
+void NBTWriter::write_int_array(int32_t const* values, size_t count)
+{
+    write_int(count);
+    for(size_t index = 0; index < count; index++)
+        write_int(values[index]);
+}
+
+void NBTWriter::write_long_array(uint64_t const* values, size_t count)
+{
+    write_int(count);
+    size_t offset = m_data.size();
+    m_data.resize(offset + count * sizeof(uint64_t));
+    auto output = m_data.data() + offset;
+    for(size_t index = 0; index < count; index++)
+    {
+        auto value = values[index];
+        for(int byte = 7; byte >= 0; byte--, value >>= 8)
+            output[index * 8 + byte] = static_cast<uint8_t>(value);
+    }
+}
+
+bool NBTWriter::write_to_file(std::string const& path, bool compress) const
+{
+    if(!compress)
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<char const*>(m_data.data()), m_data.size());
+        return static_cast<bool>(file);
+    }
+    auto file = gzopen(path.c_str(), "wb");
+    if(!file)
+        return false;
+    bool success = m_data.empty() || gzwrite(file, m_data.data(), m_data.size()) == static_cast<int>(m_data.size());
+    return gzclose(file) == Z_OK && success;
+}
+
+void write_block_state(NBTWriter& writer, Block const& block)
+{
+    using TagType = NBTWriter::TagType;
+    writer.write_tag_header(TagType::String, "Name");
+    writer.write_string(block.id().find(':') == std::string::npos ? "minecraft:" + block.id() : block.id());
+    if(block.states().begin() != block.states().end())
+    {
+        writer.write_tag_header(TagType::Compound, "Properties");
+        for(auto& [name, value]: block.states())
+        {
+            writer.write_tag_header(TagType::String, name);
+            writer.write_string(value);
+        }
+        writer.write_end();
+    }
+    writer.write_end();
+}
+
+}
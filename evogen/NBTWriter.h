@@ -0,0 +1,64 @@
+#pragma once
+
+#include <evogen/NBTReader.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace evo
+{
+
+class Block;
+
+// Writer for (big-endian, Java Edition) NBT, the counterpart of NBTReader. Tags
+// are appended to a memory buffer in the order they are written: a tag header (or
+// a list header), then its payload; compounds are terminated with write_end().
+class NBTWriter
+{
+public:
+    using TagType = NBTReader::TagType;
+
+    void write_tag_header(TagType, std::string_view name);
+    void write_list_header(TagType element_type, int32_t length);
+    void write_end() { m_data.push_back(0); }
+
+    void write_byte(int8_t value) { m_data.push_back(value); }
+    void write_short(int16_t);
+    void write_int(int32_t);
+    void write_long(int64_t);
+    void write_float(float);
+    void write_double(double);
+    void write_string(std::string_view);
+    // Whole array tags (length + elements).
+    void write_byte_array(uint8_t const* values, size_t count);
+    void write_int_array(int32_t const* values, size_t count);
+    void write_long_array(uint64_t const* values, size_t count);
+
+    // Appends already encoded NBT, e.g a compound saved from another writer.
+    void write_raw(std::vector<uint8_t> const& data) { m_data.insert(m_data.end(), data.begin(), data.end()); }
+
+    std::vector<uint8_t> const& data() const { return m_data; }
+    std::vector<uint8_t>& data() { return m_data; }
+    void clear() { m_data.clear(); }
+
+    // Saves the data, gzip-compressed (like structure files) or not.
+    bool write_to_file(std::string const& path, bool compress = true) const;
+
+private:
+    template<class T>
+    void write_big_endian(T value);
+
+    std::vector<uint8_t> m_data;
+};
+
+// Writes the payload of a block state compound ({Name, Properties}), the counterpart
+// of read_block_state_palette(). Ids without a namespace get "minecraft:".
+//
+// Block NBT is not written: Block::nbt() is SNBT, which we can't parse yet, so
+// exported blocks lose their block entities. Writers count (and warn about) blocks
+// that have NBT.
+void write_block_state(NBTWriter&, Block const&);
+
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace evo
+{
+
+// Fixed-size array of unsigned integers, each stored in `bits` bits.
+// `bits` is always a power of two (1..16), so that values never straddle
+// the 64-bit words they are packed into.
+class PackedArray
+{
+public:
+    PackedArray() = default;
+
+    PackedArray(size_t size, unsigned bits)
+    : m_words((size * bits + 63) / 64), m_size(size), m_bits(bits)
+    {
+        assert(bits > 0 && bits <= 16 && (bits & (bits - 1)) == 0);
+    }
+
+    size_t size() const { return m_size; }
+    unsigned bits() const { return m_bits; }
+    bool empty() const { return m_size == 0; }
+
+    uint32_t get(size_t index) const
+    {
+        assert(index < m_size);
+        size_t bit = index * m_bits;
+        return (m_words[bit >> 6] >> (bit & 63)) & mask();
+    }
+
+    // Gets `count` consecutive values starting at `begin`, a whole word at a time.
+    void get(size_t begin, size_t count, uint32_t* output) const
+    {
+        assert(begin + count <= m_size);
+        size_t per_word = 64 / m_bits;
+        size_t index = begin;
+        size_t end = begin + count;
+        while(index < end)
+        {
+            auto word = m_words[index / per_word] >> (index % per_word * m_bits);
+            size_t word_end = std::min(end, (index / per_word + 1) * per_word);
+            for(; index < word_end; index++, word >>= m_bits)
+                *output++ = word & mask();
+        }
+    }
+
+    void set(size_t index, uint32_t value)
+    {
+        assert(index < m_size);
+        assert(value <= mask());
+        size_t bit = index * m_bits;
+        auto& word = m_words[bit >> 6];
+        word = (word & ~(mask() << (bit & 63))) | (static_cast<uint64_t>(value) << (bit & 63));
+    }
+
+    // Sets `count` consecutive values starting at `begin`, a whole word at a time.
+    void fill(size_t begin, size_t count, uint32_t value)
+    {
+        assert(begin + count <= m_size);
+        assert(value <= mask());
+        if(count == 0)
+            return;
+        uint64_t pattern = ~uint64_t{0} / mask() * value;
+        size_t bit_begin = begin * m_bits;
+        size_t bit_end = (begin + count) * m_bits;
+        size_t first_word = bit_begin >> 6;
+        size_t last_word = (bit_end - 1) >> 6;
+        uint64_t head_mask = ~uint64_t{0} << (bit_begin & 63);
+        uint64_t tail_mask = ~uint64_t{0} >> (63 - ((bit_end - 1) & 63));
+        if(first_word == last_word)
+        {
+            auto word_mask = head_mask & tail_mask;
+            m_words[first_word] = (m_words[first_word] & ~word_mask) | (pattern & word_mask);
+            return;
+        }
+        m_words[first_word] = (m_words[first_word] & ~head_mask) | (pattern & head_mask);
+        for(size_t word = first_word + 1; word < last_word; word++)
+            m_words[word] = pattern;
+        m_words[last_word] = (m_words[last_word] & ~tail_mask) | (pattern & tail_mask);
+    }
+
+    // Returns a copy of this array with the same values, stored in `new_bits` bits.
+    PackedArray resized(unsigned new_bits) const
+    {
+        PackedArray result(m_size, new_bits);
+        for(size_t index = 0; index < m_size; index++)
+            result.set(index, get(index));
+        return result;
+    }
+
+    size_t memory_usage() const { return m_words.capacity() * sizeof(uint64_t); }
+
+    // Values are packed into the words from the lowest bits.
+    std::vector<uint64_t> const& words() const { return m_words; }
+    std::vector<uint64_t>& words() { return m_words; }
+
+    bool operator==(PackedArray const& other) const
+    {
+        return m_size == other.m_size && m_bits == other.m_bits && m_words == other.m_words;
+    }
+
+    size_t hash() const
+    {
+        // FNV-1a over the words
+        uint64_t result = 14695981039346656037ull ^ m_bits;
+        for(auto word: m_words)
+            result = (result ^ word) * 1099511628211ull;
+        return result;
+    }
+
+private:
+    uint64_t mask() const { return (uint64_t{1} << m_bits) - 1; }
+
+    std::vector<uint64_t> m_words;
+    size_t m_size = 0;
+    unsigned m_bits = 0;
+};
+
+}
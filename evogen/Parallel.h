@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace evo
+{
+
+// 0 means "one thread per hardware thread".
+inline unsigned resolve_thread_count(unsigned thread_count)
+{
+    if(thread_count != 0)
+        return thread_count;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls `callback(index)` for every index in [0, count), on up to `thread_count`
+// threads. Indices are handed out one by one, so uneven work items balance out.
+// The first exception thrown by a callback is rethrown after all threads finish.
+template<class Callback>
+void parallel_for(size_t count, unsigned thread_count, Callback&& callback)
+{
+    thread_count = std::min<size_t>(resolve_thread_count(thread_count), count);
+    if(thread_count <= 1)
+    {
+        for(size_t index = 0; index < count; index++)
+            callback(index);
+        return;
+    }
+
+    std::atomic<size_t> next_index = 0;
+    std::exception_ptr exception;
+    std::mutex exception_mutex;
+    auto worker = [&]() {
+        try
+        {
+            for(size_t index = next_index++; index < count; index = next_index++)
+                callback(index);
+        }
+        catch(...)
+        {
+            std::lock_guard lock(exception_mutex);
+            if(!exception)
+                exception = std::current_exception();
+            next_index = count;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned i = 1; i < thread_count; i++)
+        threads.emplace_back(worker);
+    worker();
+    for(auto& thread: threads)
+        thread.join();
+    if(exception)
+        std::rethrow_exception(exception);
+}
+
+// Objects (e.g scratch buffers) reused by parallel_for() callbacks. acquire() hands
+// out a free object and creates one only if all are in use, so a pool ends up with as
+// many objects as it had concurrent users. Objects go back to the pool when their
+// Lease is destroyed, and keep their contents.
+template<class T>
+class ObjectPool
+{
+public:
+    class Lease
+    {
+    public:
+        Lease(ObjectPool& pool, std::unique_ptr<T> object)
+        : m_pool(pool), m_object(std::move(object)) {}
+        ~Lease() { m_pool.release(std::move(m_object)); }
+
+        Lease(Lease const&) = delete;
+        Lease& operator=(Lease const&) = delete;
+
+        T& operator*() const { return *m_object; }
+        T* operator->() const { return m_object.get(); }
+
+    private:
+        ObjectPool& m_pool;
+        std::unique_ptr<T> m_object;
+    };
+
+    Lease acquire()
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            if(!m_free.empty())
+            {
+                auto object = std::move(m_free.back());
+                m_free.pop_back();
+                return Lease(*this, std::move(object));
+            }
+        }
+        return Lease(*this, std::make_unique<T>());
+    }
+
+private:
+    void release(std::unique_ptr<T> object)
+    {
+        std::lock_guard lock(m_mutex);
+        m_free.push_back(std::move(object));
+    }
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<T>> m_free;
+};
+
+}
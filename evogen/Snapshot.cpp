@@ -0,0 +1,372 @@
+#include <evogen/Snapshot.h>
+
+#include <evogen/BlockContainer.h>
+#include <evogen/Parallel.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace evo
+{
+
+// The directory is used in place, so the file layout is the in-memory one.
+static_assert(std::endian::native == std::endian::little);
+static_assert(sizeof(SnapshotFile::DirectoryEntry) == 32);
+
+static constexpr char MAGIC[8] = {'E', 'V', 'O', 'S', 'N', 'A', 'P', '\0'};
+// Chunks are compressed for size on disk, but saving should stay fast.
+static constexpr int COMPRESSION_LEVEL = 1;
+static constexpr size_t COMPRESS_BATCH_SIZE = 256;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t table_offset;
+    uint64_t table_size;
+};
+
+SnapshotFile::~SnapshotFile()
+{
+    if(m_data)
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+}
+
+std::shared_ptr<SnapshotFile> SnapshotFile::open(std::string const& path)
+{
+    auto fail = [&](std::string const& message) {
+        std::cerr << "Error loading snapshot " << path << ": " << message << std::endl;
+        return nullptr;
+    };
+
+    std::shared_ptr<SnapshotFile> file(new SnapshotFile);
+    file->m_path = path;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return fail("Could not open file");
+    struct stat info;
+    if(fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(SnapshotHeader))
+    {
+        void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED)
+        {
+            file->m_data = static_cast<uint8_t const*>(data);
+            file->m_size = info.st_size;
+        }
+    }
+    close(fd);
+    if(!file->m_data)
+        return fail("Could not map file");
+
+    SnapshotHeader header;
+    memcpy(&header, file->m_data, sizeof(header));
+    if(memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+        return fail("Not a snapshot");
+    if(header.version != VERSION)
+        return fail("Unsupported version " + std::to_string(header.version));
+    if(header.table_offset % 8 != 0 || header.table_offset > file->m_size || header.table_size > file->m_size - header.table_offset)
+        return fail("Invalid table location");
+
+    // Table: block count (u32), blocks (u16 length + string), marker count (u32),
+    // markers (u16 index, u16 length + string), padding to 8 bytes, chunk count
+    // (u64), directory.
+    auto position = file->m_data + header.table_offset;
+    auto end = position + header.table_size;
+    auto read = [&](void* output, size_t size) {
+        if(static_cast<size_t>(end - position) < size)
+            return false;
+        memcpy(output, position, size);
+        position += size;
+        return true;
+    };
+    auto read_string = [&](std::string& string) {
+        uint16_t length;
+        if(!read(&length, 2))
+            return false;
+        string.resize(length);
+        return read(string.data(), length);
+    };
+
+    uint32_t block_count;
+    if(!read(&block_count, 4) || block_count >= UINT16_MAX)
+        return fail("Invalid block table");
+    file->m_blocks.resize(block_count);
+    for(auto& block: file->m_blocks)
+    {
+        if(!read_string(block))
+            return fail("Invalid block table");
+    }
+    uint32_t marker_count;
+    if(!read(&marker_count, 4) || marker_count > UINT16_MAX + 1)
+        return fail("Invalid marker table");
+    file->m_markers.resize(marker_count);
+    for(auto& marker: file->m_markers)
+    {
+        if(!read(&marker.first, 2) || !read_string(marker.second))
+            return fail("Invalid marker table");
+    }
+    position += (8 - (position - file->m_data) % 8) % 8;
+    uint64_t chunk_count;
+    if(position > end || !read(&chunk_count, 8) || chunk_count > static_cast<size_t>(end - position) / sizeof(DirectoryEntry))
+        return fail("Invalid chunk directory");
+    file->m_directory = reinterpret_cast<DirectoryEntry const*>(position);
+    file->m_chunk_count = chunk_count;
+    return file;
+}
+
+static auto position_of(SnapshotFile::DirectoryEntry const& entry)
+{
+    return std::tuple(entry.x, entry.y, entry.z);
+}
+
+SnapshotFile::DirectoryEntry const* SnapshotFile::find(Vector<int> const& position) const
+{
+    auto key = std::tuple(position.x, position.y, position.z);
+    auto end = m_directory + m_chunk_count;
+    auto it = std::lower_bound(m_directory, end, key, [](DirectoryEntry const& entry, auto const& key) {
+        return position_of(entry) < key;
+    });
+    return it != end && position_of(*it) == key ? it : nullptr;
+}
+
+Vector<int> SnapshotFile::chunk_position(size_t index) const
+{
+    auto& entry = m_directory[index];
+    return {entry.x, entry.y, entry.z};
+}
+
+bool SnapshotFile::load_chunk(Vector<int> const& position, Chunk& chunk) const
+{
+    auto entry = find(position);
+    if(!entry || entry->offset > m_size || entry->size > m_size - entry->offset)
+        return false;
+    thread_local std::vector<uint8_t> buffer;
+    buffer.resize(entry->raw_size);
+    uLongf size = buffer.size();
+    if(uncompress(buffer.data(), &size, m_data + entry->offset, entry->size) != Z_OK || size != buffer.size())
+        return false;
+    return chunk.deserialize(buffer.data(), buffer.size());
+}
+
+namespace
+{
+
+// Buffered writes to a file descriptor, at increasing offsets.
+class RecordWriter
+{
+public:
+    RecordWriter(int fd, uint64_t offset)
+    : m_fd(fd), m_offset(offset) {}
+
+    // Returns the offset where the data starts.
+    uint64_t append(void const* data, size_t size)
+    {
+        auto offset = this->offset();
+        auto bytes = static_cast<uint8_t const*>(data);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+        if(m_buffer.size() >= BUFFER_SIZE)
+            flush();
+        return offset;
+    }
+
+    void align()
+    {
+        static constexpr uint8_t zeros[8] = {};
+        append(zeros, (8 - offset() % 8) % 8);
+    }
+
+    bool flush()
+    {
+        size_t written = 0;
+        while(written < m_buffer.size() && !m_failed)
+        {
+            auto result = pwrite(m_fd, m_buffer.data() + written, m_buffer.size() - written, m_offset + written);
+            if(result <= 0)
+                m_failed = true;
+            else
+                written += result;
+        }
+        m_offset += m_buffer.size();
+        m_buffer.clear();
+        return !m_failed;
+    }
+
+    uint64_t offset() const { return m_offset + m_buffer.size(); }
+
+private:
+    static constexpr size_t BUFFER_SIZE = 1 << 22;
+
+    int m_fd;
+    uint64_t m_offset;
+    std::vector<uint8_t> m_buffer;
+    bool m_failed = false;
+};
+
+}
+
+bool BlockContainer::load_snapshot(std::string const& path)
+{
+    auto file = SnapshotFile::open(path);
+    if(!file)
+        return false;
+
+    m_index_to_block.clear();
+    m_block_to_index.clear();
+    for(auto& block: file->blocks())
+        generate_index(Block::from_string(block));
+    m_marker_index_to_block.clear();
+    for(auto& [index, block]: file->markers())
+        m_marker_index_to_block[index] = Block::from_string(block);
+    m_chunks = ChunkMap();
+    m_chunks.set_source(file);
+    m_snapshot = std::move(file);
+    m_snapshot_generation = checkpoint();
+    return true;
+}
+
+bool BlockContainer::save_snapshot(std::string const& path)
+{
+    // Appending only works to the file that chunks come from; anything else is
+    // written from scratch (which also drops records replaced by earlier saves).
+    std::error_code error;
+    bool incremental = m_snapshot && std::filesystem::equivalent(path, m_snapshot->path(), error);
+    int fd = ::open(path.c_str(), incremental ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        std::cerr << "Could not open " << path << " for writing" << std::endl;
+        return false;
+    }
+
+    RecordWriter writer(fd, 0);
+    if(incremental)
+        writer = RecordWriter(fd, (m_snapshot->file_size() + 7) / 8 * 8);
+    else
+    {
+        SnapshotHeader header{};
+        writer.append(&header, sizeof(header));
+    }
+
+    // Unchanged chunks of the old file are kept where they are (or copied without
+    // decompressing them), the rest is compressed.
+    std::vector<SnapshotFile::DirectoryEntry> directory;
+    std::vector<std::pair<Vector<int>, Chunk const*>> chunks_to_write;
+    auto saved_generation = checkpoint();
+    if(m_snapshot)
+    {
+        for(size_t index = 0; index < m_snapshot->chunk_count(); index++)
+        {
+            auto position = m_snapshot->chunk_position(index);
+            auto chunk = m_chunks.find_loaded(position);
+            if(chunk && chunk->is_modified_since(m_snapshot_generation))
+            {
+                chunks_to_write.emplace_back(position, chunk);
+                continue;
+            }
+            auto entry = *m_snapshot->find(position);
+            if(!incremental)
+            {
+                if(entry.offset > m_snapshot->file_size() || entry.size > m_snapshot->file_size() - entry.offset)
+                {
+                    std::cerr << "Invalid chunk " << position.to_string() << " in snapshot " << m_snapshot->path() << std::endl;
+                    close(fd);
+                    return false;
+                }
+                entry.offset = writer.append(m_snapshot->data() + entry.offset, entry.size);
+            }
+            directory.push_back(entry);
+        }
+    }
+    for(auto& [position, chunk]: m_chunks.loaded_entries())
+    {
+        if(!m_snapshot || !m_snapshot->contains(position))
+            chunks_to_write.emplace_back(position, &chunk);
+    }
+
+    bool success = true;
+    std::vector<std::vector<uint8_t>> compressed(std::min(COMPRESS_BATCH_SIZE, chunks_to_write.size()));
+    std::vector<uint32_t> raw_sizes(compressed.size());
+    for(size_t batch_start = 0; batch_start < chunks_to_write.size(); batch_start += COMPRESS_BATCH_SIZE)
+    {
+        size_t batch_end = std::min(batch_start + COMPRESS_BATCH_SIZE, chunks_to_write.size());
+        parallel_for(batch_end - batch_start, 0, [&](size_t index) {
+            thread_local std::vector<uint8_t> raw;
+            raw.clear();
+            chunks_to_write[batch_start + index].second->serialize(raw);
+            auto& output = compressed[index];
+            uLongf size = compressBound(raw.size());
+            output.resize(size);
+            if(compress2(output.data(), &size, raw.data(), raw.size(), COMPRESSION_LEVEL) != Z_OK)
+                size = 0;
+            output.resize(size);
+            raw_sizes[index] = raw.size();
+        });
+        for(size_t index = batch_start; index < batch_end; index++)
+        {
+            auto& data = compressed[index - batch_start];
+            if(data.empty())
+                success = false;
+            auto position = chunks_to_write[index].first;
+            directory.push_back({position.x, position.y, position.z, raw_sizes[index - batch_start], writer.append(data.data(), data.size()), static_cast<uint32_t>(data.size()), 0});
+        }
+    }
+    std::sort(directory.begin(), directory.end(), [](auto const& a, auto const& b) { return position_of(a) < position_of(b); });
+
+    writer.align();
+    auto table_offset = writer.offset();
+    auto append_string = [&](std::string const& string) {
+        uint16_t length = string.size();
+        writer.append(&length, 2);
+        writer.append(string.data(), length);
+    };
+    uint32_t block_count = m_index_to_block.size();
+    writer.append(&block_count, 4);
+    for(auto block: m_index_to_block)
+        append_string(block.to_command_format());
+    uint32_t marker_count = m_marker_index_to_block.size();
+    writer.append(&marker_count, 4);
+    for(auto& [index, block]: m_marker_index_to_block)
+    {
+        writer.append(&index, 2);
+        append_string(block.to_command_format());
+    }
+    writer.align();
+    uint64_t chunk_count = directory.size();
+    writer.append(&chunk_count, 8);
+    writer.append(directory.data(), directory.size() * sizeof(directory[0]));
+
+    // The header is switched to the new table only after everything else is on disk.
+    SnapshotHeader header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = SnapshotFile::VERSION;
+    header.table_offset = table_offset;
+    header.table_size = writer.offset() - table_offset;
+    success = writer.flush() && fsync(fd) == 0 && success;
+    success = success && pwrite(fd, &header, sizeof(header), 0) == sizeof(header) && fsync(fd) == 0;
+    success = close(fd) == 0 && success;
+    if(!success)
+    {
+        std::cerr << "Error writing snapshot " << path << std::endl;
+        return false;
+    }
+
+    std::cout << "Snapshot: " << chunks_to_write.size() << " of " << directory.size() << " chunks written to " << path << std::endl;
+    auto file = SnapshotFile::open(path);
+    if(!file)
+        return false;
+    m_chunks.set_source(file);
+    m_snapshot = std::move(file);
+    m_snapshot_generation = saved_generation;
+    return true;
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <evogen/ChunkMap.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace evo
+{
+
+// A BlockContainer snapshot file (see BlockContainer::save_snapshot()), memory-mapped.
+//
+// Layout (little-endian): a header with the offset of the table, then records. The
+// table lists blocks (in index order) and markers, then a directory of chunk records
+// sorted by position, which is used in place. Chunk records are zlib-compressed
+// Chunk::serialize() output. Records are only ever appended: an incremental save
+// appends modified chunks and a new table, then switches the header to it.
+class SnapshotFile : public ChunkSource
+{
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    struct DirectoryEntry
+    {
+        int32_t x;
+        int32_t y;
+        int32_t z;
+        uint32_t raw_size;
+        uint64_t offset;
+        uint32_t size;
+        uint32_t reserved;
+    };
+
+    ~SnapshotFile();
+
+    // Returns null (and prints why) if the file can't be read.
+    static std::shared_ptr<SnapshotFile> open(std::string const& path);
+
+    std::string const& path() const { return m_path; }
+    size_t file_size() const { return m_size; }
+    uint8_t const* data() const { return m_data; }
+
+    // Blocks in command format, for block indices 1, 2, ...
+    std::vector<std::string> const& blocks() const { return m_blocks; }
+    std::vector<std::pair<uint16_t, std::string>> const& markers() const { return m_markers; }
+
+    // Null if there is no such chunk.
+    DirectoryEntry const* find(Vector<int> const&) const;
+
+    size_t chunk_count() const override { return m_chunk_count; }
+    Vector<int> chunk_position(size_t index) const override;
+    bool contains(Vector<int> const& position) const override { return find(position); }
+    bool load_chunk(Vector<int> const&, Chunk&) const override;
+
+private:
+    SnapshotFile() = default;
+
+    std::string m_path;
+    uint8_t const* m_data = nullptr;
+    size_t m_size = 0;
+    std::vector<std::string> m_blocks;
+    std::vector<std::pair<uint16_t, std::string>> m_markers;
+    DirectoryEntry const* m_directory = nullptr;
+    size_t m_chunk_count = 0;
+};
+
+}
@@ -1,69 +1,516 @@
 #include <evogen/Structure.h>
 
-#include <cpp-nbt/nbt.hpp>
-#include <fstream>
+#include <evogen/AnvilReader.h>
+#include <evogen/NBTReader.h>
+#include <evogen/StructureWriter.h>
+
+#include <bit>
+#include <climits>
+#include <cstring>
+#include <iostream>
 
 namespace evo
 {
 
+using TagType = NBTReader::TagType;
+
 bool Structure::load_from_file(std::string const& name, Format format)
 {
-    std::ifstream file(name);
-    if(!file.good())
+    NBTReader reader;
+    bool success = reader.open(name);
+    switch(format)
+    {
+        case Format::StructureBlock:
+            success = success && load_structure_block(reader);
+            break;
+        case Format::Schematic:
+            success = success && load_schematic(reader);
+            break;
+        case Format::Litematic:
+            success = success && load_litematic(reader);
+            break;
+    }
+    if(!success)
+    {
+        std::cerr << "Error loading NBT from " << name << ": " << reader.error() << std::endl;
+        return false;
+    }
+    std::cerr << "Structure loaded from file " << name << ": " << std::endl;
+    std::cerr << "   size = " << m_size.to_string() << std::endl;
+    return true;
+}
+
+bool Structure::load_from_world(std::string const& region_directory, Vector<int> const& start, Vector<int> const& end)
+{
+    Vector<int> min{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
+    Vector<int> max{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+    AnvilReader reader(region_directory);
+    if(!reader.read_box(min, max, *this, Vector<int>{} - min))
+    {
+        std::cerr << "Error loading structure from world " << region_directory << std::endl;
+        return false;
+    }
+    m_size = max - min + Vector<int>{1, 1, 1};
+    std::cerr << "Structure loaded from world " << region_directory << ": " << std::endl;
+    std::cerr << "   size = " << m_size.to_string() << std::endl;
+    return true;
+}
+
+bool Structure::save_to_file(std::string const& name) const
+{
+    if(m_size.x <= 0 || m_size.y <= 0 || m_size.z <= 0)
+    {
+        std::cerr << "Cannot save an empty structure to " << name << std::endl;
+        return false;
+    }
+    return StructureWriter().write_file(*this, {0, 0, 0}, m_size - Vector<int>{1, 1, 1}, name);
+}
+
+// Reads a list of 3 ints (sizes, positions).
+static bool read_int_vector(NBTReader& reader, TagType type, Vector<int>& vector)
+{
+    TagType element_type;
+    int32_t length;
+    if(type != TagType::List || !reader.read_list_header(element_type, length))
+        return reader.fail("Expected a list of coordinates");
+    if(element_type != TagType::Int || length != 3)
+        return reader.fail("Coordinates must be a list of 3 ints");
+    return reader.read_int(vector.x) && reader.read_int(vector.y) && reader.read_int(vector.z);
+}
+
+bool Structure::read_palette(NBTReader& reader, std::vector<BlockDescriptor>& palette)
+{
+    std::vector<BlockHandle> blocks;
+    if(!read_block_state_palette(reader, blocks))
         return false;
+    for(auto block: blocks)
+        palette.push_back(BlockDescriptor::create_block(ensure_index(block)));
+    return true;
+}
+
+bool Structure::load_structure_block(NBTReader& reader)
+{
+    TagType type;
+    std::string name;
+    if(!reader.read_root(type, name))
+        return false;
+    if(type != TagType::Compound)
+        return reader.fail("Root tag must be a compound");
+
+    // Palette indices are converted to our block descriptors once. Compounds are not
+    // ordered, so blocks that come before the palette are kept until it's read.
+    std::vector<BlockDescriptor> palette;
+    bool has_palette = false;
+    struct PendingBlock
+    {
+        Vector<int> position;
+        int32_t state;
+    };
+    std::vector<PendingBlock> pending_blocks;
+
+    auto place_block = [&](Vector<int> const& position, int32_t state) {
+        if(state < 0 || static_cast<size_t>(state) >= palette.size())
+            return reader.fail("Invalid block state index " + std::to_string(state));
+        set_block_descriptor_at(position, palette[state]);
+        return true;
+    };
 
-    try
+    while(true)
     {
-        nbt::NBT nbt(file);
-        auto size = nbt::get_list<nbt::TagInt>(nbt.at<nbt::TagList>("size"));
-        // FIXME: Are negative sizes allowed?
-        m_size = {size[0], size[1], size[2]};
-        std::cerr << "Loading palette" << std::endl;
-        auto palette = nbt::get_list<nbt::TagCompound>(nbt.at<nbt::TagList>("palette"));
+        if(!reader.read_tag_header(type, name))
+            return false;
+        if(type == TagType::End)
+            break;
 
-        // TODO: Handle this
-        //auto palettes = nbt::get_list<nbt::TagCompound>(nbt.at<nbt::TagList>("palettes"));
-        std::cerr << "Loading blocks" << std::endl;
-        auto blocks = nbt::get_list<nbt::TagCompound>(nbt.at<nbt::TagList>("blocks"));
-        for(auto& block : blocks)
+        if(name == "size")
         {
-            auto state = block.at<nbt::TagInt>("state");
-            auto pos = nbt::get_list<nbt::TagInt>(block.at<nbt::TagList>("pos"));
-            // TODO: Handle block NBT
-            auto position_vec = Vector<int>{pos[0], pos[1], pos[2]};
-            auto palette_entry = palette[state];
-            auto name = palette_entry.at<nbt::TagString>("Name");
-            nbt::TagCompound properties;
-            try
+            // FIXME: Are negative sizes allowed?
+            if(!read_int_vector(reader, type, m_size))
+                return false;
+        }
+        else if(name == "palette" && type == TagType::List)
+        {
+            if(!read_palette(reader, palette))
+                return false;
+            has_palette = true;
+        }
+        else if(name == "palettes" && type == TagType::List && !has_palette)
+        {
+            // Structures with random variants (e.g shipwrecks): use the first one.
+            TagType element_type;
+            int32_t length;
+            if(!reader.read_list_header(element_type, length))
+                return false;
+            for(int32_t index = 0; index < length; index++)
             {
-                properties = palette_entry.at<nbt::TagCompound>("Properties");
+                if(index == 0 && element_type == TagType::List)
+                {
+                    if(!read_palette(reader, palette))
+                        return false;
+                    has_palette = true;
+                }
+                else if(!reader.skip(element_type))
+                    return false;
             }
-            catch(...) {}
-            // TODO: Handle states
-            BlockStates states;
-            for(auto& property : properties.base)
+        }
+        else if(name == "blocks" && type == TagType::List)
+        {
+            TagType element_type;
+            int32_t length;
+            if(!reader.read_list_header(element_type, length))
+                return false;
+            if(length > 0 && element_type != TagType::Compound)
+                return reader.fail("Blocks must be a list of compounds");
+            for(int32_t index = 0; index < length; index++)
             {
-                auto property_string = std::get_if<nbt::TagString>(&property.second);
-                if(!property_string)
+                Vector<int> position;
+                int32_t state = -1;
+                while(true)
                 {
-                    std::cerr << "Blockstate property must be a String" << std::endl;
-                    return false;
+                    if(!reader.read_tag_header(type, name))
+                        return false;
+                    if(type == TagType::End)
+                        break;
+                    if(name == "state" && type == TagType::Int)
+                    {
+                        if(!reader.read_int(state))
+                            return false;
+                    }
+                    else if(name == "pos")
+                    {
+                        if(!read_int_vector(reader, type, position))
+                            return false;
+                    }
+                    // TODO: Handle block NBT
+                    else if(!reader.skip(type))
+                        return false;
+                }
+                if(has_palette)
+                {
+                    if(!place_block(position, state))
+                        return false;
                 }
-                states.set_state(property.first, *property_string);
+                else
+                    pending_blocks.push_back({position, state});
             }
+        }
+        // TODO: Handle entities
+        else if(!reader.skip(type))
+            return false;
+    }
+
+    if(!has_palette && !pending_blocks.empty())
+        return reader.fail("No palette");
+    for(auto& block: pending_blocks)
+    {
+        if(!place_block(block.position, block.state))
+            return false;
+    }
+    return true;
+}
 
-            set_block_at(position_vec, {name, states});
+// Reads a compound of 3 ints {x, y, z} (used by Litematica).
+static bool read_xyz_compound(NBTReader& reader, TagType type, Vector<int>& vector)
+{
+    if(type != TagType::Compound)
+        return reader.fail("Expected an {x, y, z} compound");
+    std::string name;
+    while(true)
+    {
+        if(!reader.read_tag_header(type, name))
+            return false;
+        if(type == TagType::End)
+            return true;
+        int64_t value;
+        if(name.size() == 1 && name[0] >= 'x' && name[0] <= 'z')
+        {
+            if(!reader.read_integer(type, value))
+                return false;
+            (name[0] == 'x' ? vector.x : name[0] == 'y' ? vector.y : vector.z) = value;
         }
-        // TODO: Handle this
-        //auto entities = nbt::get_list<nbt::TagCompound>(nbt.at<nbt::TagList>("entities"));
+        else if(!reader.skip(type))
+            return false;
     }
-    catch(std::exception& e)
+}
+
+// Decodes unsigned LEB128 varints, 8 bytes at a time while all of them are
+// single-byte values (the usual case for palettes up to 128 entries).
+class VarIntDecoder
+{
+public:
+    explicit VarIntDecoder(std::vector<uint8_t> const& data)
+    : m_position(data.data()), m_end(data.data() + data.size()) {}
+
+    bool decode(uint32_t* output, size_t count)
     {
-        std::cerr << "Exception during loading NBT: " << e.what() << std::endl;
+        size_t index = 0;
+        while(index < count)
+        {
+            if(count - index >= 8 && m_end - m_position >= 8)
+            {
+                uint64_t word;
+                memcpy(&word, m_position, 8);
+                if(!(word & 0x8080808080808080))
+                {
+                    for(int byte = 0; byte < 8; byte++)
+                        output[index++] = m_position[byte];
+                    m_position += 8;
+                    continue;
+                }
+            }
+            uint32_t value = 0;
+            for(int shift = 0;; shift += 7)
+            {
+                if(m_position == m_end || shift > 28)
+                    return false;
+                auto byte = *m_position++;
+                value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                if(!(byte & 0x80))
+                    break;
+            }
+            output[index++] = value;
+        }
+        return true;
+    }
+
+private:
+    uint8_t const* m_position;
+    uint8_t const* m_end;
+};
+
+bool Structure::load_schematic(NBTReader& reader)
+{
+    TagType type;
+    std::string name;
+    if(!reader.read_root(type, name))
         return false;
+    if(type != TagType::Compound)
+        return reader.fail("Root tag must be a compound");
+
+    // Compounds are not ordered, so everything is read before decoding.
+    Vector<int> size;
+    std::vector<std::pair<std::string, int32_t>> palette_entries;
+    std::vector<uint8_t> block_data;
+
+    // Palette is a compound of block state string -> index.
+    auto read_palette_entries = [&]() {
+        std::string block_string;
+        while(true)
+        {
+            if(!reader.read_tag_header(type, block_string))
+                return false;
+            if(type == TagType::End)
+                return true;
+            int64_t index;
+            if(!reader.read_integer(type, index))
+                return false;
+            palette_entries.push_back({block_string, static_cast<int32_t>(index)});
+        }
+    };
+
+    // v1/v2 have fields directly in the root, v3 in a "Schematic" compound, with blocks
+    // in a "Blocks" compound.
+    int depth = 1;
+    while(depth > 0)
+    {
+        if(!reader.read_tag_header(type, name))
+            return false;
+        if(type == TagType::End)
+        {
+            depth--;
+            continue;
+        }
+
+        int64_t value;
+        if((name == "Schematic" || name == "Blocks") && type == TagType::Compound)
+            depth++;
+        else if(name == "Width" || name == "Height" || name == "Length")
+        {
+            if(!reader.read_integer(type, value))
+                return false;
+            // Stored as (signed) shorts, but they are unsigned.
+            if(type == TagType::Short)
+                value = static_cast<uint16_t>(value);
+            (name == "Width" ? size.x : name == "Height" ? size.y : size.z) = value;
+        }
+        else if(name == "Palette" && type == TagType::Compound)
+        {
+            if(!read_palette_entries())
+                return false;
+        }
+        else if((name == "BlockData" || name == "Data") && type == TagType::ByteArray)
+        {
+            if(!reader.read_byte_array(block_data))
+                return false;
+        }
+        // TODO: Handle block entities
+        else if(!reader.skip(type))
+            return false;
+    }
+
+    int32_t palette_size = 0;
+    for(auto& entry: palette_entries)
+    {
+        if(entry.second < 0 || entry.second > UINT16_MAX)
+            return reader.fail("Invalid palette index " + std::to_string(entry.second));
+        palette_size = std::max(palette_size, entry.second + 1);
+    }
+    std::vector<BlockDescriptor> palette(palette_size);
+    for(auto& entry: palette_entries)
+        palette[entry.second] = BlockDescriptor::create_block(ensure_index(Block::from_string(entry.first)));
+
+    m_size = size;
+    VarIntDecoder decoder(block_data);
+    if(!set_blocks_from_indices({}, size, palette, [&](uint32_t* output, size_t count) { return decoder.decode(output, count); }))
+        return reader.fail("Invalid block data");
+    return true;
+}
+
+// Unpacks consecutive `bits`-bit values from a long array, a word at a time. Unlike
+// in Minecraft's chunk sections, values may span two words.
+class BitUnpacker
+{
+public:
+    BitUnpacker(std::vector<uint64_t> const& words, unsigned bits)
+    : m_words(words), m_bits(bits), m_mask((uint64_t{1} << bits) - 1) {}
+
+    bool decode(uint32_t* output, size_t count)
+    {
+        if(m_bit + count * m_bits > m_words.size() * 64)
+            return false;
+        for(size_t index = 0; index < count; index++)
+        {
+            auto word = m_bit >> 6;
+            auto offset = m_bit & 63;
+            auto value = m_words[word] >> offset;
+            if(offset + m_bits > 64)
+                value |= m_words[word + 1] << (64 - offset);
+            output[index] = value & m_mask;
+            m_bit += m_bits;
+        }
+        return true;
+    }
+
+private:
+    std::vector<uint64_t> const& m_words;
+    unsigned m_bits;
+    uint64_t m_mask;
+    size_t m_bit = 0;
+};
+
+bool Structure::load_litematic(NBTReader& reader)
+{
+    TagType type;
+    std::string name;
+    if(!reader.read_root(type, name))
+        return false;
+    if(type != TagType::Compound)
+        return reader.fail("Root tag must be a compound");
+
+    // Region positions are relative to the schematic origin, and sizes may be
+    // negative. Regions are placed after all of them are read, so that the
+    // minimum corner of all of them ends up at 0, 0, 0.
+    struct Region
+    {
+        Vector<int> position;
+        Vector<int> size;
+        std::vector<BlockDescriptor> palette;
+        std::vector<uint64_t> block_states;
+    };
+    std::vector<Region> regions;
+
+    while(true)
+    {
+        if(!reader.read_tag_header(type, name))
+            return false;
+        if(type == TagType::End)
+            break;
+        if(name != "Regions" || type != TagType::Compound)
+        {
+            if(!reader.skip(type))
+                return false;
+            continue;
+        }
+
+        std::string region_name;
+        while(true)
+        {
+            if(!reader.read_tag_header(type, region_name))
+                return false;
+            if(type == TagType::End)
+                break;
+            if(type != TagType::Compound)
+                return reader.fail("Region must be a compound");
+
+            Region region;
+            while(true)
+            {
+                if(!reader.read_tag_header(type, name))
+                    return false;
+                if(type == TagType::End)
+                    break;
+                if(name == "Position")
+                {
+                    if(!read_xyz_compound(reader, type, region.position))
+                        return false;
+                }
+                else if(name == "Size")
+                {
+                    if(!read_xyz_compound(reader, type, region.size))
+                        return false;
+                }
+                else if(name == "BlockStatePalette" && type == TagType::List)
+                {
+                    if(!read_palette(reader, region.palette))
+                        return false;
+                }
+                else if(name == "BlockStates" && type == TagType::LongArray)
+                {
+                    if(!reader.read_long_array(region.block_states))
+                        return false;
+                }
+                // TODO: Handle tile entities and entities
+                else if(!reader.skip(type))
+                    return false;
+            }
+            regions.push_back(std::move(region));
+        }
+    }
+
+    if(regions.empty())
+        return reader.fail("No regions");
+
+    // Normalize to the minimum corner and positive size.
+    Vector<int> min_corner{INT_MAX, INT_MAX, INT_MAX};
+    Vector<int> max_corner{INT_MIN, INT_MIN, INT_MIN};
+    for(auto& region: regions)
+    {
+        auto normalize = [](int& position, int& size) {
+            if(size < 0)
+            {
+                position += size + 1;
+                size = -size;
+            }
+        };
+        normalize(region.position.x, region.size.x);
+        normalize(region.position.y, region.size.y);
+        normalize(region.position.z, region.size.z);
+        min_corner = {std::min(min_corner.x, region.position.x), std::min(min_corner.y, region.position.y), std::min(min_corner.z, region.position.z)};
+        auto end = region.position + region.size;
+        max_corner = {std::max(max_corner.x, end.x), std::max(max_corner.y, end.y), std::max(max_corner.z, end.z)};
+    }
+    m_size = max_corner - min_corner;
+
+    for(auto& region: regions)
+    {
+        if(region.palette.empty())
+            return reader.fail("Region without a palette");
+        unsigned bits = std::max<unsigned>(2, std::bit_width(region.palette.size() - 1));
+        BitUnpacker unpacker(region.block_states, bits);
+        if(!set_blocks_from_indices(region.position - min_corner, region.size, region.palette,
+            [&](uint32_t* output, size_t count) { return unpacker.decode(output, count); }))
+            return reader.fail("Invalid block states");
     }
-    std::cerr << "Structure loaded from file " << name << ": " << std::endl;
-    std::cerr << "   size = " << m_size.to_string() << std::endl;
     return true;
 }
 
@@ -5,21 +5,37 @@
 namespace evo
 {
 
+class NBTReader;
+
 class Structure : public BlockContainer
 {
 public:
     enum class Format
     {
-        StructureBlock
-        // TODO: Schematic
-        // TODO: Extract from world
+        StructureBlock, // .nbt, saved by structure blocks
+        Schematic,      // .schem, Sponge schematic v1-v3 (WorldEdit)
+        Litematic,      // .litematic, Litematica
     };
 
+    // Files may be gzip-compressed (like the ones saved by structure blocks) or not.
     bool load_from_file(std::string const& name, Format format);
 
+    // Extracts the box between `start` and `end` (inclusive) from region files of a
+    // world (see AnvilReader).
+    bool load_from_world(std::string const& region_directory, Vector<int> const& start, Vector<int> const& end);
+
+    // Saves as a structure block template (gzip-compressed .nbt, see StructureWriter).
+    bool save_to_file(std::string const& name) const;
+
     Vector<int> size() const { return m_size; }
 
 private:
+    bool load_structure_block(NBTReader&);
+    bool load_schematic(NBTReader&);
+    bool load_litematic(NBTReader&);
+    // Reads a list of block state compounds, appending their descriptors to `palette`.
+    bool read_palette(NBTReader&, std::vector<BlockDescriptor>& palette);
+
     Vector<int> m_size;
 };
 
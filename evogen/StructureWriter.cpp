@@ -0,0 +1,296 @@
+#include <evogen/StructureWriter.h>
+
+#include <evogen/BlockContainer.h>
+#include <evogen/NBTWriter.h>
+#include <evogen/Parallel.h>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+namespace evo
+{
+
+using TagType = NBTWriter::TagType;
+
+static uint32_t key_of(BlockDescriptor descriptor)
+{
+    return static_cast<uint32_t>(descriptor.kind) << 16 | descriptor.arg;
+}
+
+static void write_int_list(NBTWriter& writer, std::string_view name, Vector<int> const& vector)
+{
+    writer.write_tag_header(TagType::List, name);
+    writer.write_list_header(TagType::Int, 3);
+    writer.write_int(vector.x);
+    writer.write_int(vector.y);
+    writer.write_int(vector.z);
+}
+
+StructureWriter::ChunkList StructureWriter::chunks_in_box(BlockContainer const& container, Vector<int> const& min, Vector<int> const& max)
+{
+    ChunkList chunks;
+    auto min_chunk = BlockContainer::chunk_position_from_block(min);
+    auto max_chunk = BlockContainer::chunk_position_from_block(max);
+    for(int x = min_chunk.x; x <= max_chunk.x; x++)
+    {
+        for(int y = min_chunk.y; y <= max_chunk.y; y++)
+        {
+            for(int z = min_chunk.z; z <= max_chunk.z; z++)
+            {
+                if(auto chunk = container.get_chunk_at({x, y, z}))
+                    chunks.emplace_back(Vector<int>{x, y, z}, chunk);
+            }
+        }
+    }
+    return chunks;
+}
+
+void StructureWriter::build_palette(BlockContainer const& container, ChunkList const& chunks)
+{
+    m_descriptor_to_entry.clear();
+    m_palette_entries.clear();
+    std::unordered_map<BlockHandle, int32_t> block_to_entry;
+    size_t blocks_without_nbt = 0;
+    for(auto& [position, chunk]: chunks)
+    {
+        for(auto descriptor: chunk->palette())
+        {
+            auto [it, inserted] = m_descriptor_to_entry.try_emplace(key_of(descriptor), -1);
+            if(!inserted)
+                continue;
+            auto& entry = it->second;
+            auto block = descriptor.is_placeable() ? container.block_from_descriptor(descriptor) : std::nullopt;
+            if(!block.has_value())
+                continue;
+            auto result = block_to_entry.try_emplace(*block, m_palette_entries.size());
+            if(result.second)
+            {
+                NBTWriter writer;
+                write_block_state(writer, block->block());
+                m_palette_entries.push_back(std::move(writer.data()));
+                if(!block->block().nbt().empty())
+                    blocks_without_nbt++;
+            }
+            entry = result.first->second;
+        }
+    }
+    if(blocks_without_nbt > 0)
+        std::cerr << "WARNING: " << blocks_without_nbt << " blocks with NBT are written without it" << std::endl;
+}
+
+bool StructureWriter::encode(ChunkList const& chunks, Vector<int> const& min, Vector<int> const& max, std::vector<uint8_t>& output) const
+{
+    // Palette of this template: the entries that it uses, in order of first use.
+    std::vector<int32_t> entry_to_state(m_palette_entries.size(), -1);
+    std::vector<int32_t> used_entries;
+    std::vector<int32_t> chunk_entries;
+    std::vector<uint32_t> indices;
+    NBTWriter blocks;
+    int32_t block_count = 0;
+
+    for(auto& [chunk_position, chunk]: chunks)
+    {
+        auto origin = BlockContainer::block_from_chunk_position_and_offset(chunk_position);
+        Vector<int> start{std::max(min.x, origin.x), std::max(min.y, origin.y), std::max(min.z, origin.z)};
+        Vector<int> end{std::min(max.x, origin.x + Chunk::SIZE - 1), std::min(max.y, origin.y + Chunk::SIZE - 1), std::min(max.z, origin.z + Chunk::SIZE - 1)};
+        if(start.x > end.x || start.y > end.y || start.z > end.z)
+            continue;
+
+        chunk_entries.clear();
+        bool has_blocks = false;
+        for(auto descriptor: chunk->palette())
+        {
+            chunk_entries.push_back(m_descriptor_to_entry.at(key_of(descriptor)));
+            has_blocks = has_blocks || chunk_entries.back() >= 0;
+        }
+        if(!has_blocks)
+            continue;
+
+        auto offset_start = BlockContainer::chunk_offset_from_block(start);
+        auto offset_end = BlockContainer::chunk_offset_from_block(end);
+        indices.resize(static_cast<size_t>(end.x - start.x + 1) * (end.y - start.y + 1) * (end.z - start.z + 1));
+        chunk->get_indices_at(offset_start, offset_end, indices.data());
+        size_t index = 0;
+        for(int x = start.x; x <= end.x; x++)
+        {
+            for(int y = start.y; y <= end.y; y++)
+            {
+                for(int z = start.z; z <= end.z; z++)
+                {
+                    auto entry = chunk_entries[indices[index++]];
+                    if(entry < 0)
+                        continue;
+                    auto& state = entry_to_state[entry];
+                    if(state < 0)
+                    {
+                        state = used_entries.size();
+                        used_entries.push_back(entry);
+                    }
+                    blocks.write_tag_header(TagType::Int, "state");
+                    blocks.write_int(state);
+                    write_int_list(blocks, "pos", Vector<int>{x, y, z} - min);
+                    blocks.write_end();
+                    block_count++;
+                }
+            }
+        }
+    }
+    NBTWriter writer;
+    writer.write_tag_header(TagType::Compound, "");
+    writer.write_tag_header(TagType::Int, "DataVersion");
+    writer.write_int(m_options.data_version);
+    write_int_list(writer, "size", max - min + Vector<int>{1, 1, 1});
+    writer.write_tag_header(TagType::List, "palette");
+    writer.write_list_header(TagType::Compound, used_entries.size());
+    for(auto entry: used_entries)
+        writer.write_raw(m_palette_entries[entry]);
+    writer.write_tag_header(TagType::List, "blocks");
+    writer.write_list_header(TagType::Compound, block_count);
+    writer.write_raw(blocks.data());
+    writer.write_tag_header(TagType::List, "entities");
+    writer.write_list_header(TagType::Compound, 0);
+    writer.write_end();
+    output = std::move(writer.data());
+    return block_count > 0;
+}
+
+bool StructureWriter::write_box(ChunkList const& chunks, Vector<int> const& min, Vector<int> const& max, std::string const& path) const
+{
+    // An empty template is still written.
+    NBTWriter writer;
+    encode(chunks, min, max, writer.data());
+    if(!writer.write_to_file(path))
+    {
+        std::cerr << "Could not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool StructureWriter::write_file(BlockContainer const& container, Vector<int> const& start, Vector<int> const& end, std::string const& path)
+{
+    Vector<int> min{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
+    Vector<int> max{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+    auto chunks = chunks_in_box(container, min, max);
+    build_palette(container, chunks);
+    return write_box(chunks, min, max, path);
+}
+
+void StructureWriter::prepare(BlockContainer const& container, ChunkList const& chunks)
+{
+    build_palette(container, chunks);
+}
+
+bool StructureWriter::write_prepared_file(BlockContainer const& container, Vector<int> const& start, Vector<int> const& end, std::string const& path) const
+{
+    Vector<int> min{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
+    Vector<int> max{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+    return write_box(chunks_in_box(container, min, max), min, max, path);
+}
+
+bool StructureWriter::write_tiles(BlockContainer const& container, Vector<int> const& start, Vector<int> const& end)
+{
+    Vector<int> min{std::min(start.x, end.x), std::min(start.y, end.y), std::min(start.z, end.z)};
+    Vector<int> max{std::max(start.x, end.x), std::max(start.y, end.y), std::max(start.z, end.z)};
+    auto size = max - min + Vector<int>{1, 1, 1};
+    int tile_size = m_options.tile_size;
+    Vector<int> tile_count{(size.x + tile_size - 1) / tile_size, (size.y + tile_size - 1) / tile_size, (size.z + tile_size - 1) / tile_size};
+
+    // The palette is built once for the whole box, from chunks looked up once here.
+    auto all_chunks = chunks_in_box(container, min, max);
+    build_palette(container, all_chunks);
+    struct Tile
+    {
+        Vector<int> index;
+        Vector<int> offset;
+        Vector<int> size;
+        ChunkList chunks;
+        bool written = false;
+    };
+    std::vector<Tile> tiles;
+    for(int x = 0; x < tile_count.x; x++)
+    {
+        for(int y = 0; y < tile_count.y; y++)
+        {
+            for(int z = 0; z < tile_count.z; z++)
+            {
+                auto& tile = tiles.emplace_back();
+                tile.index = {x, y, z};
+                tile.offset = tile.index * tile_size;
+                tile.size = {std::min(tile_size, size.x - tile.offset.x), std::min(tile_size, size.y - tile.offset.y), std::min(tile_size, size.z - tile.offset.z)};
+                tile.chunks = chunks_in_box(container, min + tile.offset, min + tile.offset + tile.size - Vector<int>{1, 1, 1});
+            }
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(m_options.directory, error);
+    if(error)
+    {
+        std::cerr << "Could not create " << m_options.directory << ": " << error.message() << std::endl;
+        return false;
+    }
+
+    auto file_name = [&](Tile const& tile) {
+        std::string result = m_options.name;
+        for(int index: {tile.index.x, tile.index.y, tile.index.z})
+        {
+            result += "_";
+            result += std::to_string(index);
+        }
+        result += ".nbt";
+        return result;
+    };
+
+    std::atomic<bool> success = true;
+    parallel_for(tiles.size(), m_options.thread_count, [&](size_t index) {
+        auto& tile = tiles[index];
+        NBTWriter writer;
+        auto tile_min = min + tile.offset;
+        if(!encode(tile.chunks, tile_min, tile_min + tile.size - Vector<int>{1, 1, 1}, writer.data()))
+            return;
+        auto path = m_options.directory + "/" + file_name(tile);
+        if(!writer.write_to_file(path))
+        {
+            std::cerr << "Could not write " << path << std::endl;
+            success = false;
+            return;
+        }
+        tile.written = true;
+    });
+
+    auto manifest_path = m_options.directory + "/" + m_options.name + ".json";
+    std::ofstream manifest(manifest_path);
+    auto to_json = [](Vector<int> const& vector) {
+        std::string result = "[";
+        result += std::to_string(vector.x);
+        result += ", ";
+        result += std::to_string(vector.y);
+        result += ", ";
+        result += std::to_string(vector.z);
+        result += "]";
+        return result;
+    };
+    manifest << "{\n    \"size\": " << to_json(size) << ",\n    \"tile_size\": " << tile_size << ",\n    \"tiles\": [";
+    size_t written_count = 0;
+    for(auto& tile: tiles)
+    {
+        if(!tile.written)
+            continue;
+        manifest << (written_count++ ? ",\n" : "\n") << "        {\"file\": \"" << file_name(tile) << "\", \"offset\": "
+                 << to_json(tile.offset) << ", \"size\": " << to_json(tile.size) << "}";
+    }
+    manifest << "\n    ]\n}\n";
+    if(!manifest)
+    {
+        std::cerr << "Could not write " << manifest_path << std::endl;
+        return false;
+    }
+    std::cout << "Structures: " << written_count << " of " << tiles.size() << " tiles written to " << m_options.directory << std::endl;
+    return success;
+}
+
+}
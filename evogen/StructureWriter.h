@@ -0,0 +1,74 @@
+#pragma once
+
+#include <evogen/Vector.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace evo
+{
+
+class BlockContainer;
+class Chunk;
+
+// Writes boxes of a BlockContainer as structure block templates (gzip-compressed
+// .nbt, read by Structure::Format::StructureBlock). Empty blocks are left out, so
+// that they work like structure void; markers are written as their blocks. Block NBT
+// is not written (see write_block_state()).
+class StructureWriter
+{
+public:
+    struct Options
+    {
+        std::string directory = ".";
+        // Tiles are saved as <name>_<x>_<y>_<z>.nbt (by tile index), listed in a
+        // <name>.json manifest.
+        std::string name = "structure";
+        // Structure blocks save and load at most 48x48x48.
+        int tile_size = 48;
+        int data_version = 3465;
+        // Threads used for writing tiles. 0 = all hardware threads.
+        unsigned thread_count = 0;
+    };
+
+    StructureWriter() = default;
+    explicit StructureWriter(Options const& options)
+    : m_options(options) {}
+
+    // Our chunks that intersect a box.
+    using ChunkList = std::vector<std::pair<Vector<int>, Chunk const*>>;
+
+    // Writes the box between `start` and `end` (inclusive) as one template.
+    bool write_file(BlockContainer const&, Vector<int> const& start, Vector<int> const& end, std::string const& path);
+
+    // Builds the palette once for all blocks of `chunks`, for write_prepared_file().
+    void prepare(BlockContainer const&, ChunkList const& chunks);
+    // Like write_file(), with the palette of prepare(). The box must be within the
+    // prepared chunks. Can be called from many threads at once.
+    bool write_prepared_file(BlockContainer const&, Vector<int> const& start, Vector<int> const& end, std::string const& path) const;
+
+    // Splits the box between `start` and `end` (inclusive) into tiles of tile_size^3
+    // (smaller at the far ends), written in parallel. Tiles without blocks are skipped.
+    // The manifest lists the offset (from the box minimum) and size of every tile.
+    bool write_tiles(BlockContainer const&, Vector<int> const& start, Vector<int> const& end);
+
+private:
+    static ChunkList chunks_in_box(BlockContainer const&, Vector<int> const& min, Vector<int> const& max);
+    // Encodes palette entries of all blocks placed by descriptors of `chunks`.
+    void build_palette(BlockContainer const&, ChunkList const& chunks);
+    // Returns false if the box has no blocks.
+    bool encode(ChunkList const& chunks, Vector<int> const& min, Vector<int> const& max, std::vector<uint8_t>& output) const;
+    // Writes a template of `chunks`, even if it's empty.
+    bool write_box(ChunkList const& chunks, Vector<int> const& min, Vector<int> const& max, std::string const& path) const;
+
+    Options m_options;
+    // Palette entry of every descriptor of the chunks (by kind << 16 | arg), -1 for
+    // descriptors that don't place anything. Only holds descriptors that are used, so
+    // writing a single chunk stays cheap.
+    std::unordered_map<uint32_t, int32_t> m_descriptor_to_entry;
+    std::vector<std::vector<uint8_t>> m_palette_entries;
+};
+
+}
@@ -1,34 +1,47 @@
 #include "Task.h"
 
-#include <evogen/Generator.h>
+#include <evogen/CommandWriter.h>
 
 namespace evo
 {
 
-void PlaceBlockTask::generate_code(Generator const& generator) const
+void PlaceBlockTask::generate_code(CommandWriter& writer, Turtle& turtle) const
 {
-    *generator.stream() << generator.turtle().to_execute_at() << " run setblock "
-                            << m_position.to_command_format() << " "
-                            << m_block.to_command_format() << std::endl;
+    writer << turtle.to_execute_at() << " run setblock "
+           << m_position << ' '
+           << m_block;
+    writer.end_line();
 }
 
-void FillBlocksTask::generate_code(Generator const& generator) const
+void FillBlocksTask::generate_code(CommandWriter& writer, Turtle& turtle) const
 {
-    *generator.stream() << generator.turtle().to_execute_at() << " run fill "
-                        << m_start_position.to_command_format() << " "
-                        << m_end_position.to_command_format() << " "
-                        << m_block.to_command_format() << std::endl;
+    writer << turtle.to_execute_at() << " run fill "
+           << m_start_position << ' '
+           << m_end_position << ' '
+           << m_block;
+    writer.end_line();
 }
 
-void MoveTurtleTask::generate_code(Generator const& generator) const
+void PlaceTemplateTask::generate_code(CommandWriter& writer, Turtle& turtle) const
 {
-    // FIXME: This is not the most elegant way to do this.
-    m_turtle.move(m_position.value());
-    *generator.stream() << "# turtle pos = " << m_turtle.position().to_string() << std::endl;
-    *generator.stream() << m_turtle.to_execute_as() << " at @s run tp @s "
-                        << m_position.to_command_format() << std::endl;
-    // DEBUG
-    *generator.stream() << m_turtle.to_execute_as() << " at @s run setblock ~ ~ ~ redstone_block" << std::endl;
+    writer << turtle.to_execute_at() << " run place template "
+           << m_name << ' '
+           << m_position;
+    writer.end_line();
+}
+
+void MoveTurtleTask::generate_code(CommandWriter& writer, Turtle& turtle) const
+{
+    turtle.move(m_position.value());
+    writer << "# turtle pos = " << turtle.position();
+    writer.end_line();
+    writer << turtle.to_execute_as() << " at @s run tp @s " << m_position;
+    writer.end_line();
+    if(m_debug_marker)
+    {
+        writer << turtle.to_execute_as() << " at @s run setblock ~ ~ ~ redstone_block";
+        writer.end_line();
+    }
 }
 
 }
@@ -1,59 +1,88 @@
 #pragma once
 
 #include <evogen/Block.h>
+#include <evogen/BlockHandle.h>
 #include <evogen/Turtle.h>
 
-#include <ostream>
-
 namespace evo
 {
 
-class Generator;
+class CommandWriter;
 
+// Tasks don't keep any output state, the turtle they are generated for is passed
+// in, so the same task list can be generated more than once (or concurrently).
 class Task
 {
 public:
-    virtual void generate_code(Generator const&) const = 0;
+    virtual ~Task() = default;
+
+    virtual void generate_code(CommandWriter&, Turtle&) const = 0;
+
+    // Lines written by generate_code().
+    virtual size_t line_count() const { return 1; }
+
+    // How generate_code() moves the turtle.
+    virtual Vector<int> turtle_movement() const { return {}; }
 };
 
 class PlaceBlockTask : public Task
 {
 public:
-    PlaceBlockTask(Block const& block, BlockPosition const& position)
+    PlaceBlockTask(BlockHandle block, BlockPosition const& position)
     : m_block(block), m_position(position) {}
 
-    virtual void generate_code(Generator const&) const override;
+    virtual void generate_code(CommandWriter&, Turtle&) const override;
 
 private:
-    Block m_block;
+    BlockHandle m_block;
     BlockPosition m_position;
 };
 
 class FillBlocksTask : public Task
 {
 public:
-    FillBlocksTask(Block const& block, BlockPosition const& start_position, BlockPosition const& end_position)
+    // Largest area that a single /fill can change.
+    static constexpr size_t MAX_VOLUME = 32768;
+
+    FillBlocksTask(BlockHandle block, BlockPosition const& start_position, BlockPosition const& end_position)
     : m_block(block), m_start_position(start_position), m_end_position(end_position) {}
 
-    virtual void generate_code(Generator const&) const override;
+    virtual void generate_code(CommandWriter&, Turtle&) const override;
 
 private:
-    Block m_block;
+    BlockHandle m_block;
     BlockPosition m_start_position;
     BlockPosition m_end_position;
 };
 
+class PlaceTemplateTask : public Task
+{
+public:
+    // `name` is a structure template of a datapack, e.g "evogen:output/0_0_0".
+    PlaceTemplateTask(std::string name, BlockPosition const& position)
+    : m_name(std::move(name)), m_position(position) {}
+
+    virtual void generate_code(CommandWriter&, Turtle&) const override;
+
+private:
+    std::string m_name;
+    BlockPosition m_position;
+};
+
 class MoveTurtleTask : public Task
 {
 public:
-    MoveTurtleTask(BlockPosition const& position, Turtle& turtle)
-    : m_position(position), m_turtle(turtle) {}
+    // With `debug_marker`, a redstone block is placed at every turtle stop.
+    MoveTurtleTask(BlockPosition const& position, bool debug_marker = false)
+    : m_position(position), m_debug_marker(debug_marker) {}
 
-    virtual void generate_code(Generator const&) const override;
+    virtual void generate_code(CommandWriter&, Turtle&) const override;
+    virtual size_t line_count() const override { return m_debug_marker ? 3 : 2; }
+    virtual Vector<int> turtle_movement() const override { return m_position.value(); }
 
 private:
     BlockPosition m_position;
-    Turtle& m_turtle;
+    bool m_debug_marker;
 };
 
 }
@@ -1,15 +1,25 @@
 #include <evogen/Turtle.h>
 
+#include <evogen/CommandWriter.h>
+
 namespace evo
 {
 
-void Turtle::generate_spawn_command(std::ostream& stream) const
+void Turtle::generate_spawn_command(CommandWriter& writer) const
 {
     // Teleport player(s) that load chunks to start position
-    stream << "tp @e[tag=evogen] " << m_start_position.to_string() << std::endl;
+    writer << "tp " << to_general_selector() << ' ' << m_start_position;
+    writer.end_line();
 
     // Actually summon the armor stand
-    stream << "summon armor_stand " << m_start_position.to_string() << R"( {Tags:["evogen"],NoGravity:1,Invisible:1,CustomName:"\")" + m_custom_name + R"(\""})" << std::endl;
+    writer << "summon armor_stand " << m_start_position << R"( {Tags:["evogen"],NoGravity:1,Invisible:1,CustomName:"\")" << m_custom_name << R"(\""})";
+    writer.end_line();
+}
+
+void Turtle::generate_teleport_command(CommandWriter& writer) const
+{
+    writer << "tp " << to_general_selector() << ' ' << m_current_position;
+    writer.end_line();
 }
 
 }
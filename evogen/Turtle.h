@@ -2,38 +2,49 @@
 
 #include <evogen/Vector.h>
 
-#include <ostream>
 #include <string>
 
 namespace evo
 {
 
+class CommandWriter;
+
 class Turtle
 {
 public:
     Turtle(Vector<int> start_position, std::string custom_name = "evoTurtle")
-    : m_start_position(start_position), m_current_position(start_position), m_custom_name(custom_name) {}
+    : m_start_position(start_position), m_current_position(start_position), m_custom_name(custom_name)
+    , m_strict_selector("@e[tag=evogen,type=armor_stand,name=" + m_custom_name + "]")
+    , m_execute_as("execute as " + to_general_selector())
+    , m_execute_at("execute at " + m_strict_selector) {}
 
     Vector<int> start_position() const { return m_start_position; }
 
-    void generate_spawn_command(std::ostream&) const;
+    void generate_spawn_command(CommandWriter&) const;
+    // Teleports the turtle and player(s) that load chunks to the current position.
+    void generate_teleport_command(CommandWriter&) const;
 
-    std::string to_strict_selector() const { return "@e[tag=evogen,type=armor_stand,name=" + m_custom_name + "]"; }
+    // Selectors and prefixes are built once, they are used by every command.
+    std::string const& to_strict_selector() const { return m_strict_selector; }
     std::string to_general_selector() const { return "@e[tag=evogen]"; }
 
     // Use for teleporting (e.g player)
-    std::string to_execute_as() const { return "execute as " + to_general_selector(); }
+    std::string const& to_execute_as() const { return m_execute_as; }
 
     // Use for filling, when you need to execute command once
-    std::string to_execute_at() const { return "execute at " + to_strict_selector(); }
+    std::string const& to_execute_at() const { return m_execute_at; }
 
     void move(Vector<int> const& vector) { m_current_position += vector; }
+    void set_position(Vector<int> const& position) { m_current_position = position; }
     Vector<int> position() const { return m_current_position; }
 
 private:
     Vector<int> m_start_position;
     Vector<int> m_current_position;
     std::string m_custom_name;
+    std::string m_strict_selector;
+    std::string m_execute_as;
+    std::string m_execute_at;
 };
 
 }
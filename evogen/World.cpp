@@ -1,8 +1,151 @@
 #include <evogen/World.h>
 
+#include <evogen/ChunkOrder.h>
+#include <evogen/Parallel.h>
+#include <evogen/StructureWriter.h>
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
 namespace evo
 {
 
+static int axis_of(Vector<int> const& vector, int axis)
+{
+    return axis == 0 ? vector.x : axis == 1 ? vector.y : vector.z;
+}
+
+static void set_axis_of(Vector<int>& vector, int axis, int value)
+{
+    (axis == 0 ? vector.x : axis == 1 ? vector.y : vector.z) = value;
+}
+
+// Merges boxes that continue each other across chunk boundaries (e.g a box ending
+// at the +X face of its chunk with a box of the same block and cross-section
+// starting at the -X face of the next one), as long as the result fits in one /fill.
+// Boxes are in absolute coordinates; a merged box stays with the chunk that contains
+// its start.
+static void merge_boxes_across_chunks(std::vector<std::vector<BlockBox>>& chunk_boxes, size_t chunk_count)
+{
+    for(int axis = 0; axis < 3; axis++)
+    {
+        // Coordinate on `axis` where the box starts, cross-section, block.
+        using Key = std::tuple<int, int, int, int, int, uint8_t, uint16_t>;
+        auto key_of = [axis](BlockBox const& box, int axis_start) {
+            int a = (axis + 1) % 3, b = (axis + 2) % 3;
+            return Key{axis_start, axis_of(box.start, a), axis_of(box.end, a),
+                       axis_of(box.start, b), axis_of(box.end, b), box.block.kind, box.block.arg};
+        };
+
+        // Boxes are disjoint, so there is at most one box per key.
+        std::map<Key, BlockBox*> boundary_starts;
+        for(size_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            for(auto& box: chunk_boxes[chunk])
+            {
+                if(axis_of(box.start, axis) % Chunk::SIZE == 0)
+                    boundary_starts.emplace(key_of(box, axis_of(box.start, axis)), &box);
+            }
+        }
+        if(boundary_starts.empty())
+            continue;
+
+        for(size_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            for(auto& box: chunk_boxes[chunk])
+            {
+                // Boxes absorbed by another one are marked Empty.
+                while(box.block.is_placeable() && (axis_of(box.end, axis) + 1) % Chunk::SIZE == 0)
+                {
+                    auto it = boundary_starts.find(key_of(box, axis_of(box.end, axis) + 1));
+                    if(it == boundary_starts.end() || !it->second->block.is_placeable())
+                        break;
+                    auto merged = box;
+                    set_axis_of(merged.end, axis, axis_of(it->second->end, axis));
+                    if(merged.volume() > FillBlocksTask::MAX_VOLUME)
+                        break;
+                    box = merged;
+                    it->second->block = BlockDescriptor::create_empty();
+                }
+            }
+        }
+
+        for(size_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            auto& boxes = chunk_boxes[chunk];
+            boxes.erase(std::remove_if(boxes.begin(), boxes.end(), [](auto const& box) { return !box.block.is_placeable(); }), boxes.end());
+        }
+    }
+}
+
+// Blocks that the generator places for every entry of a chunk palette, invalid
+// handles where it places nothing.
+static void resolve_palette(World const& world, Chunk const& chunk, std::vector<BlockHandle>& blocks)
+{
+    blocks.clear();
+    for(auto descriptor: chunk.palette())
+        blocks.push_back(world.block_from_descriptor(descriptor).value_or(BlockHandle()));
+}
+
+// Builds a chunk of what has to change to turn `base_chunk` into `chunk` (either may
+// be null, i.e empty): descriptors of `chunk` where it places another block, `removed`
+// where only the base places something, Empty elsewhere. Returns false if nothing
+// changed.
+namespace
+{
+
+// Scratch space of diff_chunk(), reused for every chunk of a pass.
+struct DiffBuffers
+{
+    std::vector<BlockHandle> blocks;
+    std::vector<BlockHandle> base_blocks;
+    std::vector<uint32_t> indices = std::vector<uint32_t>(Chunk::VOLUME);
+    std::vector<uint32_t> base_indices = std::vector<uint32_t>(Chunk::VOLUME);
+    std::vector<uint32_t> diff_indices = std::vector<uint32_t>(Chunk::VOLUME);
+};
+
+}
+
+static bool diff_chunk(World const& world, Chunk const* chunk, World const& base, Chunk const* base_chunk, BlockDescriptor removed, Chunk& diff, DiffBuffers& buffers)
+{
+    static Chunk const empty_chunk;
+    chunk = chunk ? chunk : &empty_chunk;
+    base_chunk = base_chunk ? base_chunk : &empty_chunk;
+
+    auto& [blocks, base_blocks, indices, base_indices, diff_indices] = buffers;
+    resolve_palette(world, *chunk, blocks);
+    resolve_palette(base, *base_chunk, base_blocks);
+    // Optimized chunks with equal contents have equal palettes and index arrays. The
+    // palettes are short, and the arrays are often shared (e.g a world loaded from the
+    // base snapshot), so this is usually cheap.
+    if(blocks == base_blocks && chunk->has_same_indices(*base_chunk))
+        return false;
+
+    Vector<unsigned> end{Chunk::SIZE - 1, Chunk::SIZE - 1, Chunk::SIZE - 1};
+    chunk->get_indices_at({}, end, indices.data());
+    base_chunk->get_indices_at({}, end, base_indices.data());
+
+    // Diff palette: Empty, `removed`, then the palette of `chunk`.
+    std::vector<BlockDescriptor> palette{BlockDescriptor::create_empty(), removed};
+    palette.insert(palette.end(), chunk->palette().begin(), chunk->palette().end());
+    bool changed = false;
+    for(size_t index = 0; index < Chunk::VOLUME; index++)
+    {
+        auto block = blocks[indices[index]];
+        auto base_block = base_blocks[base_indices[index]];
+        uint32_t diff_index = 0;
+        if(!(block == base_block))
+            diff_index = block.is_valid() ? indices[index] + 2 : 1;
+        diff_indices[index] = diff_index;
+        changed = changed || diff_index != 0;
+    }
+    if(!changed)
+        return false;
+    diff.set_blocks_at({}, end, diff_indices.data(), palette);
+    return true;
+}
+
 void World::generate_tasks(Generator& generator) const
 {
     std::cerr << "Block index: size: " << m_index_to_block.size() << std::endl;
@@ -17,15 +160,161 @@ void World::generate_tasks(Generator& generator) const
         std::cerr << " - " << it.first << ": " << it.second.to_command_format() << std::endl;
     }
 
-    std::cerr << "Chunks: count = " << m_chunks.size() << std::endl;
+    struct ScanChunk
+    {
+        Vector<int> position;
+        Chunk const* chunk;
+        // Diff mode only. Either chunk may be null then, but not both.
+        Chunk const* base_chunk = nullptr;
+    };
+    std::vector<ScanChunk> chunks;
+    auto base = generator.diff_base();
+    if(base)
+    {
+        for(auto& it: m_chunks)
+            chunks.push_back({it.first, &it.second, base->get_chunk_at(it.first)});
+        for(auto& it: base->m_chunks)
+        {
+            if(!get_chunk_at(it.first))
+                chunks.push_back({it.first, nullptr, &it.second});
+        }
+        std::cerr << "Chunks: " << chunks.size() << " (" << m_chunks.size() << " new, " << base->m_chunks.size() << " base)" << std::endl;
+    }
+    else if(auto checkpoint = generator.incremental_checkpoint())
+    {
+        // Only touches modified chunks, which are all loaded already.
+        for(auto& position: dirty_chunks_since(*checkpoint))
+        {
+            if(auto chunk = get_chunk_at(position))
+                chunks.push_back({position, chunk});
+        }
+        std::cerr << "Chunks: " << chunks.size() << " of " << m_chunks.size() << " modified since checkpoint " << *checkpoint << std::endl;
+    }
+    else
+    {
+        std::cerr << "Chunks: count = " << m_chunks.size() << ", memory = " << memory_usage() / 1024
+                  << " KiB (dense: " << m_chunks.size() * Chunk::dense_memory_usage() / 1024 << " KiB)" << std::endl;
+
+        chunks.reserve(m_chunks.size());
+        for(auto& it: m_chunks)
+            chunks.push_back({it.first, &it.second});
+    }
+    auto failed_count = m_chunks.failed_count() + (base ? base->m_chunks.failed_count() : 0);
+    if(failed_count > 0)
+        std::cerr << "Error: " << failed_count << " chunks could not be loaded, they are not generated" << std::endl;
+    sort_by_chunk_order(chunks, generator.chunk_order(), [](auto const& chunk) { return chunk.position; });
+
+    // In diff mode, removed blocks are cleared with air. Index 0 is never a valid
+    // block index, so it stands for air if we have no index for it.
+    BlockHandle air = VanillaBlock::Air;
+    auto air_descriptor = BlockDescriptor::create_block(index_of(air).value_or(0));
+
+    // Chunks are scanned independently (possibly in parallel) in fixed-size batches,
+    // and emitted in the generator's chunk order, so that the output doesn't depend on
+    // hashing or on the thread count. Batches keep memory bounded when streaming.
+    std::vector<std::vector<BlockBox>> chunk_boxes(std::min(SCAN_BATCH_SIZE, chunks.size()));
     Vector<int> last_turtle_position = generator.turtle().start_position();
-    for(auto& it: m_chunks)
+
+    // Scratch buffers are taken from pools, so the pass allocates at most one set per
+    // worker thread. Scan buffers belong to the generator and are kept for later passes.
+    ObjectPool<DiffBuffers> diff_buffers;
+
+    // Chunks that would need too many block commands are written as templates
+    // instead. That is decided before merging boxes, so that no merged box covers
+    // a templated chunk. All templates share one palette, built here.
+    auto& template_options = generator.template_options();
+    bool use_templates = !base && template_options && generator.prepare_template_directory();
+    StructureWriter template_writer;
+    if(use_templates)
+    {
+        StructureWriter::ChunkList template_chunks;
+        template_chunks.reserve(chunks.size());
+        for(auto& scan_chunk: chunks)
+            template_chunks.emplace_back(scan_chunk.position, scan_chunk.chunk);
+        template_writer.prepare(*this, template_chunks);
+    }
+    for(size_t batch_start = 0; batch_start < chunks.size(); batch_start += SCAN_BATCH_SIZE)
     {
-        auto position = block_from_chunk_position_and_offset(it.first);
-        //std::cerr << " - " << it.first.to_string() << " (" << position.to_string() << ")" << std::endl;
-        generator.add_task<MoveTurtleTask>(position - last_turtle_position, generator.turtle());
-        last_turtle_position = position;
-        it.second.generate_tasks(*this, generator);
+        size_t batch_end = std::min(batch_start + SCAN_BATCH_SIZE, chunks.size());
+        std::vector<size_t> z_runs(batch_end - batch_start);
+        // Block commands replaced by the chunk's template, 0 if not templated.
+        std::vector<size_t> templated(batch_end - batch_start);
+        // Diff mode: chunks without changes.
+        std::vector<char> unchanged(batch_end - batch_start);
+        parallel_for(batch_end - batch_start, generator.thread_count(), [&](size_t index) {
+            auto& boxes = chunk_boxes[index];
+            boxes.clear();
+            auto& scan_chunk = chunks[batch_start + index];
+            auto scan_buffers = generator.scan_buffers().acquire();
+            if(base)
+            {
+                Chunk diff;
+                if(diff_chunk(*this, scan_chunk.chunk, *base, scan_chunk.base_chunk, air_descriptor, diff, *diff_buffers.acquire()))
+                    z_runs[index] = diff.generate_boxes(boxes, *scan_buffers);
+                else
+                    unchanged[index] = true;
+            }
+            else
+                z_runs[index] = scan_chunk.chunk->generate_boxes(boxes, *scan_buffers);
+            auto origin = block_from_chunk_position_and_offset(scan_chunk.position);
+            // This is a heuristic: merging across chunks can still remove some of the
+            // chunk's boxes, so its cost in block commands may end up a bit lower.
+            if(use_templates && boxes.size() > template_options->template_cost)
+            {
+                // If writing fails, the chunk is generated with block commands.
+                auto path = generator.template_path(scan_chunk.position);
+                if(template_writer.write_prepared_file(*this, origin, origin + Vector<int>{Chunk::SIZE - 1, Chunk::SIZE - 1, Chunk::SIZE - 1}, path))
+                {
+                    templated[index] = boxes.size();
+                    boxes.clear();
+                    return;
+                }
+            }
+            for(auto& box: boxes)
+            {
+                box.start += origin;
+                box.end += origin;
+            }
+        });
+        merge_boxes_across_chunks(chunk_boxes, batch_end - batch_start);
+
+        for(size_t index = batch_start; index < batch_end; index++)
+        {
+            auto& boxes = chunk_boxes[index - batch_start];
+            generator.statistics().unchanged_chunks += unchanged[index - batch_start];
+            generator.statistics().z_runs += z_runs[index - batch_start];
+            auto templated_block_commands = templated[index - batch_start];
+            if(boxes.empty() && templated_block_commands == 0)
+                continue;
+
+            auto position = block_from_chunk_position_and_offset(chunks[index].position);
+            //std::cerr << " - " << chunks[index].position.to_string() << " (" << position.to_string() << ")" << std::endl;
+            generator.add_task<MoveTurtleTask>(position - last_turtle_position, generator.debug_markers());
+            last_turtle_position = position;
+            if(templated_block_commands > 0)
+            {
+                generator.add_task<PlaceTemplateTask>(generator.template_name(chunks[index].position), Vector<int>{});
+                generator.statistics().template_commands++;
+                generator.statistics().templated_block_commands += templated_block_commands;
+                continue;
+            }
+            for(auto& box: boxes)
+            {
+                auto block = box.block == air_descriptor ? air : block_from_descriptor(box.block);
+                if(!block.has_value())
+                {
+                    std::cout << "ERROR: No block for " << (box.block.kind == BlockDescriptor::Marker ? "marker" : "block")
+                        << " index " << box.block.arg << std::endl;
+                    assert(false);
+                    continue;
+                }
+                if(box.volume() == 1)
+                    generator.add_task<PlaceBlockTask>(block.value(), box.start - position);
+                else
+                    generator.add_task<FillBlocksTask>(block.value(), box.start - position, box.end - position);
+                generator.statistics().block_commands++;
+            }
+        }
     }
 }
 
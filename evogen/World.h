@@ -8,6 +8,13 @@ namespace evo
 class World : public BlockContainer
 {
 public:
+    // Chunks scanned at once. Boxes are merged across chunk boundaries only
+    // within a batch.
+    static constexpr size_t SCAN_BATCH_SIZE = 256;
+
+    // Keeps no state in the world (scratch buffers come from the generator), so it can
+    // be generated any number of times, and by many generators at once. Chunks of a
+    // snapshot that fail to load are reported and left out.
     void generate_tasks(Generator&) const;
 };
 
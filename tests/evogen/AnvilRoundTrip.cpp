@@ -0,0 +1,340 @@
+#include <evogen/AnvilReader.h>
+#include <evogen/AnvilWriter.h>
+#include <evogen/NBTReader.h>
+#include <evogen/VanillaBlock.h>
+#include <evogen/World.h>
+
+#include <bit>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <tuple>
+#include <zlib.h>
+
+// Writes a world as Anvil region files, decodes them again and checks that every
+// block inside the world height matches (and that blocks outside of it are dropped),
+// and that the WORLD_SURFACE heightmaps agree with the blocks. Then reads them back
+// with AnvilReader, which must give the same blocks.
+
+using evo::Vector;
+using TagType = evo::NBTReader::TagType;
+
+static constexpr int MIN_Y = -64;
+static constexpr int HEIGHT = 384;
+
+using Position = std::tuple<int, int, int>;
+
+static Position key_of(Vector<int> const& position)
+{
+    return {position.x, position.y, position.z};
+}
+
+static std::string to_string(Position const& position)
+{
+    return Vector<int>{std::get<0>(position), std::get<1>(position), std::get<2>(position)}.to_string();
+}
+
+// Just enough of an NBT tree to look at chunks.
+struct Tag
+{
+    TagType type = TagType::End;
+    int64_t integer = 0;
+    std::string string;
+    std::vector<uint64_t> longs;
+    std::vector<Tag> list;
+    std::map<std::string, Tag> compound;
+
+    Tag const& operator[](std::string const& name) const
+    {
+        static Tag const missing;
+        auto it = compound.find(name);
+        return it == compound.end() ? missing : it->second;
+    }
+};
+
+static bool read_payload(evo::NBTReader& reader, TagType type, Tag& tag)
+{
+    tag.type = type;
+    switch(type)
+    {
+    case TagType::Byte:
+    case TagType::Short:
+    case TagType::Int:
+    case TagType::Long:
+        return reader.read_integer(type, tag.integer);
+    case TagType::String:
+        return reader.read_string(tag.string);
+    case TagType::LongArray:
+        return reader.read_long_array(tag.longs);
+    case TagType::List:
+    {
+        TagType element_type;
+        int32_t length;
+        if(!reader.read_list_header(element_type, length))
+            return false;
+        tag.list.resize(std::max(length, 0));
+        for(auto& element: tag.list)
+        {
+            if(!read_payload(reader, element_type, element))
+                return false;
+        }
+        return true;
+    }
+    case TagType::Compound:
+        for(;;)
+        {
+            TagType child_type;
+            std::string name;
+            if(!reader.read_tag_header(child_type, name))
+                return false;
+            if(child_type == TagType::End)
+                return true;
+            if(!read_payload(reader, child_type, tag.compound[name]))
+                return false;
+        }
+    default:
+        return reader.skip(type);
+    }
+}
+
+static std::string normalize(evo::Block const& block)
+{
+    auto id = block.id().find(':') == std::string::npos ? "minecraft:" + block.id() : block.id();
+    return evo::Block(id, block.states()).to_command_format();
+}
+
+static std::string expected_at(evo::World const& world, Vector<int> const& position)
+{
+    if(position.y < MIN_Y || position.y >= MIN_Y + HEIGHT)
+        return "(none)";
+    auto descriptor = world.get_block_descriptor_at(position);
+    if(!descriptor || !descriptor->is_placeable())
+        return "(none)";
+    auto block = world.block_from_descriptor(*descriptor);
+    return block ? normalize(block->block()) : "(none)";
+}
+
+// Decodes all chunks of all region files in `directory` into `blocks` (air left
+// out). Returns the number of errors.
+static int decode_regions(std::string const& directory, std::map<Position, std::string>& blocks)
+{
+    int errors = 0;
+    auto error = [&](std::string const& message) {
+        if(errors++ < 10)
+            std::cout << message << std::endl;
+    };
+    for(auto& file: std::filesystem::directory_iterator(directory))
+    {
+        std::ifstream stream(file.path(), std::ios::binary);
+        std::vector<uint8_t> data{std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+        if(data.size() < 8192 || data.size() % 4096 != 0)
+        {
+            error(file.path().string() + ": bad size");
+            continue;
+        }
+        for(size_t index = 0; index < 1024; index++)
+        {
+            size_t offset = (data[index * 4] << 16 | data[index * 4 + 1] << 8 | data[index * 4 + 2]) * size_t{4096};
+            if(offset == 0)
+                continue;
+            if(offset + 5 > data.size())
+            {
+                error(file.path().string() + ": bad chunk offset");
+                continue;
+            }
+            uint32_t length = data[offset] << 24 | data[offset + 1] << 16 | data[offset + 2] << 8 | data[offset + 3];
+            if(length == 0 || offset + 4 + length > data.size() || data[offset + 4] != 2)
+            {
+                error(file.path().string() + ": bad chunk header");
+                continue;
+            }
+            std::vector<uint8_t> nbt(1 << 22);
+            uLongf nbt_size = nbt.size();
+            if(uncompress(nbt.data(), &nbt_size, data.data() + offset + 5, length - 1) != Z_OK)
+            {
+                error(file.path().string() + ": bad compressed chunk");
+                continue;
+            }
+            evo::NBTReader reader(nbt.data(), nbt_size);
+            TagType type;
+            std::string name;
+            Tag chunk;
+            if(!reader.read_root(type, name) || type != TagType::Compound || !read_payload(reader, type, chunk))
+            {
+                error(file.path().string() + ": " + reader.error());
+                continue;
+            }
+
+            Vector<int> chunk_origin{static_cast<int>(chunk["xPos"].integer) * 16, 0, static_cast<int>(chunk["zPos"].integer) * 16};
+            std::vector<int> heights(256);
+            for(auto& section: chunk["sections"].list)
+            {
+                auto& palette = section["block_states"]["palette"].list;
+                std::vector<std::string> names;
+                for(auto& entry: palette)
+                {
+                    std::string states;
+                    for(auto& [property, value]: entry["Properties"].compound)
+                        states += (states.empty() ? "" : ",") + property + "=" + value.string;
+                    names.push_back(entry["Name"].string == "minecraft:air" ? "" : normalize(evo::Block(entry["Name"].string, evo::BlockStates::from_string(states))));
+                }
+                auto& words = section["block_states"]["data"].longs;
+                int bits = std::max(4, static_cast<int>(std::bit_width(names.size() - 1)));
+                int per_word = 64 / bits;
+                if(names.empty() || (names.size() > 1 && words.size() != static_cast<size_t>((4096 + per_word - 1) / per_word)))
+                {
+                    error(file.path().string() + ": bad section");
+                    continue;
+                }
+                for(int block = 0; block < 4096; block++)
+                {
+                    size_t value = names.size() == 1 ? 0 : words[block / per_word] >> (block % per_word * bits) & ((uint64_t{1} << bits) - 1);
+                    if(value >= names.size())
+                    {
+                        error(file.path().string() + ": bad palette index");
+                        break;
+                    }
+                    if(names[value].empty())
+                        continue;
+                    int x = block % 16, z = block / 16 % 16, y = static_cast<int>(section["Y"].integer) * 16 + block / 256;
+                    blocks[key_of(chunk_origin + Vector<int>{x, y, z})] = names[value];
+                    heights[z * 16 + x] = std::max(heights[z * 16 + x], y - MIN_Y + 1);
+                }
+            }
+
+            auto& heightmap = chunk["Heightmaps"]["WORLD_SURFACE"].longs;
+            if(heightmap.size() != 37)
+            {
+                error(file.path().string() + ": bad heightmap");
+                continue;
+            }
+            for(int column = 0; column < 256; column++)
+            {
+                int height = heightmap[column / 7] >> (column % 7 * 9) & 511;
+                if(height != heights[column])
+                    error("Heightmap at " + (chunk_origin + Vector<int>{column % 16, 0, column / 16}).to_string() + ": expected " + std::to_string(heights[column]) + ", got " + std::to_string(height));
+            }
+        }
+    }
+    return errors;
+}
+
+int main()
+{
+    auto directory = (std::filesystem::temp_directory_path() / "evogen-AnvilRoundTrip").string();
+    std::filesystem::remove_all(directory);
+
+    evo::World world;
+    world.set_marker(evo::World::marker_index_from_color({255, 255, 0}), {"minecraft:yellow_wool"});
+    world.fill_blocks_at({11, 11, 11}, {-11, 50, -11}, evo::VanillaBlock::Stone);
+    world.fill_blocks_hollow({50, 50, 50}, {40, 40, 40}, evo::VanillaBlock::OakLog, evo::VanillaBlock::Podzol);
+    world.set_block_at({1, 2, 3}, evo::Block("minecraft:oak_stairs", evo::BlockStates::from_string("facing=east,half=top")));
+    world.set_block_at({7, 8, 9}, evo::Block("chest", evo::BlockStates::from_string("facing=west"), "{Lock:\"x\"}"));
+    world.set_block_descriptor_at({3, 70, 3}, evo::BlockDescriptor::create_marker(evo::World::marker_index_from_color({255, 255, 0})));
+    // More blocks than fit in 4 bits per index, in one section.
+    for(int i = 0; i < 40; i++)
+        world.set_block_at({-20 + i, -30, 7}, evo::Block("minecraft:test_block_" + std::to_string(i)));
+    // Another region, partly below the world, and blocks above and below it (which
+    // must not reach the heightmap either).
+    world.fill_blocks_at({-600, -70, 700}, {-595, -60, 705}, evo::VanillaBlock::Stone);
+    world.set_block_at({10, 460, 10}, evo::VanillaBlock::Stone);
+    world.set_block_at({2, -100, 2}, evo::VanillaBlock::Stone);
+
+    evo::AnvilWriter::Options options;
+    options.directory = directory;
+    options.min_y = MIN_Y;
+    options.height = HEIGHT;
+    evo::AnvilWriter writer(options);
+    bool success = writer.write(world);
+    if(!success)
+        std::cout << "Write: FAIL" << std::endl;
+    if(writer.statistics().skipped_sections == 0)
+    {
+        std::cout << "Skipped sections: FAIL (none)" << std::endl;
+        success = false;
+    }
+    if(writer.statistics().blocks_without_nbt != 1)
+    {
+        std::cout << "Blocks without NBT: FAIL (" << writer.statistics().blocks_without_nbt << ")" << std::endl;
+        success = false;
+    }
+
+    std::map<Position, std::string> blocks;
+    int errors = decode_regions(directory, blocks);
+    std::map<Position, std::string> expected;
+    for(auto& [chunk_position, chunk]: world.chunks())
+    {
+        for(int x = 0; x < evo::Chunk::SIZE; x++)
+        {
+            for(int y = 0; y < evo::Chunk::SIZE; y++)
+            {
+                for(int z = 0; z < evo::Chunk::SIZE; z++)
+                {
+                    auto position = evo::World::block_from_chunk_position_and_offset(chunk_position, Vector<unsigned>(x, y, z));
+                    auto block = expected_at(world, position);
+                    if(block != "(none)")
+                        expected[key_of(position)] = block;
+                }
+            }
+        }
+    }
+    for(auto& [position, block]: expected)
+    {
+        auto it = blocks.find(position);
+        auto actual = it == blocks.end() ? "(none)" : it->second;
+        if(actual != block && errors++ < 10)
+            std::cout << "At " << to_string(position) << ": expected " << block << ", got " << actual << std::endl;
+    }
+    for(auto& [position, block]: blocks)
+    {
+        if(!expected.contains(position) && errors++ < 10)
+            std::cout << "At " << to_string(position) << ": expected (none), got " << block << std::endl;
+    }
+    std::cout << "Blocks: " << (errors == 0 ? "PASS" : "FAIL") << std::endl;
+    success = success && errors == 0;
+
+    evo::World copy;
+    evo::AnvilReader reader(directory, {.skip_air = true});
+    if(!reader.read_box({-640, MIN_Y, -64}, {63, MIN_Y + HEIGHT - 1, 735}, copy))
+    {
+        std::cout << "Read: FAIL" << std::endl;
+        success = false;
+    }
+    errors = 0;
+    std::map<Position, std::string> read_blocks;
+    for(auto& [chunk_position, chunk]: copy.chunks())
+    {
+        for(int x = 0; x < evo::Chunk::SIZE; x++)
+        {
+            for(int y = 0; y < evo::Chunk::SIZE; y++)
+            {
+                for(int z = 0; z < evo::Chunk::SIZE; z++)
+                {
+                    auto position = evo::World::block_from_chunk_position_and_offset(chunk_position, Vector<unsigned>(x, y, z));
+                    auto block = expected_at(copy, position);
+                    if(block != "(none)")
+                        read_blocks[key_of(position)] = block;
+                }
+            }
+        }
+    }
+    if(read_blocks != expected)
+    {
+        for(auto& [position, block]: expected)
+        {
+            auto it = read_blocks.find(position);
+            auto actual = it == read_blocks.end() ? "(none)" : it->second;
+            if(actual != block && errors++ < 10)
+                std::cout << "Read at " << to_string(position) << ": expected " << block << ", got " << actual << std::endl;
+        }
+        errors += read_blocks.size() != expected.size();
+    }
+    std::cout << "AnvilReader: " << (errors == 0 ? "PASS" : "FAIL") << std::endl;
+    success = success && errors == 0;
+
+    std::filesystem::remove_all(directory);
+    std::cout << (success ? "PASS" : "FAIL") << std::endl;
+    return success ? 0 : 1;
+}
@@ -0,0 +1,77 @@
+#include <evogen/BlockHandle.h>
+#include <evogen/VanillaBlock.h>
+#include <evogen/World.h>
+
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Checks that equal blocks are interned to the same handle (also from several
+// threads at once), that handles convert back to the blocks they were made from,
+// and that the world stores blocks set by handle and by Block the same way.
+
+static bool check(std::string_view name, bool result)
+{
+    if(!result)
+        std::cout << name << ": FAIL" << std::endl;
+    return result;
+}
+
+int main()
+{
+    bool success = true;
+
+    evo::BlockStates states;
+    states.set_state("facing", "east");
+    states.set_state("half", "top");
+    evo::Block stairs("minecraft:oak_stairs", states);
+    evo::Block chest("minecraft:chest", {}, "{Lock:\"x\"}");
+
+    evo::BlockHandle handle = stairs;
+    success &= check("Default handle is invalid", !evo::BlockHandle().is_valid());
+    success &= check("Interned handle is valid", handle.is_valid());
+    success &= check("Same block, same handle", evo::BlockHandle(stairs) == handle && evo::BlockHandle::intern(stairs).id() == handle.id());
+    success &= check("Constructed from parts", evo::BlockHandle("minecraft:oak_stairs", states) == handle);
+    success &= check("Different states", evo::BlockHandle("minecraft:oak_stairs") != handle);
+    success &= check("Different NBT", evo::BlockHandle(chest) != evo::BlockHandle("minecraft:chest"));
+    success &= check("Round trip", handle.block() == stairs && evo::BlockHandle(chest).block() == chest);
+    success &= check("Command format", handle.to_command_format() == stairs.to_command_format()
+                                           && evo::BlockHandle(chest).to_command_format() == chest.to_command_format());
+    success &= check("VanillaBlock", evo::BlockHandle(evo::VanillaBlock::Stone) == evo::BlockHandle(evo::Block(evo::VanillaBlock::Stone)));
+
+    // Threads intern the same new blocks concurrently and must agree on every handle.
+    constexpr size_t THREAD_COUNT = 4;
+    constexpr int BLOCK_COUNT = 1000;
+    std::vector<std::vector<evo::BlockHandle>> handles(THREAD_COUNT);
+    std::vector<std::thread> threads;
+    for(size_t thread = 0; thread < THREAD_COUNT; thread++)
+    {
+        threads.emplace_back([&, thread] {
+            for(int i = 0; i < BLOCK_COUNT; i++)
+                handles[thread].emplace_back("minecraft:test_block_" + std::to_string(i));
+        });
+    }
+    for(auto& thread: threads)
+        thread.join();
+    bool threads_agree = true;
+    for(int i = 0; i < BLOCK_COUNT; i++)
+    {
+        for(size_t thread = 0; thread < THREAD_COUNT; thread++)
+            threads_agree = threads_agree && handles[thread][i] == handles[0][i];
+        threads_agree = threads_agree && handles[0][i].block().id() == "minecraft:test_block_" + std::to_string(i);
+    }
+    success &= check("Concurrent interning", threads_agree);
+
+    evo::World world;
+    world.set_block_at({1, 2, 3}, handle);
+    world.set_block_at({4, 5, 6}, stairs);
+    auto first = world.get_block_descriptor_at({1, 2, 3});
+    auto second = world.get_block_descriptor_at({4, 5, 6});
+    auto index = world.index_of(handle);
+    success &= check("World stores handle and Block alike", first && second && *first == *second && index
+                                                                && *first == evo::BlockDescriptor::create_block(*index));
+    success &= check("World index round trip", index && world.block_from_index(*index) == handle);
+
+    std::cout << (success ? "PASS" : "FAIL") << std::endl;
+    return success ? 0 : 1;
+}
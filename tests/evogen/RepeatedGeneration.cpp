@@ -0,0 +1,55 @@
+#include <evogen/Generator.h>
+#include <evogen/VanillaBlock.h>
+#include <evogen/World.h>
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+// Generates the same world repeatedly and from several threads at once, and checks
+// that every pass produces the same commands.
+
+static std::string generate(evo::World const& world)
+{
+    evo::Generator generator;
+    std::ostringstream stream;
+    generator.stream_from_world(world, stream);
+    return stream.str();
+}
+
+int main()
+{
+    evo::World world;
+    world.set_marker(evo::World::marker_index_from_color({255, 255, 0}), {"minecraft:yellow_wool"});
+    world.fill_blocks_at({11, 11, 11}, {-11, 50, -11}, evo::VanillaBlock::Stone);
+    world.fill_blocks_hollow({50, 50, 50}, {40, 40, 40}, evo::VanillaBlock::OakLog, evo::VanillaBlock::Podzol);
+    world.fill_ball({-25, 20, -25}, 6, evo::VanillaBlock::Cobblestone);
+    world.set_block_descriptor_at({3, 70, 3}, evo::BlockDescriptor::create_marker(evo::World::marker_index_from_color({255, 255, 0})));
+
+    auto expected = generate(world);
+    bool success = !expected.empty();
+    if(generate(world) != expected)
+    {
+        std::cout << "Second pass: FAIL" << std::endl;
+        success = false;
+    }
+
+    constexpr size_t THREAD_COUNT = 4;
+    std::vector<std::string> outputs(THREAD_COUNT);
+    std::vector<std::thread> threads;
+    for(size_t index = 0; index < THREAD_COUNT; index++)
+        threads.emplace_back([&, index] { outputs[index] = generate(world); });
+    for(auto& thread: threads)
+        thread.join();
+    for(size_t index = 0; index < THREAD_COUNT; index++)
+    {
+        if(outputs[index] != expected)
+        {
+            std::cout << "Concurrent pass " << index << ": FAIL" << std::endl;
+            success = false;
+        }
+    }
+    std::cout << (success ? "PASS" : "FAIL") << std::endl;
+    return success ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+#include <evogen/VanillaBlock.h>
+#include <evogen/World.h>
+
+#include <filesystem>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Saves a world to a snapshot, loads it back, modifies it and saves it again
+// incrementally (appending to the same file), and checks that every load matches
+// the world that was saved.
+
+using evo::Vector;
+
+static std::string describe(evo::World const& world, Vector<int> const& position)
+{
+    auto descriptor = world.get_block_descriptor_at(position);
+    if(!descriptor)
+        return "(none)";
+    std::optional<evo::BlockHandle> block;
+    if(descriptor->kind == evo::BlockDescriptor::Block)
+        block = world.block_from_index(descriptor->arg);
+    else if(descriptor->kind == evo::BlockDescriptor::Marker)
+        block = world.block_from_marker_index(descriptor->arg);
+    return std::to_string(descriptor->kind) + ":" + (block ? block->to_command_format() : "");
+}
+
+static bool check_world(std::string const& name, evo::World const& expected, evo::World const& actual)
+{
+    if(actual.chunk_count() != expected.chunk_count())
+    {
+        std::cout << name << ": FAIL (" << actual.chunk_count() << " chunks, expected " << expected.chunk_count() << ")" << std::endl;
+        return false;
+    }
+
+    int errors = 0;
+    for(auto& [chunk_position, chunk]: expected.chunks())
+    {
+        for(int x = 0; x < evo::Chunk::SIZE; x++)
+        {
+            for(int y = 0; y < evo::Chunk::SIZE; y++)
+            {
+                for(int z = 0; z < evo::Chunk::SIZE; z++)
+                {
+                    auto position = evo::World::block_from_chunk_position_and_offset(chunk_position, Vector<unsigned>(x, y, z));
+                    auto expected_block = describe(expected, position);
+                    auto actual_block = describe(actual, position);
+                    if(actual_block != expected_block && errors++ < 10)
+                        std::cout << name << ": at " << position.to_string() << ": expected " << expected_block << ", got " << actual_block << std::endl;
+                }
+            }
+        }
+    }
+    std::cout << name << ": " << (errors == 0 ? "PASS" : "FAIL") << std::endl;
+    return errors == 0;
+}
+
+int main()
+{
+    auto path = (std::filesystem::temp_directory_path() / "evogen-SnapshotRoundTrip.evs").string();
+    auto compacted_path = (std::filesystem::temp_directory_path() / "evogen-SnapshotRoundTrip-compacted.evs").string();
+
+    evo::World world;
+    world.set_marker(evo::World::marker_index_from_color({255, 255, 0}), {"minecraft:yellow_wool"});
+    world.fill_blocks_at({11, 11, 11}, {-11, 50, -11}, evo::VanillaBlock::Stone);
+    world.fill_blocks_hollow({50, 50, 50}, {40, 40, 40}, evo::VanillaBlock::OakLog, evo::VanillaBlock::Podzol);
+    world.fill_ball({-25, 20, -25}, 6, evo::VanillaBlock::Cobblestone);
+    world.set_block_at({7, 8, 9}, evo::Block("chest", evo::BlockStates::from_string("facing=west")));
+    world.set_block_descriptor_at({3, 70, 3}, evo::BlockDescriptor::create_marker(evo::World::marker_index_from_color({255, 255, 0})));
+
+    bool success = true;
+    auto fail = [&](std::string const& message) {
+        std::cout << message << ": FAIL" << std::endl;
+        success = false;
+    };
+
+    if(!world.save_snapshot(path))
+        fail("Save");
+
+    evo::World loaded;
+    if(!loaded.load_snapshot(path))
+        fail("Load");
+
+    // Chunks are loaded on first access, from many threads at once here.
+    {
+        constexpr size_t THREAD_COUNT = 4;
+        std::vector<std::string> blocks(THREAD_COUNT);
+        std::vector<std::thread> threads;
+        for(size_t index = 0; index < THREAD_COUNT; index++)
+            threads.emplace_back([&, index] { blocks[index] = describe(loaded, {7, 8, 9}) + describe(loaded, {45, 50, 45}); });
+        for(auto& thread: threads)
+            thread.join();
+        for(auto& block: blocks)
+        {
+            if(block != blocks[0] || block != describe(world, {7, 8, 9}) + describe(world, {45, 50, 45}))
+                fail("Concurrent load");
+        }
+    }
+    success &= check_world("Loaded", world, loaded);
+
+    // Modifies a loaded chunk, adds a chunk and a block that weren't in the file, and
+    // appends them to it.
+    loaded.set_block_at({0, 0, 0}, evo::VanillaBlock::Dirt);
+    loaded.fill_blocks_at({200, 200, 200}, {210, 205, 240}, evo::Block("minecraft:red_wool"));
+    auto size_before = std::filesystem::file_size(path);
+    if(!loaded.save_snapshot(path))
+        fail("Incremental save");
+    if(std::filesystem::file_size(path) <= size_before)
+        fail("Incremental save (file didn't grow)");
+
+    evo::World reloaded;
+    if(!reloaded.load_snapshot(path))
+        fail("Reload");
+    success &= check_world("Reloaded", loaded, reloaded);
+
+    // Saving a partly loaded world keeps the chunks that weren't accessed.
+    reloaded.set_block_at({-25, 20, -25}, evo::VanillaBlock::Air);
+    if(!reloaded.save_snapshot(path))
+        fail("Second incremental save");
+    if(!reloaded.save_snapshot(compacted_path))
+        fail("Compacting save");
+    evo::World appended;
+    evo::World compacted;
+    if(!appended.load_snapshot(path) || !compacted.load_snapshot(compacted_path))
+        fail("Second reload");
+    success &= check_world("Appended twice", reloaded, appended);
+    success &= check_world("Compacted", reloaded, compacted);
+    if(std::filesystem::file_size(compacted_path) >= std::filesystem::file_size(path))
+        fail("Compacting save (file didn't shrink)");
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(compacted_path);
+    std::cout << (success ? "PASS" : "FAIL") << std::endl;
+    return success ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+#include <evogen/Structure.h>
+
+#include <filesystem>
+#include <iostream>
+
+// Loads the same structure saved in all supported formats (fixtures/generate.py)
+// and checks that every block matches the pattern.
+
+using evo::Vector;
+
+static std::string const PALETTE[] = {
+    "minecraft:air",
+    "minecraft:stone",
+    "minecraft:oak_stairs[facing=east,half=top]",
+    "minecraft:glass",
+    "minecraft:oak_log[axis=z]",
+    "minecraft:red_wool",
+};
+static constexpr int PALETTE_SIZE = std::size(PALETTE);
+static Vector<int> const SIZE{13, 3, 11};
+
+static int block_at(int x, int y, int z)
+{
+    return (x * 7 + y * 3 + z * 5 + (x * z) % 3) % PALETTE_SIZE;
+}
+
+static bool check_structure(std::string const& file_name, evo::Structure const& structure)
+{
+    if(structure.size() != SIZE)
+    {
+        std::cout << file_name << ": FAIL (size " << structure.size().to_string() << ")" << std::endl;
+        return false;
+    }
+
+    int errors = 0;
+    for(int x = 0; x < SIZE.x; x++)
+    {
+        for(int y = 0; y < SIZE.y; y++)
+        {
+            for(int z = 0; z < SIZE.z; z++)
+            {
+                auto expected = evo::Block::from_string(PALETTE[block_at(x, y, z)]).to_command_format();
+                std::string actual = "(none)";
+                auto descriptor = structure.get_block_descriptor_at({x, y, z});
+                if(descriptor && descriptor->kind == evo::BlockDescriptor::Block)
+                {
+                    if(auto block = structure.block_from_index(descriptor->arg))
+                        actual = block->to_command_format();
+                }
+                if(actual != expected && errors++ < 10)
+                    std::cout << file_name << ": at " << Vector<int>{x, y, z}.to_string() << ": expected " << expected << ", got " << actual << std::endl;
+            }
+        }
+    }
+    std::cout << file_name << ": " << (errors == 0 ? "PASS" : "FAIL") << std::endl;
+    return errors == 0;
+}
+
+static bool check(std::string const& file_name, evo::Structure::Format format)
+{
+    auto path = std::filesystem::path(__FILE__).parent_path() / "fixtures" / file_name;
+    evo::Structure structure;
+    if(!structure.load_from_file(path.string(), format))
+    {
+        std::cout << file_name << ": FAIL (could not load)" << std::endl;
+        return false;
+    }
+    if(!check_structure(file_name, structure))
+        return false;
+
+    // Saved as a template, it must load back the same.
+    auto saved_path = std::filesystem::temp_directory_path() / ("evogen-" + file_name + ".nbt");
+    evo::Structure saved;
+    bool loaded = structure.save_to_file(saved_path.string()) && saved.load_from_file(saved_path.string(), evo::Structure::Format::StructureBlock);
+    std::filesystem::remove(saved_path);
+    if(!loaded)
+    {
+        std::cout << file_name << " (saved): FAIL (could not save or load)" << std::endl;
+        return false;
+    }
+    return check_structure(file_name + " (saved)", saved);
+}
+
+int main()
+{
+    using Format = evo::Structure::Format;
+    bool success = true;
+    success &= check("pattern.nbt", Format::StructureBlock);
+    success &= check("pattern_v2.schem", Format::Schematic);
+    success &= check("pattern_v3.schem", Format::Schematic);
+    success &= check("pattern.litematic", Format::Litematic);
+    return success ? 0 : 1;
+}
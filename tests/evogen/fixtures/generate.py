@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+# Generates the structure fixtures used by StructureFormats.cpp: the same small
+# structure saved as structure block .nbt, Sponge schematic v2 and v3, and Litematica.
+# Keep PALETTE, SIZE and block_at() in sync with StructureFormats.cpp.
+
+import gzip
+import os
+import struct
+
+PALETTE = [
+    "minecraft:air",
+    "minecraft:stone",
+    "minecraft:oak_stairs[facing=east,half=top]",
+    "minecraft:glass",
+    "minecraft:oak_log[axis=z]",
+    "minecraft:red_wool",
+]
+SIZE = (13, 3, 11)
+
+
+def block_at(x, y, z):
+    return (x * 7 + y * 3 + z * 5 + (x * z) % 3) % len(PALETTE)
+
+
+def string(value):
+    data = value.encode()
+    return struct.pack(">H", len(data)) + data
+
+
+def tag(type, name, payload):
+    return bytes([type]) + string(name) + payload
+
+
+def compound(*fields):
+    return b"".join(fields) + b"\0"
+
+
+def list_of(type, items):
+    return bytes([type]) + struct.pack(">i", len(items)) + b"".join(items)
+
+
+def byte_(name, value): return tag(1, name, struct.pack(">b", value))
+def short(name, value): return tag(2, name, struct.pack(">h", value))
+def int_(name, value): return tag(3, name, struct.pack(">i", value))
+def str_(name, value): return tag(8, name, string(value))
+def comp(name, *fields): return tag(10, name, compound(*fields))
+def int_list(name, values): return tag(9, name, list_of(3, [struct.pack(">i", v) for v in values]))
+def xyz(name, x, y, z): return comp(name, int_("x", x), int_("y", y), int_("z", z))
+
+
+def split_block(block):
+    if "[" not in block:
+        return block, []
+    name, states = block[:-1].split("[")
+    return name, [state.split("=") for state in states.split(",")]
+
+
+def block_state_compound(block):
+    name, states = split_block(block)
+    fields = [str_("Name", name)]
+    if states:
+        fields.append(comp("Properties", *[str_(key, value) for key, value in states]))
+    return compound(*fields)
+
+
+def positions():
+    # X fastest, then Z, then Y, like in schematics.
+    for y in range(SIZE[1]):
+        for z in range(SIZE[2]):
+            for x in range(SIZE[0]):
+                yield x, y, z
+
+
+def varints(values):
+    result = bytearray()
+    for value in values:
+        while value >= 0x80:
+            result.append(value & 0x7f | 0x80)
+            value >>= 7
+        result.append(value)
+    return bytes(result)
+
+
+def structure_block():
+    blocks = [compound(int_list("pos", p), int_("state", block_at(*p))) for p in positions()]
+    return comp("",
+        int_("DataVersion", 2586),
+        int_list("size", SIZE),
+        tag(9, "palette", list_of(10, [block_state_compound(b) for b in PALETTE])),
+        tag(9, "blocks", list_of(10, blocks)),
+        tag(9, "entities", list_of(10, [])))
+
+
+# Schematic palettes are shuffled (with a large index, so that varints take 2 bytes)
+# to check that they are mapped by their values.
+SCHEMATIC_INDICES = [3, 0, 200, 1, 5, 2]
+
+
+def schematic_blocks():
+    palette = comp("Palette", *[int_(block, SCHEMATIC_INDICES[i]) for i, block in enumerate(PALETTE)])
+    data = varints(SCHEMATIC_INDICES[block_at(*p)] for p in positions())
+    return palette, tag(7, "BlockData", struct.pack(">i", len(data)) + data)
+
+
+def schematic_v2():
+    palette, block_data = schematic_blocks()
+    return comp("Schematic",
+        int_("Version", 2),
+        int_("DataVersion", 2586),
+        short("Width", SIZE[0]), short("Height", SIZE[1]), short("Length", SIZE[2]),
+        int_("PaletteMax", max(SCHEMATIC_INDICES) + 1),
+        block_data,
+        palette)
+
+
+def schematic_v3():
+    palette, block_data = schematic_blocks()
+    data = tag(7, "Data", block_data[len(string("BlockData")) + 1:])
+    return comp("",
+        comp("Schematic",
+            int_("Version", 3),
+            int_("DataVersion", 3465),
+            short("Width", SIZE[0]), short("Height", SIZE[1]), short("Length", SIZE[2]),
+            comp("Blocks", data, palette, tag(9, "BlockEntities", list_of(10, [])))))
+
+
+def litematic():
+    bits = max(2, (len(PALETTE) - 1).bit_length())
+    packed = 0
+    for index, p in enumerate(positions()):
+        packed |= block_at(*p) << (index * bits)
+    total_bits = SIZE[0] * SIZE[1] * SIZE[2] * bits
+    longs = [(packed >> (64 * i)) & (2 ** 64 - 1) for i in range((total_bits + 63) // 64)]
+    # Negative size: the region extends towards negative X/Z from its position.
+    position = (SIZE[0] - 1 + 4, 0, SIZE[2] - 1 - 2)
+    region = comp("Main",
+        xyz("Position", *position),
+        xyz("Size", -SIZE[0], SIZE[1], -SIZE[2]),
+        tag(9, "BlockStatePalette", list_of(10, [block_state_compound(b) for b in PALETTE])),
+        tag(12, "BlockStates", struct.pack(">i", len(longs)) + b"".join(struct.pack(">Q", v) for v in longs)),
+        tag(9, "TileEntities", list_of(10, [])))
+    return comp("",
+        int_("Version", 6),
+        comp("Metadata", str_("Name", "fixture"), xyz("EnclosingSize", *SIZE)),
+        comp("Regions", region))
+
+
+def save(name, data):
+    with open(os.path.join(os.path.dirname(os.path.abspath(__file__)), name), "wb") as file:
+        # Fixed mtime, so that the output is reproducible.
+        file.write(gzip.compress(data, mtime=0))
+
+
+save("pattern.nbt", structure_block())
+save("pattern_v2.schem", schematic_v2())
+save("pattern_v3.schem", schematic_v3())
+save("pattern.litematic", litematic())